@@ -0,0 +1,205 @@
+/*
+ * histheader.c -- Benchmark of the history record header parser
+ *
+ * Compares parse_histo_header() (histofmt.c) with the previous code path
+ * of hlog_reader_read(), copied below: header checks, from_iso8601() and
+ * atoi().  Both parsers are run on the same records, and the results are
+ * checked against each other.  The benchmark runs in the UTC time zone,
+ * since from_iso8601() gets the dates of the other DST period wrong.
+ *
+ * Build it from the mcabber/ directory of a configured source tree:
+ *   gcc -O2 -I. -Imcabber `pkg-config --cflags glib-2.0` \
+ *     -o histheader-bench contrib/benchmarks/histheader.c \
+ *     mcabber/histofmt.c `pkg-config --libs glib-2.0`
+ *
+ * Usage: histheader-bench [records [rounds]]
+ * The defaults are 1000000 records, parsed 10 times.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "histofmt.h"
+
+//  old_from_iso8601(timestamp, utc)
+// from_iso8601() from utils.c, for the "yyyymmddThh:mm:ssZ" format.
+static time_t old_from_iso8601(const char *timestamp, int utc)
+{
+  struct tm t;
+  time_t retval = 0;
+  char buf[32];
+  char *c;
+  int tzoff = 0;
+  int tmpyear;
+
+  time(&retval);
+  localtime_r(&retval, &t);
+
+  t.tm_hour = t.tm_min = t.tm_sec = 0;
+
+  snprintf(buf, sizeof(buf), "%s", timestamp);
+  c = buf;
+
+  if (!sscanf(c, "%04d", &tmpyear)) return 0;
+  t.tm_year = tmpyear - 1900;
+  c += 4;
+  if (!sscanf(c, "%02d", &t.tm_mon)) return 0;
+  t.tm_mon -= 1;
+  c += 2;
+  if (!sscanf(c, "%02d", &t.tm_mday)) return 0;
+  c += 2;
+  if (*c == 'T') {
+    c++;
+    if (sscanf(c, "%02d:%02d:%02d", &t.tm_hour, &t.tm_min, &t.tm_sec) == 3 &&
+        utc) {
+#ifdef HAVE_TM_GMTOFF
+      tzoff += t.tm_gmtoff;
+#else
+#  ifdef HAVE_TIMEZONE
+      tzset();
+      tzoff -= timezone;
+#  endif
+#endif
+    }
+  }
+
+  t.tm_isdst = -1;
+  retval = mktime(&t);
+  return retval + tzoff;
+}
+
+//  old_parse_header(data, &type, &timestamp, &nlines)
+// The header parsing of hlog_reader_read() before parse_histo_header().
+// data is modified, like the record buffer was.
+static guint old_parse_header(char *data, guchar *p_type,
+                              time_t *p_timestamp, guint *p_nlines)
+{
+  guint dataoffset = 25;
+  guchar type = data[0];
+
+  if ((type != 'M' && type != 'S') ||
+      ((data[11] != 'T') || (data[20] != 'Z') ||
+       (data[21] != ' ') ||
+       (data[25] != ' ' && data[26] != ' ')))
+    return 0;
+  if (data[25] != ' ') dataoffset = 26;
+  data[21] = data[dataoffset] = 0;
+  *p_type = type;
+  *p_timestamp = old_from_iso8601(&data[3], 1);
+  *p_nlines = (guint) atoi(&data[22]);
+  return dataoffset;
+}
+
+static double elapsed(GTimer *timer, const char *name, guint count)
+{
+  double t = g_timer_elapsed(timer, NULL);
+
+  printf("%-26s %7.3f s  %12.0f records/s\n", name, t, count / t);
+  return t;
+}
+
+int main(int argc, char **argv)
+{
+  guint nrecords = 1000000, rounds = 10;
+  guint i, r, len, errors = 0;
+  char **records, **copies;
+  time_t *timestamps;
+  GTimer *timer;
+  double told, tnew;
+  guchar type;
+  guint nlines;
+  time_t ts;
+  long sum = 0;
+
+  if (argc > 1)
+    nrecords = strtoul(argv[1], NULL, 10);
+  if (argc > 2)
+    rounds = strtoul(argv[2], NULL, 10);
+  if (!nrecords || !rounds) {
+    fprintf(stderr, "Usage: %s [records [rounds]]\n", argv[0]);
+    return 2;
+  }
+
+  setenv("TZ", "UTC", 1);
+  tzset();
+
+  // Records spread over 20 years from 2005, with a few multi-line ones.
+  records = g_new(char *, nrecords);
+  copies = g_new(char *, nrecords);
+  timestamps = g_new(time_t, nrecords);
+  for (i = 0; i < nrecords; i++) {
+    time_t t = 1104537600 + (time_t)i * (631152000 / nrecords) + i % 3600;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    records[i] = g_strdup_printf("M%c %04d%02d%02dT%02d:%02d:%02dZ %03u "
+                                 "Message number %u",
+                                 i % 2 ? 'R' : 'S', tm.tm_year + 1900,
+                                 tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+                                 tm.tm_min, tm.tm_sec, i % 7 ? 0 : i % 5, i);
+    copies[i] = g_strdup(records[i]);
+    timestamps[i] = t;
+  }
+  printf("%u records, %u rounds\n", nrecords, rounds);
+
+  timer = g_timer_new();
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < nrecords; i++) {
+      // The old parser modifies the record, so it works on a copy
+      memcpy(copies[i], records[i], 27);
+      if (!old_parse_header(copies[i], &type, &ts, &nlines))
+        errors++;
+      sum += ts + nlines;
+    }
+  }
+  told = elapsed(timer, "from_iso8601() + atoi()", nrecords * rounds);
+
+  g_timer_start(timer);
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < nrecords; i++) {
+      len = strlen(records[i]);
+      if (!parse_histo_header(records[i], len, &type, &ts, &nlines))
+        errors++;
+      sum -= ts + nlines;
+    }
+  }
+  tnew = elapsed(timer, "parse_histo_header()", nrecords * rounds);
+  printf("Speedup: x%.1f\n", told / tnew);
+
+  // Check the results
+  for (i = 0; i < nrecords; i++) {
+    time_t oldts;
+    guint oldnlines;
+    guint off;
+
+    memcpy(copies[i], records[i], 27);
+    off = old_parse_header(copies[i], &type, &oldts, &oldnlines);
+    if (off != parse_histo_header(records[i], strlen(records[i]), &type,
+                                  &ts, &nlines) ||
+        ts != oldts || ts != timestamps[i] || nlines != oldnlines)
+      errors++;
+  }
+  if (errors || sum) {
+    printf("ERROR: %u records parsed differently\n", errors);
+    return 1;
+  }
+  printf("Results checked\n");
+
+  g_timer_destroy(timer);
+  for (i = 0; i < nrecords; i++) {
+    g_free(records[i]);
+    g_free(copies[i]);
+  }
+  g_free(records);
+  g_free(copies);
+  g_free(timestamps);
+  return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * rewrap.c     -- Benchmark of the buffer rewrap (hbuf.c)
+ *
+ * Compares the time needed to rewrap many buffers sequentially with
+ * hbuf_rebuild(), and with the background rewrap used by the screen code:
+ * the lines are copied by hbuf_wrap_prepare(), wrapped by a GThreadPool
+ * with hbuf_wrap_compute(), and hbuf_wrap_apply() splits the lines in the
+ * main thread.  A few lines are added to each buffer while its job runs,
+ * and the result is checked against hbuf_rebuild().
+ *
+ * Build it from the mcabber/ directory of a configured source tree:
+ *   gcc -O2 -I. -Imcabber `pkg-config --cflags glib-2.0 gthread-2.0` \
+ *     -o rewrap-bench contrib/benchmarks/rewrap.c mcabber/hbuf.c \
+ *     mcabber/utf8.c `pkg-config --libs glib-2.0 gthread-2.0`
+ *
+ * Usage: rewrap-bench [buffers [lines [threads]]]
+ * The defaults are 500 buffers of 50000 lines (about 16 GB of memory), and
+ * one thread per processor.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "hbuf.h"
+#include "logprint.h"
+
+#define WIDTH1 80
+#define WIDTH2 113
+
+// Used by hbuf.c (defined by screen.c in mcabber)
+int utf8_mode;
+
+void scr_LogPrint(unsigned int flag, const char *fmt, ...)
+{
+}
+
+guint scr_getprefixwidth(void)
+{
+  return 0;
+}
+
+size_t scr_line_prefix(hbb_line *line, char *prefix, guint preflen)
+{
+  *prefix = 0;
+  return 0;
+}
+
+typedef struct {
+  GList *hbuf;
+  hbuf_wrap_job *job;
+} buffer;
+
+static GAsyncQueue *done_queue;
+
+static void worker(gpointer data, gpointer user_data)
+{
+  buffer *buf = data;
+  hbuf_wrap_compute(buf->job);
+  g_async_queue_push(done_queue, buf);
+}
+
+static double now(void)
+{
+  return g_get_monotonic_time() / 1e6;
+}
+
+// A message of 1 to 60 words (some of them with accented characters)
+static void make_message(char *text, guint seed)
+{
+  static const char *words[] = { "hello", "world", "caf\xc3\xa9", "a",
+    "mcabber", "xmpp", "\xc3\xa9t\xc3\xa9", "buffer", "rewrap", "of",
+    "the", "verylongwordwithoutanyspacesinsideit", "ok", "line" };
+  guint nwords = 1 + seed % 60;
+  char *p = text;
+  guint i;
+
+  for (i = 0; i < nwords; i++) {
+    const char *w = words[(seed / 7 + i * 5) % G_N_ELEMENTS(words)];
+    if (i)
+      *p++ = ' ';
+    strcpy(p, w);
+    p += strlen(w);
+  }
+  *p = 0;
+}
+
+static void add_lines(buffer *buf, guint from, guint count)
+{
+  char text[1024];
+  guint i;
+
+  for (i = from; i < from + count; i++) {
+    make_message(text, i * 2654435761U);
+    hbuf_add_line(&buf->hbuf, text, 1000000000 + i, 0, WIDTH1, 0, 0, NULL);
+  }
+}
+
+// Checksum of the lines of the buffer (text and flags)
+static guint64 checksum(buffer *buf, guint *nlines)
+{
+  hbb_line_view views[1024];
+  guint64 sum = 0;
+  GList *elt = hbuf_get_nth(buf->hbuf, 0);
+  guint n, i, j;
+
+  *nlines = 0;
+  while (elt && (n = hbuf_get_line_views(elt, views, 1024))) {
+    for (i = 0; i < n; i++) {
+      sum = sum * 31 + views[i].line.flags + views[i].len;
+      for (j = 0; j < views[i].len; j++)
+        sum = sum * 131 + (guchar)views[i].line.text[j];
+    }
+    *nlines += n;
+    elt = hbuf_get_nth(buf->hbuf, *nlines);
+  }
+  return sum;
+}
+
+int main(int argc, char **argv)
+{
+  guint nbuffers = argc > 1 ? atoi(argv[1]) : 500;
+  guint nlines = argc > 2 ? atoi(argv[2]) : 50000;
+  long nthreads = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+  buffer *buffers;
+  GThreadPool *pool;
+  guint64 *sums;
+  guint i, submitted, done, maxjobs, errors = 0;
+  double t, t2, seq, par, busy = 0;
+
+  setlocale(LC_ALL, "C.UTF-8");
+  utf8_mode = 1;
+  if (nthreads < 1)
+    nthreads = 1;
+
+  buffers = g_new0(buffer, nbuffers);
+  sums = g_new(guint64, nbuffers);
+  printf("Filling %u buffers with %u messages...\n", nbuffers, nlines);
+  for (i = 0; i < nbuffers; i++)
+    add_lines(&buffers[i], 0, nlines);
+
+  t = now();
+  for (i = 0; i < nbuffers; i++)
+    hbuf_rebuild(&buffers[i].hbuf, WIDTH2);
+  seq = now() - t;
+  for (i = 0; i < nbuffers; i++)
+    hbuf_rebuild(&buffers[i].hbuf, WIDTH1);
+
+  // At most 2 jobs per thread, as the screen code does (each job holds a
+  // copy of the text of its buffer)
+  done_queue = g_async_queue_new();
+  pool = g_thread_pool_new(worker, NULL, nthreads, FALSE, NULL);
+  maxjobs = 2 * nthreads;
+  t = now();
+  for (submitted = done = 0; done < nbuffers; ) {
+    buffer *buf;
+    if (submitted < nbuffers && submitted - done < maxjobs) {
+      t2 = now();
+      buf = &buffers[submitted++];
+      buf->job = hbuf_wrap_prepare(buf->hbuf, WIDTH2);
+      g_thread_pool_push(pool, buf, NULL);
+      busy += now() - t2;
+      continue;
+    }
+    buf = g_async_queue_pop(done_queue);
+    t2 = now();
+    // New messages while the job was running
+    add_lines(buf, nlines, 3);
+    if (!hbuf_wrap_apply(&buf->hbuf, buf->job))
+      errors++;
+    hbuf_wrap_job_free(buf->job);
+    busy += now() - t2;
+    done++;
+  }
+  par = now() - t;
+  g_thread_pool_free(pool, FALSE, TRUE);
+
+  printf("Sequential rewrap: %.2f s\n", seq);
+  printf("Thread pool rewrap (%ld threads): %.2f s (x%.2f), main thread "
+         "busy %.2f s\n", nthreads, par, seq / par, busy);
+
+  // The result must be the same as with hbuf_rebuild()
+  for (i = 0; i < nbuffers; i++) {
+    guint n1, n2;
+    sums[i] = checksum(&buffers[i], &n1);
+    hbuf_rebuild(&buffers[i].hbuf, WIDTH1);
+    hbuf_rebuild(&buffers[i].hbuf, WIDTH2);
+    if (checksum(&buffers[i], &n2) != sums[i] || n1 != n2)
+      errors++;
+    hbuf_free(&buffers[i].hbuf);
+  }
+  g_free(sums);
+  g_free(buffers);
+  if (errors) {
+    printf("%u buffer(s) differ from hbuf_rebuild()!\n", errors);
+    return 1;
+  }
+  printf("Results checked against hbuf_rebuild()\n");
+  return 0;
+}
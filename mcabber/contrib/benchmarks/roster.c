@@ -0,0 +1,192 @@
+/*
+ * roster.c     -- Benchmark of the roster loading (roster.c)
+ *
+ * Loads generated rosters item by item with roster_add_user(), the way
+ * handle_iq_roster() does, once with the incremental path used for roster
+ * pushes and once between roster_bulk_begin() and roster_bulk_end(), as
+ * cb_roster() does for the initial roster.  Each roster is loaded into an
+ * empty roster (first connection) and then again over the existing items
+ * (reconnection).  The resulting buddylists are checked against each other.
+ *
+ * Build it from the mcabber/ directory of a configured source tree:
+ *   gcc -O2 -I. -Imcabber `pkg-config --cflags glib-2.0 loudmouth-1.0` \
+ *     -o roster-bench contrib/benchmarks/roster.c mcabber/roster.c \
+ *     `pkg-config --libs glib-2.0`
+ *
+ * Usage: roster-bench [items...]
+ * The default sizes are 1000, 10000 and 50000 items.
+ * The incremental reconnection rebuilds the buddylist for every item, so it
+ * is quadratic: it is only run for rosters of 10000 items or less.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "roster.h"
+
+#define NGROUPS 20
+#define MAX_INCREMENTAL_RELOAD 10000
+
+// Used by roster.c (defined by utils.c and hooks.c in mcabber)
+const char *LocaleCharSet = "UTF-8";
+
+void hk_unread_list_change(guint unread_count, guint attention_count,
+                           guint muc_unread, guint muc_attention)
+{
+}
+
+typedef struct {
+  char *jid;
+  char *name;
+  char *group;
+} item;
+
+//  make_roster(nitems)
+// Create nitems roster items, in no particular order, in NGROUPS groups.
+// One item out of NGROUPS has no group.
+static item *make_roster(guint nitems)
+{
+  item *items = g_new0(item, nitems);
+  guint32 seed = 12345;
+  guint i;
+
+  for (i = 0; i < nitems; i++) {
+    seed = seed * 1103515245 + 12345;
+    items[i].jid = g_strdup_printf("user%u@example.org", i);
+    items[i].name = g_strdup_printf("Contact %08x", seed);
+    if (seed % (NGROUPS + 1))
+      items[i].group = g_strdup_printf("Group %u", seed % (NGROUPS + 1));
+  }
+  return items;
+}
+
+static void free_roster(item *items, guint nitems)
+{
+  guint i;
+
+  for (i = 0; i < nitems; i++) {
+    g_free(items[i].jid);
+    g_free(items[i].name);
+    g_free(items[i].group);
+  }
+  g_free(items);
+}
+
+//  load_roster(items, nitems, bulk)
+// Add the items to the roster, and return the elapsed time.
+static double load_roster(item *items, guint nitems, gboolean bulk)
+{
+  GTimer *timer = g_timer_new();
+  double t;
+  guint i;
+
+  if (bulk)
+    roster_bulk_begin();
+  for (i = 0; i < nitems; i++)
+    roster_add_user(items[i].jid, items[i].name, items[i].group,
+                    ROSTER_TYPE_USER, sub_both, 1);
+  // handle_iq_roster() always rebuilds the buddylist at the end
+  buddylist_build();
+  if (bulk)
+    roster_bulk_end();
+
+  t = g_timer_elapsed(timer, NULL);
+  g_timer_destroy(timer);
+  return t;
+}
+
+//  buddylist_dump()
+// Return the names of the buddylist entries, in order.
+static GString *buddylist_dump(void)
+{
+  GString *dump = g_string_new(NULL);
+  GList *node;
+
+  for (node = buddylist; node; node = g_list_next(node)) {
+    const char *name = buddy_getname(BUDDATA(node));
+    g_string_append(dump, name ? name : "");
+    g_string_append_c(dump, '\n');
+  }
+  return dump;
+}
+
+static void print_time(const char *what, double t, guint nitems)
+{
+  printf("  %-26s %8.3f s  %10.0f items/s\n", what, t, nitems / t);
+}
+
+int main(int argc, char **argv)
+{
+  static guint default_sizes[] = { 1000, 10000, 50000 };
+  guint *sizes = default_sizes;
+  guint nsizes = G_N_ELEMENTS(default_sizes);
+  guint n, errors = 0;
+
+  if (argc > 1) {
+    nsizes = argc - 1;
+    sizes = g_new(guint, nsizes);
+    for (n = 0; n < nsizes; n++) {
+      sizes[n] = strtoul(argv[n+1], NULL, 10);
+      if (!sizes[n]) {
+        fprintf(stderr, "Usage: %s [items...]\n", argv[0]);
+        return 2;
+      }
+    }
+  }
+
+  roster_init();
+  // Show all the buddies, so that the buddylists can be compared
+  buddylist_set_hide_offline_buddies(FALSE);
+
+  for (n = 0; n < nsizes; n++) {
+    guint nitems = sizes[n];
+    item *items = make_roster(nitems);
+    GString *ref, *dump;
+    double tinc, tbulk;
+
+    printf("%u items, %u groups:\n", nitems, NGROUPS);
+
+    tinc = load_roster(items, nitems, FALSE);
+    ref = buddylist_dump();
+    print_time("incremental, first load", tinc, nitems);
+    if (nitems <= MAX_INCREMENTAL_RELOAD) {
+      tinc = load_roster(items, nitems, FALSE);
+      print_time("incremental, reload", tinc, nitems);
+    }
+    roster_free();
+
+    tbulk = load_roster(items, nitems, TRUE);
+    dump = buddylist_dump();
+    print_time("bulk, first load", tbulk, nitems);
+    if (!g_string_equal(ref, dump))
+      errors++;
+    g_string_free(dump, TRUE);
+
+    tbulk = load_roster(items, nitems, TRUE);
+    dump = buddylist_dump();
+    print_time("bulk, reload", tbulk, nitems);
+    if (!g_string_equal(ref, dump))
+      errors++;
+    g_string_free(dump, TRUE);
+    roster_free();
+
+    g_string_free(ref, TRUE);
+    free_roster(items, nitems);
+  }
+
+  if (sizes != default_sizes)
+    g_free(sizes);
+  if (errors) {
+    printf("ERROR: the buddylists differ\n");
+    return 1;
+  }
+  printf("Buddylists checked\n");
+  return 0;
+}
@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+# This script is provided under the terms of the GNU General Public License,
+# see the file COPYING in the root mcabber source directory.
+#
+# Split the history files of a mcabber logging directory into monthly
+# segments, for the logging_segments option.
+# The records of the previous months are moved to "<jid>.yyyy-mm.gz" files
+# (or "<jid>.yyyy-mm" with --no-compress), the history file keeps the
+# records of the last month.
+# mcabber must not be running when this script is used.
+
+import gzip
+import os
+import re
+import sys
+
+segment_re = re.compile(r"\.\d{4}-\d{2}(\.gz)?$")
+header_re = re.compile(rb"^[MS]. (\d{4})(\d{2})\d\dT\d\d:\d\d:\d\dZ (\d{3,4}) ")
+
+
+def records(f):
+  """Yield (month, record) tuples; month is None for invalid lines."""
+  lines = iter(f)
+  for line in lines:
+    m = header_re.match(line)
+    if not m:
+      yield None, line
+      continue
+    record = [line]
+    for i in range(int(m.group(3))):
+      try:
+        record.append(next(lines))
+      except StopIteration:
+        break
+    yield (m.group(1).decode(), m.group(2).decode()), b"".join(record)
+
+
+def segment_months(path):
+  """Return the list of the segment months of the file."""
+  months = []
+  with open(path, "rb") as f:
+    for month, record in records(f):
+      # A new segment starts when a record belongs to a later month
+      if month and (not months or month > months[-1]):
+        months.append(month)
+      elif not months:
+        months.append(month or ("0000", "00"))
+  return months
+
+
+def split_file(path, compress):
+  # The file is read twice, so that the records are never kept in memory:
+  # the first pass finds the segments, the second one writes them.
+  months = segment_months(path)
+  if len(months) < 2:
+    return 0
+
+  names = []
+  for month in months[:-1]:
+    name = "%s.%s-%s" % (path, month[0], month[1])
+    if os.path.exists(name) or os.path.exists(name + ".gz"):
+      print("%s already exists, skipping %s" % (name, path))
+      return 0
+    names.append(name + ".gz" if compress else name)
+  names.append(path)
+
+  seg = -1
+  out = None
+  with open(path, "rb") as f:
+    for month, record in records(f):
+      if out is None or (month and seg + 1 < len(months) and
+                         month >= months[seg + 1]):
+        if out:
+          out.close()
+        seg += 1
+        if compress and seg + 1 < len(months):
+          out = gzip.open(names[seg] + ".tmp", "wb")
+        else:
+          out = open(names[seg] + ".tmp", "wb")
+      out.write(record)
+  out.close()
+
+  for name in names:
+    os.rename(name + ".tmp", name)
+  # The index is out of date, mcabber will rebuild it
+  index = os.path.join(os.path.dirname(path), ".index",
+                       os.path.basename(path))
+  if os.path.exists(index):
+    os.unlink(index)
+  return len(months) - 1
+
+
+def main():
+  args = sys.argv[1:]
+  compress = True
+  if args and args[0] == "--no-compress":
+    compress = False
+    args = args[1:]
+  if len(args) != 1:
+    print("usage: %s [--no-compress] histo_dir" % sys.argv[0])
+    sys.exit(1)
+
+  histodir = args[0]
+  for name in sorted(os.listdir(histodir)):
+    path = os.path.join(histodir, name)
+    if (os.path.islink(path) or not os.path.isfile(path) or
+        segment_re.search(name) or name.endswith(".tmp")):
+      continue
+    n = split_file(path, compress)
+    if n:
+      print("%s: %d segment(s) created" % (name, n))
+
+
+if __name__ == "__main__":
+  main()
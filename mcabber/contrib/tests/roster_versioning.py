@@ -0,0 +1,508 @@
+#!/usr/bin/env python3
+# This script is provided under the terms of the GNU General Public License,
+# see the file COPYING in the root mcabber source directory.
+#
+# Stand-in XMPP server for testing the roster cache (roster_cache option)
+# with roster versioning (XEP-0237).
+#
+# The server accepts any account and password (SASL PLAIN or jabber:iq:auth,
+# without TLS), and serves a generated roster.  Each change of the roster
+# makes a new version.  When a roster request carries a known version, only
+# the changes since this version are sent as roster pushes, after an empty
+# result.  Like common servers, the result only carries the version if the
+# request had a ver attribute.
+#
+# Usage:
+#   roster_versioning.py serve [--port PORT] [--items N]
+#       Run the server only.  Use mcabber with "set server = 127.0.0.1",
+#       "set port = PORT", "set tls = 0" and the roster_cache option.
+#       Each roster request is logged with its version.  Type "add",
+#       "rename" or "remove" (and Enter) to change the roster.
+#   roster_versioning.py test MCABBER [--port PORT] [--items N]
+#       Run the given mcabber binary 3 times against the server, in a
+#       temporary home directory, and check the roster requests, the roster
+#       pushes and the cache file.  Exits with status 1 if a check fails.
+
+import argparse
+import base64
+import os
+import pty
+import queue
+import shutil
+import signal
+import socket
+import sys
+import tempfile
+import threading
+import time
+import xml.etree.ElementTree as ET
+from xml.sax.saxutils import escape, quoteattr
+
+NS_CLIENT = "jabber:client"
+NS_STREAM = "http://etherx.jabber.org/streams"
+NS_SASL = "urn:ietf:params:xml:ns:xmpp-sasl"
+NS_BIND = "urn:ietf:params:xml:ns:xmpp-bind"
+NS_SESSION = "urn:ietf:params:xml:ns:xmpp-session"
+NS_AUTH = "jabber:iq:auth"
+NS_ROSTER = "jabber:iq:roster"
+NS_ROSTERVER = "urn:xmpp:features:rosterver"
+NS_STANZAS = "urn:ietf:params:xml:ns:xmpp-stanzas"
+
+DOMAIN = "localhost"
+ROSTER_CACHE_DELAY = 5  # See rostercache.c
+
+
+def log(msg):
+  print("[server] " + msg, flush=True)
+
+
+def item_xml(jid, item):
+  """Return the roster item element; item is None for a removed jid."""
+  if item is None:
+    return "<item jid=%s subscription='remove'/>" % quoteattr(jid)
+  name, group = item
+  xml = "<item jid=%s name=%s subscription='both'>" % (quoteattr(jid),
+                                                       quoteattr(name))
+  if group:
+    xml += "<group>%s</group>" % escape(group)
+  return xml + "</item>"
+
+
+class Roster:
+  """Roster with its versions: version n is the roster after n-1 changes."""
+
+  def __init__(self, nitems):
+    self.lock = threading.Lock()
+    self.items = {}
+    for i in range(nitems):
+      self.items["contact%d@example.org" % i] = ("Contact %d" % i,
+                                                 "Group %d" % (i % 20))
+    self.version = 1
+    self.changes = {}  # version -> jid changed by this version
+    self.serial = nitems
+
+  def change(self, jid, item):
+    """Set (or remove, if item is None) a roster item; return the version."""
+    with self.lock:
+      if item is None:
+        self.items.pop(jid, None)
+      else:
+        self.items[jid] = item
+      self.version += 1
+      self.changes[self.version] = jid
+      return self.version
+
+  def add(self):
+    self.serial += 1
+    jid = "contact%d@example.org" % self.serial
+    return jid, self.change(jid, ("Contact %d" % self.serial, "New"))
+
+  def changes_since(self, ver):
+    """Return the [(version, jid, item)] changes since the version ver,
+    or None if ver is not a known version."""
+    with self.lock:
+      if not ver.isdigit() or not 1 <= int(ver) <= self.version:
+        return None
+      latest = {}
+      for v in range(int(ver) + 1, self.version + 1):
+        latest[self.changes[v]] = v
+      return [(v, jid, self.items.get(jid))
+              for jid, v in sorted(latest.items(), key=lambda x: x[1])]
+
+
+class Session(threading.Thread):
+  """A client connection."""
+
+  def __init__(self, server, sock):
+    threading.Thread.__init__(self, daemon=True)
+    self.server = server
+    self.sock = sock
+    self.send_lock = threading.Lock()
+    self.jid = None
+    self.interested = False  # The client has requested the roster
+    self.bytes_sent = 0
+    self.roster_requests = queue.Queue()
+    self.pushes_acked = queue.Queue()
+    self.pending_pushes = set()
+    self.closed = threading.Event()
+    self.next_id = 0
+
+  def send(self, data):
+    data = data.encode("utf-8")
+    with self.send_lock:
+      try:
+        self.sock.sendall(data)
+        self.bytes_sent += len(data)
+      except OSError:
+        pass
+
+  def new_id(self):
+    self.next_id += 1
+    return "push%d" % self.next_id
+
+  def push(self, version, jid, item):
+    """Send a roster push."""
+    iqid = self.new_id()
+    self.pending_pushes.add(iqid)
+    self.send("<iq type='set' id=%s to=%s><query xmlns='%s' ver='%d'>%s"
+              "</query></iq>" % (quoteattr(iqid), quoteattr(self.jid),
+                                 NS_ROSTER, version, item_xml(jid, item)))
+
+  def open_stream(self, authenticated):
+    self.send("<?xml version='1.0'?><stream:stream xmlns='%s' "
+              "xmlns:stream='%s' id='s%d' from='%s' version='1.0'>"
+              % (NS_CLIENT, NS_STREAM, id(self) % 100000, DOMAIN))
+    if authenticated:
+      self.send("<stream:features><bind xmlns='%s'/><session xmlns='%s'/>"
+                "<ver xmlns='%s'/></stream:features>"
+                % (NS_BIND, NS_SESSION, NS_ROSTERVER))
+    else:
+      self.send("<stream:features><mechanisms xmlns='%s'><mechanism>PLAIN"
+                "</mechanism></mechanisms><auth xmlns="
+                "'http://jabber.org/features/iq-auth'/></stream:features>"
+                % NS_SASL)
+
+  def run(self):
+    try:
+      self.read_stream()
+    except (OSError, ET.ParseError) as e:
+      log("connection error: %s" % e)
+    self.closed.set()
+    with self.server.lock:
+      if self in self.server.sessions:
+        self.server.sessions.remove(self)
+    try:
+      self.sock.close()
+    except OSError:
+      pass
+
+  def read_stream(self):
+    authenticated = False
+    while True:
+      parser = ET.XMLPullParser(events=("start", "end"))
+      depth = 0
+      root = None
+      restart = False
+      while not restart:
+        data = self.sock.recv(65536)
+        if not data:
+          return
+        parser.feed(data)
+        for event, elem in parser.read_events():
+          if event == "start":
+            if depth == 0:
+              root = elem
+              self.open_stream(authenticated)
+            depth += 1
+            continue
+          depth -= 1
+          if depth == 0:
+            self.send("</stream:stream>")
+            return
+          if depth > 1:
+            continue
+          root.remove(elem)
+          if elem.tag == "{%s}auth" % NS_SASL:
+            user = base64.b64decode(elem.text or "").split(b"\0")
+            self.jid = "%s@%s" % (user[1].decode() if len(user) > 1
+                                  else "user", DOMAIN)
+            self.send("<success xmlns='%s'/>" % NS_SASL)
+            authenticated = restart = True
+            break
+          if elem.tag == "{%s}iq" % NS_CLIENT:
+            self.handle_iq(elem)
+
+  def handle_iq(self, iq):
+    iqtype = iq.get("type")
+    iqid = iq.get("id", "")
+    query = iq[0] if len(iq) else None
+    ns = query.tag[1:].split("}")[0] if query is not None else None
+
+    if iqtype in ("result", "error"):
+      if iqid in self.pending_pushes:
+        self.pending_pushes.discard(iqid)
+        self.pushes_acked.put(iqid)
+      return
+
+    if ns == NS_AUTH:
+      if iqtype == "get":
+        self.send("<iq type='result' id=%s><query xmlns='%s'><username/>"
+                  "<password/><resource/></query></iq>"
+                  % (quoteattr(iqid), NS_AUTH))
+        return
+      user = query.findtext("{%s}username" % NS_AUTH) or "user"
+      resource = query.findtext("{%s}resource" % NS_AUTH) or "res"
+      self.jid = "%s@%s/%s" % (user, DOMAIN, resource)
+    elif ns == NS_BIND:
+      resource = query.findtext("{%s}resource" % NS_BIND) or "res"
+      self.jid = "%s/%s" % (self.jid, resource)
+      self.send("<iq type='result' id=%s><bind xmlns='%s'><jid>%s</jid>"
+                "</bind></iq>" % (quoteattr(iqid), NS_BIND,
+                                  escape(self.jid)))
+      return
+    elif ns == NS_ROSTER and iqtype == "get":
+      self.handle_roster_request(iqid, query.get("ver"))
+      return
+    elif ns not in (NS_SESSION, NS_ROSTER):
+      # Unsupported request (disco, version, ping...)
+      self.send("<iq type='error' id=%s><error type='cancel'>"
+                "<service-unavailable xmlns='%s'/></error></iq>"
+                % (quoteattr(iqid), NS_STANZAS))
+      return
+    self.send("<iq type='result' id=%s/>" % quoteattr(iqid))
+
+  def handle_roster_request(self, iqid, ver):
+    roster = self.server.roster
+    changes = roster.changes_since(ver) if ver is not None else None
+    if changes is not None:
+      self.send("<iq type='result' id=%s/>" % quoteattr(iqid))
+      for version, jid, item in changes:
+        self.push(version, jid, item)
+      answer = "empty result and %d push(es)" % len(changes)
+    else:
+      with roster.lock:
+        items = "".join(item_xml(jid, item)
+                        for jid, item in roster.items.items())
+        verattr = " ver='%d'" % roster.version if ver is not None else ""
+        self.send("<iq type='result' id=%s><query xmlns='%s'%s>%s</query>"
+                  "</iq>" % (quoteattr(iqid), NS_ROSTER, verattr, items))
+        answer = "full roster (%d items, %s)" % (
+            len(roster.items), "version %d" % roster.version
+            if ver is not None else "no version")
+    self.interested = True
+    log("roster request from %s, ver=%s: %s" %
+        (self.jid, "(none)" if ver is None else repr(ver), answer))
+    self.roster_requests.put((ver, changes))
+
+
+class Server:
+  def __init__(self, port, nitems):
+    self.roster = Roster(nitems)
+    self.lock = threading.Lock()
+    self.sessions = []
+    self.new_sessions = queue.Queue()
+    self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    self.sock.bind(("127.0.0.1", port))
+    self.sock.listen(5)
+    self.port = self.sock.getsockname()[1]
+    threading.Thread(target=self.accept_loop, daemon=True).start()
+
+  def accept_loop(self):
+    while True:
+      sock, _ = self.sock.accept()
+      session = Session(self, sock)
+      with self.lock:
+        self.sessions.append(session)
+      session.start()
+      self.new_sessions.put(session)
+
+  def change(self, jid, item):
+    """Change the roster and push the change to the connected clients."""
+    version = self.roster.change(jid, item)
+    self.push(version, jid, item)
+    return version
+
+  def add(self):
+    jid, version = self.roster.add()
+    self.push(version, jid, self.roster.items[jid])
+    return jid, version
+
+  def push(self, version, jid, item):
+    with self.lock:
+      sessions = [s for s in self.sessions if s.interested]
+    for session in sessions:
+      session.push(version, jid, item)
+    log("version %d: %s %s, pushed to %d client(s)" %
+        (version, "removed" if item is None else "set", jid, len(sessions)))
+
+
+def serve(args):
+  server = Server(args.port, args.items)
+  log("listening on 127.0.0.1:%d, roster of %d items, version %d" %
+      (server.port, args.items, server.roster.version))
+  for line in sys.stdin:
+    cmd = line.strip()
+    jids = sorted(server.roster.items)
+    if cmd == "add":
+      server.add()
+    elif cmd == "rename" and jids:
+      server.change(jids[0], ("Renamed at %s" % time.strftime("%H:%M:%S"),
+                              server.roster.items[jids[0]][1]))
+    elif cmd == "remove" and jids:
+      server.change(jids[0], None)
+    elif cmd:
+      print("Commands: add, rename, remove")
+
+
+class Failure(Exception):
+  pass
+
+
+def read_cache(path):
+  """Return (version, {jid: (name, group)}) from the cache file."""
+  version, items = None, {}
+  try:
+    with open(path, encoding="utf-8") as f:
+      for line in f:
+        line = line.rstrip("\n")
+        if line.startswith("V "):
+          version = line[2:]
+        elif line.startswith("I "):
+          jid, name, group = line[2:].split(" ", 1)[1].split("\t")
+          items[jid] = (name, group)
+  except FileNotFoundError:
+    pass
+  return version, items
+
+
+class Mcabber:
+  """mcabber running in a pseudo-terminal."""
+
+  def __init__(self, binary, home, rcfile):
+    env = dict(os.environ, HOME=home, TERM="xterm")
+    self.pid, self.fd = pty.fork()
+    if not self.pid:
+      os.execve(binary, [binary, "-f", rcfile], env)
+    # Read the screen output, so that mcabber never blocks on it
+    threading.Thread(target=self.drain, daemon=True).start()
+
+  def drain(self):
+    while True:
+      try:
+        if not os.read(self.fd, 65536):
+          return
+      except OSError:
+        return
+
+  def quit(self):
+    os.write(self.fd, b"/quit\r")
+    for _ in range(100):
+      pid, _ = os.waitpid(self.pid, os.WNOHANG)
+      if pid:
+        return
+      time.sleep(0.1)
+    os.kill(self.pid, signal.SIGKILL)
+    os.waitpid(self.pid, 0)
+    raise Failure("mcabber did not quit")
+
+
+def wait_push_ack(session):
+  try:
+    session.pushes_acked.get(timeout=30)
+  except queue.Empty:
+    raise Failure("roster push not acknowledged")
+
+
+def wait_for(what, check, timeout):
+  end = time.time() + timeout
+  while time.time() < end:
+    if check():
+      return
+    time.sleep(0.2)
+  raise Failure("timeout waiting for " + what)
+
+
+def run_mcabber(args, server, home, rcfile, expected_ver, check):
+  """Run mcabber once, check its roster request and call check(session)."""
+  mcabber = Mcabber(args.mcabber, home, rcfile)
+  try:
+    try:
+      session = server.new_sessions.get(timeout=30)
+    except queue.Empty:
+      raise Failure("mcabber did not connect")
+    try:
+      ver, changes = session.roster_requests.get(timeout=30)
+    except queue.Empty:
+      raise Failure("mcabber did not request the roster")
+    if ver != expected_ver:
+      raise Failure("roster request with ver=%r, expected %r" %
+                    (ver, expected_ver))
+    # The pushes of the delta must be acknowledged
+    for _ in changes or []:
+      wait_push_ack(session)
+    check(session)
+  finally:
+    mcabber.quit()
+  return session
+
+
+def check_cache(cachefile, roster):
+  def matches():
+    version, items = read_cache(cachefile)
+    return version == str(roster.version) and items == roster.items
+  wait_for("the cache file (version %d, %d items)" %
+           (roster.version, len(roster.items)), matches,
+           ROSTER_CACHE_DELAY * 3)
+  # The cache lists the contacts, it must not be readable by others
+  if os.stat(cachefile).st_mode & 0o077:
+    raise Failure("the cache file is readable by other users")
+
+
+def test(args):
+  server = Server(args.port, args.items)
+  roster = server.roster
+  home = tempfile.mkdtemp(prefix="mcabber-rosterver-")
+  cachefile = os.path.join(home, "roster.cache")
+  rcfile = os.path.join(home, "mcabberrc")
+  with open(rcfile, "w") as f:
+    f.write("set jid = tester@%s\nset password = secret\n"
+            "set server = 127.0.0.1\nset port = %d\nset tls = 0\n"
+            "set ssl = 0\nset resource = test\nset roster_cache = %s\n"
+            % (DOMAIN, server.port, cachefile))
+  os.chmod(rcfile, 0o600)
+
+  try:
+    # 1. No cache yet: the full roster is sent, then a push
+    def first_run(session):
+      server.add()
+      wait_push_ack(session)
+      check_cache(cachefile, roster)
+    s1 = run_mcabber(args, server, home, rcfile, "", first_run)
+    print("run 1: full roster and 1 push, %d bytes sent, cache saved" %
+          s1.bytes_sent)
+
+    # 2. The roster changes while mcabber is offline: only the changes are
+    # sent
+    server.change("contact1@example.org", ("Renamed contact", "Other group"))
+    server.change("contact2@example.org", None)
+    s2 = run_mcabber(args, server, home, rcfile, str(roster.version - 2),
+                     lambda session: check_cache(cachefile, roster))
+    print("run 2: empty result and 2 pushes, %d bytes sent, cache updated" %
+          s2.bytes_sent)
+
+    # 3. Nothing has changed
+    s3 = run_mcabber(args, server, home, rcfile, str(roster.version),
+                     lambda session: time.sleep(1))
+    check_cache(cachefile, roster)
+    print("run 3: empty result, %d bytes sent, cache unchanged" %
+          s3.bytes_sent)
+  except Failure as e:
+    print("FAILED: %s" % e)
+    print("(test directory: %s)" % home)
+    return 1
+  shutil.rmtree(home)
+  print("PASSED")
+  return 0
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description="Stand-in server for testing roster versioning.")
+  sub = parser.add_subparsers(dest="mode", required=True)
+  p = sub.add_parser("serve", help="run the server")
+  p.add_argument("--port", type=int, default=5222)
+  p.add_argument("--items", type=int, default=1000)
+  p = sub.add_parser("test", help="run a test scenario with mcabber")
+  p.add_argument("mcabber", help="mcabber binary")
+  p.add_argument("--port", type=int, default=0)
+  p.add_argument("--items", type=int, default=1000)
+  args = parser.parse_args()
+  if args.mode == "serve":
+    serve(args)
+    return 0
+  return test(args)
+
+
+if __name__ == "__main__":
+  sys.exit(main())
@@ -35,6 +35,7 @@
 #include "compl.h"
 #include "hooks.h"
 #include "hbuf.h"
+#include "histolog.h"
 #include "utils.h"
 #include "settings.h"
 #include "events.h"
@@ -94,6 +95,7 @@ static void do_otrpolicy(char *arg);
 static void do_echo(char *arg);
 static void do_module(char *arg);
 static void do_carbons(char *arg);
+static void do_history(char *arg);
 
 static void room_bookmark(gpointer bud, char *arg);
 
@@ -204,6 +206,7 @@ void cmd_init(void)
   cmd_add("group", "Change group display settings",
           COMPL_GROUP, COMPL_GROUPNAME, &do_group, NULL);
   cmd_add("help", "Display some help", COMPL_CMD, 0, &do_help, NULL);
+  cmd_add("history", "Search the history logs", 0, 0, &do_history, NULL);
   cmd_add("iline", "Manipulate input buffer", 0, 0, &do_iline, NULL);
   cmd_add("info", "Show basic info on current buddy", 0, 0, &do_info, NULL);
   cmd_add("module", "Manipulations with modules", COMPL_MODULE, 0, &do_module,
@@ -279,6 +282,7 @@ void cmd_init(void)
   compl_add_category_word(COMPL_ROSTER, "item_toggle_lock");
   compl_add_category_word(COMPL_ROSTER, "alternate");
   compl_add_category_word(COMPL_ROSTER, "search");
+  compl_add_category_word(COMPL_ROSTER, "fuzzy");
   compl_add_category_word(COMPL_ROSTER, "unread_first");
   compl_add_category_word(COMPL_ROSTER, "unread_next");
   compl_add_category_word(COMPL_ROSTER, "note");
@@ -870,6 +874,15 @@ static void do_roster(char *arg)
     }
     scr_roster_search(arg);
     update_roster = TRUE;
+  } else if (!strcasecmp(subcmd, "fuzzy")) {
+    strip_arg_special_chars(arg);
+    if (!arg || !*arg) {
+      scr_LogPrint(LPRINT_NORMAL, "What name or JID are you looking for?");
+      free_arg_lst(paramlst);
+      return;
+    }
+    scr_roster_fuzzy_search(arg);
+    update_roster = TRUE;
   } else if (!strcasecmp(subcmd, "up")) {
     roster_updown(-1, arg);
   } else if (!strcasecmp(subcmd, "down")) {
@@ -4199,4 +4212,26 @@ static void do_carbons(char *arg)
   }
 }
 
+static void do_history(char *arg)
+{
+  char **paramlst;
+  char *subcmd;
+
+  paramlst = split_arg(arg, 2, 1); // subcmd, arg
+  subcmd = *paramlst;
+  arg = *(paramlst+1);
+
+  if (!subcmd || !*subcmd) {
+    scr_LogPrint(LPRINT_NORMAL, "Missing parameter.");
+  } else if (!strcasecmp(subcmd, "search")) {
+    if (arg && *arg)
+      hlog_search(arg);
+    else
+      scr_LogPrint(LPRINT_NORMAL, "Missing parameter.");
+  } else {
+    scr_LogPrint(LPRINT_NORMAL, "Unrecognized parameter!");
+  }
+  free_arg_lst(paramlst);
+}
+
 /* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
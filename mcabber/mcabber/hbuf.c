@@ -30,86 +30,361 @@
 #include "screen.h"
 
 
-/* This is a private structure type */
+/* These are private structure types */
+
+// Fixed-size items allocated from chunks owned by a buffer.  Freed items
+// are kept in a free list and reused; the chunks are only freed with the
+// buffer.
+typedef struct {
+  gsize size;           // Size of the items
+  GSList *chunks;       // Chunks allocated for this pool
+  char *next, *end;     // Unused part of the last chunk
+  gpointer free_list;   // Freed items (linked through their first word)
+} hbuf_pool;
+
+// The line index of a buffer.  The lines array contains the list elements
+// of the buffer, in order; lines before the "first" offset have been
+// removed from the list.  This gives O(1) access to the buffer tail, to the
+// nth line and to the position of a given line.
+// It also holds the memory accounting of the buffer, and the pools of its
+// blocks and line metadata.
+typedef struct {
+  GPtrArray *lines;
+  guint first;
+  gsize memory;         // Approximate memory used by the buffer
+  guint serial;         // Changed when lines are moved (see hbuf_wrap_job)
+  hbuf_pool blocks;     // hbuf_block items
+  hbuf_pool infos;      // hbuf_line_info items
+} hbuf_index;
+
+// Message metadata, only allocated for the first line of a message
+typedef struct {
+  time_t timestamp;
+  unsigned mucnicklen;
+  guint  flags;
+  gpointer xep184;
+} hbuf_line_info;
 
 typedef struct {
   char *ptr;
   char *ptr_end;        // beginning of the block
   char *ptr_end_alloc;  // end of the current persistent block
   guchar flags;
-
-  // XXX This should certainly be a pointer, and be allocated only when needed
-  // (for ex. when HBB_FLAG_PERSISTENT is set).
-  struct { // hbuf_line_info
-    time_t timestamp;
-    unsigned mucnicklen;
-    guint  flags;
-    gpointer xep184;
-  } prefix;
+  guint pos;            // position in index->lines
+  hbuf_index *index;
+  hbuf_line_info *prefix; // NULL for continuation lines
 } hbuf_block;
 
 
-//  do_wrap(p_hbuf, first_hbuf_elt, width)
+#define HBUF_INDEX_MINCOMPACT 1024
+
+// Number of items of a pool chunk
+#define HBUF_POOL_CHUNK_ITEMS 128
+
+// Memory cost of a line, except the text and metadata
+#define HBB_LINE_COST (sizeof(hbuf_block) + sizeof(GList) + sizeof(gpointer))
+
+static const hbuf_line_info no_prefix;
+
+// Used to tell when the lines of an index have been moved
+static guint hbuf_serial;
+
+// Wrapping of the lines of a buffer by another thread: the text of the
+// persistent lines is copied by hbuf_wrap_prepare(), hbuf_wrap_compute()
+// finds the breaks, and hbuf_wrap_apply() splits the lines.
+struct hbuf_wrap_job {
+  hbuf_index *index;    // Index of the buffer
+  guint serial;         // Serial of the index when the job was prepared
+  guint width;
+  GArray *pos;          // Positions of the persistent lines in the index
+  GString *text;        // Text of these lines (null-separated)
+  GArray *breaks;       // Break offsets of each line, followed by 0
+};
+
+// Memory used by all the buffers
+static gsize hbuf_total_memory;
+
+static inline void mem_account(hbuf_index *index, gssize delta)
+{
+  index->memory += delta;
+  hbuf_total_memory += delta;
+}
+
+static void hbuf_pool_init(hbuf_pool *pool, gsize size)
+{
+  memset(pool, 0, sizeof *pool);
+  // Items must be able to hold the free list link
+  pool->size = MAX(size, sizeof(gpointer));
+}
+
+//  hbuf_pool_alloc0(pool)
+// Return a zeroed item of the pool.
+static gpointer hbuf_pool_alloc0(hbuf_pool *pool)
+{
+  gpointer item = pool->free_list;
+
+  if (item) {
+    pool->free_list = *(gpointer*)item;
+  } else {
+    if (pool->next == pool->end) {
+      gsize len = pool->size * HBUF_POOL_CHUNK_ITEMS;
+      pool->next = g_new(char, len);
+      pool->end = pool->next + len;
+      pool->chunks = g_slist_prepend(pool->chunks, pool->next);
+    }
+    item = pool->next;
+    pool->next += pool->size;
+  }
+  memset(item, 0, pool->size);
+  return item;
+}
+
+static inline void hbuf_pool_free(hbuf_pool *pool, gpointer item)
+{
+  *(gpointer*)item = pool->free_list;
+  pool->free_list = item;
+}
+
+//  hbuf_pool_merge(pool, from)
+// Move the chunks (and the items) of the pool from to the pool.
+static void hbuf_pool_merge(hbuf_pool *pool, hbuf_pool *from)
+{
+  gpointer *last;
+
+  // The unused part of the last chunk of from is lost
+  pool->chunks = g_slist_concat(from->chunks, pool->chunks);
+  for (last = &from->free_list; *last; last = (gpointer*)*last)
+    ;
+  *last = pool->free_list;
+  pool->free_list = from->free_list;
+  from->chunks = NULL;
+  from->free_list = NULL;
+}
+
+static void hbuf_pool_destroy(hbuf_pool *pool)
+{
+  g_slist_foreach(pool->chunks, (GFunc)g_free, NULL);
+  g_slist_free(pool->chunks);
+  pool->chunks = NULL;
+}
+
+//  hbuf_index_new()
+// Create the index (and the pools) of a new buffer.
+static hbuf_index *hbuf_index_new(void)
+{
+  hbuf_index *index = g_new0(hbuf_index, 1);
+
+  index->lines = g_ptr_array_new();
+  index->serial = ++hbuf_serial;
+  hbuf_pool_init(&index->blocks, sizeof(hbuf_block));
+  hbuf_pool_init(&index->infos, sizeof(hbuf_line_info));
+  return index;
+}
+
+static void hbuf_index_free(hbuf_index *index)
+{
+  hbuf_pool_destroy(&index->blocks);
+  hbuf_pool_destroy(&index->infos);
+  g_ptr_array_free(index->lines, TRUE);
+  g_free(index);
+}
+
+//  hbuf_block_new(index)
+// Return a new (zeroed) block of the buffer.
+static hbuf_block *hbuf_block_new(hbuf_index *index)
+{
+  hbuf_block *blk = hbuf_pool_alloc0(&index->blocks);
+
+  blk->index = index;
+  return blk;
+}
+
+//  get_prefix(blk)
+// Return the line metadata of the block (all zero for continuation lines).
+static inline const hbuf_line_info *get_prefix(const hbuf_block *blk)
+{
+  return blk->prefix ? blk->prefix : &no_prefix;
+}
+
+//  get_prefix_rw(blk)
+// Return the line metadata of the block, allocating it if needed.
+static hbuf_line_info *get_prefix_rw(hbuf_block *blk)
+{
+  if (!blk->prefix) {
+    blk->prefix = hbuf_pool_alloc0(&blk->index->infos);
+    mem_account(blk->index, sizeof(hbuf_line_info));
+  }
+  return blk->prefix;
+}
+
+static void hbuf_block_free(hbuf_block *blk)
+{
+  hbuf_index *index = blk->index;
+
+  mem_account(index, -(gssize)(HBB_LINE_COST +
+              (blk->prefix ? sizeof(hbuf_line_info) : 0)));
+  if (blk->prefix) {
+    g_free(blk->prefix->xep184);
+    hbuf_pool_free(&index->infos, blk->prefix);
+  }
+  hbuf_pool_free(&index->blocks, blk);
+}
+
+//  hbuf_area_free(blk)
+// Free the text area allocated for the block (it must have the
+// HBB_FLAG_ALLOC flag).
+static void hbuf_area_free(hbuf_block *blk)
+{
+  mem_account(blk->index, -(gssize)(blk->ptr_end_alloc - blk->ptr));
+  g_free(blk->ptr);
+}
+
+//  hbuf_index_append(index, elt)
+// Append the list element elt to the index.
+static inline void hbuf_index_append(hbuf_index *index, GList *elt)
+{
+  hbuf_block *blk = elt->data;
+
+  blk->index = index;
+  blk->pos = index->lines->len;
+  g_ptr_array_add(index->lines, elt);
+}
+
+//  hbuf_index_sync_tail(index)
+// Append to the index the list elements following the last indexed one.
+static void hbuf_index_sync_tail(hbuf_index *index)
+{
+  GList *elt;
+
+  if (index->lines->len == index->first)
+    return;
+  elt = g_ptr_array_index(index->lines, index->lines->len - 1);
+  for (elt = g_list_next(elt); elt; elt = g_list_next(elt))
+    hbuf_index_append(index, elt);
+}
+
+//  hbuf_index_rebuild(index, first_elt)
+// Reindex the whole list, starting from its head first_elt.
+static void hbuf_index_rebuild(hbuf_index *index, GList *first_elt)
+{
+  g_ptr_array_set_size(index->lines, 0);
+  index->first = 0;
+  index->serial = ++hbuf_serial;
+  for ( ; first_elt; first_elt = g_list_next(first_elt))
+    hbuf_index_append(index, first_elt);
+}
+
+//  hbuf_index_drop_head(index)
+// Remove the first line from the index.
+// The array is compacted when more than half of it is unused, so that the
+// cost is amortized.
+static void hbuf_index_drop_head(hbuf_index *index)
+{
+  guint i;
+
+  index->first++;
+  if (index->first < HBUF_INDEX_MINCOMPACT ||
+      index->first * 2 < index->lines->len)
+    return;
+
+  g_ptr_array_remove_range(index->lines, 0, index->first);
+  index->first = 0;
+  index->serial = ++hbuf_serial;
+  for (i = 0; i < index->lines->len; i++) {
+    GList *elt = g_ptr_array_index(index->lines, i);
+    ((hbuf_block*)elt->data)->pos = i;
+  }
+}
+
+static inline hbuf_index *get_index(GList *hbuf)
+{
+  return hbuf ? ((hbuf_block*)hbuf->data)->index : NULL;
+}
+
+//  wrap_find_break(ptr, width, p_cr)
+// Return where the text at ptr has to be broken: at the first CR ('\n',
+// which is replaced with a null character, and *p_cr is set), or after the
+// last blank which fits in width columns.  Returns NULL if the text fits.
+// If width is 0, the text is only broken at CRs.
+// This does not use the buffer, and can be called from another thread.
+static char *wrap_find_break(char *ptr, unsigned int width, gboolean *p_cr)
+{
+  char *c = ptr;
+  char *br = NULL; // break pointer
+  unsigned int cur_w = 0;
+
+  *p_cr = FALSE;
+  // We want to break where we can find a space char or a CR
+  while (*c && (!width || cur_w <= width)) {
+    if (*c == '\n') {
+      *c = 0;
+      *p_cr = TRUE;
+      return c;
+    }
+    if (iswblank(get_char(c)))
+      br = c;
+    cur_w += get_char_width(c);
+    c = next_char(c);
+  }
+
+  if (!*c)
+    return NULL;
+  if (!br || br == ptr)
+    return c;
+  return next_char(br);
+}
+
+//  hbuf_split_block(curr_elt, br, cr)
+// Break the line of the list element curr_elt at br, and insert a new
+// block with the end of the line after it.  The new block is persistent if
+// the line is broken at a CR.
+// Returns the list element of the new block (which is not indexed).
+static GList *hbuf_split_block(GList *curr_elt, char *br, gboolean cr)
+{
+  hbuf_block *hbuf_b_prev = curr_elt->data;
+  hbuf_block *hbuf_b_curr = hbuf_block_new(hbuf_b_prev->index);
+
+  // The block must be persistent after a CR
+  if (cr) {
+    hbuf_b_curr->ptr    = br + 1;
+    hbuf_b_curr->flags  = HBB_FLAG_PERSISTENT;
+  } else {
+    hbuf_b_curr->ptr    = br;
+    hbuf_b_curr->flags  = 0;
+  }
+  hbuf_b_curr->ptr_end  = hbuf_b_prev->ptr_end;
+  hbuf_b_curr->ptr_end_alloc = hbuf_b_prev->ptr_end_alloc;
+  hbuf_b_prev->ptr_end  = br;
+  mem_account(hbuf_b_curr->index, HBB_LINE_COST);
+  // (g_list_append() only walks the list from curr_elt, its last element)
+  if (curr_elt->next)
+    g_list_insert_before(curr_elt, curr_elt->next, hbuf_b_curr);
+  else
+    g_list_append(curr_elt, hbuf_b_curr);
+  return curr_elt->next;
+}
+
+//  do_wrap(first_hbuf_elt, width)
 // Wrap hbuf lines with the specified width.
 // '\n' are handled by this routine (they are removed and persistent lines
 // are created).
 // All hbuf elements are processed, starting from first_hbuf_elt.
-static inline void do_wrap(GList **p_hbuf, GList *first_hbuf_elt,
-                           unsigned int width)
+// The new elements are not indexed.
+static inline void do_wrap(GList *first_hbuf_elt, unsigned int width)
 {
-  GList *curr_elt = first_hbuf_elt;
+  GList *curr_elt;
 
   // Let's add non-persistent blocs if necessary
   // - If there are '\n' in the string
   // - If length > width (and width != 0)
-  while (curr_elt) {
-    hbuf_block *hbuf_b_curr, *hbuf_b_prev;
-    char *c, *end;
-    char *br = NULL; // break pointer
-    char *cr = NULL; // CR pointer
-    unsigned int cur_w = 0;
-
-    // We want to break where we can find a space char or a CR
-
-    hbuf_b_curr = (hbuf_block*)(curr_elt->data);
-    hbuf_b_prev = hbuf_b_curr;
-    c = hbuf_b_curr->ptr;
-
-    while (*c && (!width || cur_w <= width)) {
-      if (*c == '\n') {
-        br = cr = c;
-        *c = 0;
-        break;
-      }
-      if (iswblank(get_char(c)))
-        br = c;
-      cur_w += get_char_width(c);
-      c = next_char(c);
-    }
-
-    if (cr || (*c && cur_w > width)) {
-      if (!br || br == hbuf_b_curr->ptr)
-        br = c;
-      else
-        br = next_char(br);
-      end = hbuf_b_curr->ptr_end;
-      hbuf_b_curr->ptr_end = br;
-      // Create another block
-      hbuf_b_curr = g_new0(hbuf_block, 1);
-      // The block must be persistent after a CR
-      if (cr) {
-        hbuf_b_curr->ptr    = hbuf_b_prev->ptr_end + 1; // == cr+1
-        hbuf_b_curr->flags  = HBB_FLAG_PERSISTENT;
-      } else {
-        hbuf_b_curr->ptr    = hbuf_b_prev->ptr_end; // == br
-        hbuf_b_curr->flags    = 0;
-      }
-      hbuf_b_curr->ptr_end  = end;
-      hbuf_b_curr->ptr_end_alloc = hbuf_b_prev->ptr_end_alloc;
-      // This is OK because insert_before(NULL) == append():
-      *p_hbuf = g_list_insert_before(*p_hbuf, curr_elt->next, hbuf_b_curr);
-    }
-    curr_elt = g_list_next(curr_elt);
+  for (curr_elt = first_hbuf_elt; curr_elt;
+       curr_elt = g_list_next(curr_elt)) {
+    hbuf_block *hbuf_b_curr = curr_elt->data;
+    gboolean cr;
+    char *br = wrap_find_break(hbuf_b_curr->ptr, width, &cr);
+
+    if (br)
+      hbuf_split_block(curr_elt, br, cr);
   }
 }
 
@@ -130,6 +405,7 @@ void hbuf_add_line(GList **p_hbuf, const char *text, time_t timestamp,
   char *line;
   guint hbb_blocksize, textlen;
   hbuf_block *hbuf_block_elt;
+  hbuf_index *index;
 
   if (!text) return;
 
@@ -138,30 +414,34 @@ void hbuf_add_line(GList **p_hbuf, const char *text, time_t timestamp,
   textlen = strlen(text);
   hbb_blocksize = MAX(textlen+1, HBB_BLOCKSIZE);
 
-  hbuf_block_elt = g_new0(hbuf_block, 1);
-  hbuf_block_elt->prefix.timestamp  = timestamp;
-  hbuf_block_elt->prefix.flags      = prefix_flags;
-  hbuf_block_elt->prefix.mucnicklen = mucnicklen;
-  hbuf_block_elt->prefix.xep184     = xep184;
   if (!*p_hbuf) {
+    index = hbuf_index_new();
+    hbuf_block_elt = hbuf_block_new(index);
     hbuf_block_elt->ptr  = g_new(char, hbb_blocksize);
-    if (!hbuf_block_elt->ptr) {
-      g_free(hbuf_block_elt);
-      return;
-    }
     hbuf_block_elt->flags  = HBB_FLAG_ALLOC | HBB_FLAG_PERSISTENT;
     hbuf_block_elt->ptr_end_alloc = hbuf_block_elt->ptr + hbb_blocksize;
+    mem_account(index, hbb_blocksize);
   } else {
     hbuf_block *hbuf_b_prev;
     // Set p_hbuf to the end of the list, to speed up history loading
     // (or CPU time will be used by g_list_last() for each line)
-    *p_hbuf = g_list_last(*p_hbuf);
+    *p_hbuf = hbuf_get_last(*p_hbuf);
     hbuf_b_prev = (*p_hbuf)->data;
+    index = hbuf_b_prev->index;
+    hbuf_block_elt = hbuf_block_new(index);
     hbuf_block_elt->ptr    = hbuf_b_prev->ptr_end;
     hbuf_block_elt->flags  = HBB_FLAG_PERSISTENT;
     hbuf_block_elt->ptr_end_alloc = hbuf_b_prev->ptr_end_alloc;
   }
+  hbuf_block_elt->prefix = hbuf_pool_alloc0(&index->infos);
+  hbuf_block_elt->prefix->timestamp  = timestamp;
+  hbuf_block_elt->prefix->flags      = prefix_flags;
+  hbuf_block_elt->prefix->mucnicklen = mucnicklen;
+  hbuf_block_elt->prefix->xep184     = xep184;
   *p_hbuf = g_list_append(*p_hbuf, hbuf_block_elt);
+  curr_elt = g_list_last(*p_hbuf);
+  hbuf_index_append(index, curr_elt);
+  mem_account(index, HBB_LINE_COST + sizeof(hbuf_line_info));
 
   if (hbuf_block_elt->ptr + textlen >= hbuf_block_elt->ptr_end_alloc) {
     // Too long for the current allocated bloc, we need another one
@@ -171,12 +451,13 @@ void hbuf_add_line(GList **p_hbuf, const char *text, time_t timestamp,
       // as well (it could be too small and cause a segfault).
       hbuf_block_elt->ptr  = g_new0(char, hbb_blocksize);
       hbuf_block_elt->ptr_end_alloc = hbuf_block_elt->ptr + hbb_blocksize;
+      mem_account(index, hbb_blocksize);
       // XXX We should check the return value.
     } else {
       GList *hbuf_head, *hbuf_elt;
       hbuf_block *hbuf_b_elt;
       guint n = 0;
-      hbuf_head = g_list_first(*p_hbuf);
+      hbuf_head = hbuf_get_nth(*p_hbuf, 0);
       // We need at least 2 allocated blocks
       if (maxhbufblocks == 1)
         maxhbufblocks = 2;
@@ -190,6 +471,7 @@ void hbuf_add_line(GList **p_hbuf, const char *text, time_t timestamp,
       if (n < maxhbufblocks) {
         hbuf_block_elt->ptr  = g_new0(char, hbb_blocksize);
         hbuf_block_elt->ptr_end_alloc = hbuf_block_elt->ptr + hbb_blocksize;
+        mem_account(index, hbb_blocksize);
       } else {
         // Let's use an old block, and free the extra blocks if needed
         char *allocated_block = NULL;
@@ -205,10 +487,11 @@ void hbuf_add_line(GList **p_hbuf, const char *text, time_t timestamp,
                 allocated_block = hbuf_b_elt->ptr;
                 end_of_allocated_block = hbuf_b_elt->ptr_end_alloc;
               } else {
-                g_free(hbuf_b_elt->ptr);
+                hbuf_area_free(hbuf_b_elt);
               }
             }
-            g_free(hbuf_b_elt);
+            hbuf_block_free(hbuf_b_elt);
+            hbuf_index_drop_head(index);
             hbuf_head = *p_hbuf = g_list_delete_link(hbuf_head, hbuf_elt);
           }
           n--;
@@ -226,10 +509,9 @@ void hbuf_add_line(GList **p_hbuf, const char *text, time_t timestamp,
   strcpy(line, text);
   hbuf_block_elt->ptr_end = line + textlen + 1;
 
-  curr_elt = g_list_last(*p_hbuf);
-
   // Wrap lines and handle CRs ('\n')
-  do_wrap(p_hbuf, curr_elt, width);
+  do_wrap(curr_elt, width);
+  hbuf_index_sync_tail(index);
 }
 
 //  hbuf_free()
@@ -238,32 +520,143 @@ void hbuf_free(GList **p_hbuf)
 {
   hbuf_block *hbuf_b_elt;
   GList *hbuf_elt;
-  GList *first_elt = g_list_first(*p_hbuf);
+  GList *first_elt = hbuf_get_nth(*p_hbuf, 0);
+  hbuf_index *index = get_index(first_elt);
 
   for (hbuf_elt = first_elt; hbuf_elt; hbuf_elt = g_list_next(hbuf_elt)) {
     hbuf_b_elt = (hbuf_block*)(hbuf_elt->data);
     if (hbuf_b_elt->flags & HBB_FLAG_ALLOC) {
-      g_free(hbuf_b_elt->ptr);
+      hbuf_area_free(hbuf_b_elt);
     }
-    g_free(hbuf_b_elt);
+    hbuf_block_free(hbuf_b_elt);
   }
 
   g_list_free(first_elt);
+  // The blocks are freed with their pools
+  if (index)
+    hbuf_index_free(index);
   *p_hbuf = NULL;
 }
 
-//  hbuf_rebuild()
-// Rebuild all hbuf list, with the new width.
-// If width == 0, lines are not wrapped.
-void hbuf_rebuild(GList **p_hbuf, unsigned int width)
+//  hbuf_shrink(p_hbuf, size)
+// Free the oldest allocated areas of the buffer (and their lines) until it
+// uses at most size bytes.  The last area is never freed.
+// Returns the number of bytes freed.
+gsize hbuf_shrink(GList **p_hbuf, gsize size)
 {
-  GList *first_elt, *curr_elt, *next_elt;
-  hbuf_block *hbuf_b_curr, *hbuf_b_next;
+  hbuf_index *index = get_index(*p_hbuf);
+  GList *hbuf_head, *hbuf_elt;
+  hbuf_block *blk;
+  gsize before;
 
-  // *p_hbuf needs to be the head of the list
-  first_elt = *p_hbuf = g_list_first(*p_hbuf);
+  if (!index)
+    return 0;
+
+  before = index->memory;
+  hbuf_head = hbuf_get_nth(*p_hbuf, 0);
+
+  while (index->memory > size) {
+    // Look for the beginning of the next area
+    for (hbuf_elt = g_list_next(hbuf_head); hbuf_elt;
+         hbuf_elt = g_list_next(hbuf_elt)) {
+      blk = (hbuf_block*)(hbuf_elt->data);
+      if (blk->flags & HBB_FLAG_ALLOC)
+        break;
+    }
+    if (!hbuf_elt)
+      break;
+    // Drop all the lines of the first area
+    while (hbuf_head != hbuf_elt) {
+      blk = (hbuf_block*)(hbuf_head->data);
+      if (blk->flags & HBB_FLAG_ALLOC)
+        hbuf_area_free(blk);
+      hbuf_block_free(blk);
+      hbuf_index_drop_head(index);
+      hbuf_head = g_list_delete_link(hbuf_head, hbuf_head);
+    }
+  }
+
+  *p_hbuf = hbuf_head;
+  return before - index->memory;
+}
+
+//  hbuf_index_reserve_head(index, n)
+// Make room in the index for n lines before the first one.  The room is
+// proportional to the number of lines, so that prepending pages of lines
+// has an amortized cost linear in the number of lines prepended.
+static void hbuf_index_reserve_head(hbuf_index *index, guint n)
+{
+  guint nlines = index->lines->len - index->first;
+  GPtrArray *lines;
+  guint room, i;
+
+  if (index->first >= n)
+    return;
+
+  room = MAX(n, nlines / 2);
+  lines = g_ptr_array_sized_new(room + nlines);
+  g_ptr_array_set_size(lines, room);
+  for (i = index->first; i < index->lines->len; i++) {
+    GList *elt = g_ptr_array_index(index->lines, i);
+    ((hbuf_block*)elt->data)->pos = lines->len;
+    g_ptr_array_add(lines, elt);
+  }
+  g_ptr_array_free(index->lines, TRUE);
+  index->lines = lines;
+  index->first = room;
+}
+
+//  hbuf_prepend(p_hbuf, p_head)
+// Insert the lines of the buffer *p_head before the lines of *p_hbuf.
+// The lines are moved, and *p_head is set to NULL.
+// Only the lines of *p_head are indexed again.
+void hbuf_prepend(GList **p_hbuf, GList **p_head)
+{
+  hbuf_index *index = get_index(*p_hbuf);
+  hbuf_index *head_index = get_index(*p_head);
+  GList *first_elt;
+  guint i, n;
+
+  if (!head_index)
+    return;
+  if (!index) {
+    *p_hbuf = *p_head;
+    *p_head = NULL;
+    return;
+  }
+
+  // g_list_concat() is O(1) when given the last element of the first list
+  first_elt = hbuf_get_nth(*p_hbuf, 0);
+  g_list_concat(hbuf_get_last(*p_head), first_elt);
+
+  // The lines of the head now belong to the index of the buffer
+  n = head_index->lines->len - head_index->first;
+  hbuf_index_reserve_head(index, n);
+  index->first -= n;
+  index->serial = ++hbuf_serial;
+  for (i = 0; i < n; i++) {
+    GList *elt = g_ptr_array_index(head_index->lines, head_index->first + i);
+    hbuf_block *blk = elt->data;
+
+    blk->index = index;
+    blk->pos = index->first + i;
+    g_ptr_array_index(index->lines, blk->pos) = elt;
+  }
+  index->memory += head_index->memory;
+  hbuf_pool_merge(&index->blocks, &head_index->blocks);
+  hbuf_pool_merge(&index->infos, &head_index->infos);
+  hbuf_index_free(head_index);
+  *p_head = NULL;
+}
+
+//  hbuf_merge_blocks(first_elt)
+// Remove the non-persistent blocks of the list (the lines are not wrapped
+// anymore).  The index must be rebuilt.
+static void hbuf_merge_blocks(GList *first_elt)
+{
+  GList *curr_elt, *next_elt;
+  hbuf_block *hbuf_b_curr, *hbuf_b_next;
 
-  // #1 Remove non-persistent blocks (ptr_end should be updated!)
   curr_elt = first_elt;
   while (curr_elt) {
     next_elt = g_list_next(curr_elt);
@@ -275,14 +668,149 @@ void hbuf_rebuild(GList **p_hbuf, unsigned int width)
     // Is next line not-persistent?
     if (!(hbuf_b_next->flags & HBB_FLAG_PERSISTENT)) {
       hbuf_b_curr->ptr_end = hbuf_b_next->ptr_end;
-      g_free(hbuf_b_next);
+      hbuf_block_free(hbuf_b_next);
       curr_elt = g_list_delete_link(curr_elt, next_elt);
     } else
       curr_elt = next_elt;
   }
+}
+
+//  hbuf_rebuild()
+// Rebuild all hbuf list, with the new width.
+// If width == 0, lines are not wrapped.
+void hbuf_rebuild(GList **p_hbuf, unsigned int width)
+{
+  GList *first_elt;
+
+  if (!*p_hbuf)
+    return;
+
+  // *p_hbuf needs to be the head of the list
+  first_elt = *p_hbuf = hbuf_get_nth(*p_hbuf, 0);
+
+  // #1 Remove non-persistent blocks (ptr_end should be updated!)
+  hbuf_merge_blocks(first_elt);
   // #2 Go back to head and create non-persistent blocks when needed
   if (width)
-    do_wrap(p_hbuf, first_elt, width);
+    do_wrap(first_elt, width);
+  // #3 Update the line index
+  hbuf_index_rebuild(get_index(first_elt), first_elt);
+}
+
+//  hbuf_wrap_prepare(hbuf, width)
+// Copy the lines of the buffer, so that they can be wrapped with the given
+// width by hbuf_wrap_compute() in another thread.
+// Returns NULL if the buffer is empty.
+hbuf_wrap_job *hbuf_wrap_prepare(GList *hbuf, guint width)
+{
+  hbuf_index *index = get_index(hbuf);
+  hbuf_wrap_job *job;
+  guint i;
+
+  if (!index)
+    return NULL;
+
+  job = g_new0(hbuf_wrap_job, 1);
+  job->index = index;
+  job->serial = index->serial;
+  job->width = width;
+  job->pos = g_array_new(FALSE, FALSE, sizeof(guint));
+  job->text = g_string_new(NULL);
+  for (i = index->first; i < index->lines->len; i++) {
+    GList *elt = g_ptr_array_index(index->lines, i);
+    hbuf_block *blk = elt->data;
+
+    if (!(blk->flags & HBB_FLAG_PERSISTENT))
+      continue;
+    // The text of the line goes on in its non-persistent blocks
+    g_array_append_val(job->pos, i);
+    g_string_append_len(job->text, blk->ptr, strlen(blk->ptr) + 1);
+  }
+  return job;
+}
+
+//  hbuf_wrap_compute(job)
+// Find where the lines of the job have to be broken.
+// This function does not use the buffer, and can be called from any thread.
+void hbuf_wrap_compute(hbuf_wrap_job *job)
+{
+  char *line = job->text->str;
+  char *end = line + job->text->len;
+  guint zero = 0;
+
+  job->breaks = g_array_new(FALSE, FALSE, sizeof(guint));
+  while (line < end) {
+    char *next = line + strlen(line) + 1;
+    char *ptr = line, *br;
+    gboolean cr;
+
+    // (There is no CR left in the lines, see do_wrap())
+    while (job->width && (br = wrap_find_break(ptr, job->width, &cr))) {
+      guint offset = br - line;
+      g_array_append_val(job->breaks, offset);
+      ptr = cr ? br + 1 : br;
+    }
+    g_array_append_val(job->breaks, zero);
+    line = next;
+  }
+}
+
+//  hbuf_wrap_apply(p_hbuf, job)
+// Wrap the lines of the buffer with the breaks found by the job.  The lines
+// added since the job was prepared are wrapped here.
+// Returns FALSE (and the buffer is unchanged) if the job is out of date:
+// the buffer has been rewrapped, freed, or lines have been inserted.
+gboolean hbuf_wrap_apply(GList **p_hbuf, hbuf_wrap_job *job)
+{
+  hbuf_index *index = get_index(*p_hbuf);
+  GList *first_elt, *tail = NULL;
+  GList **lines;
+  guint i, b = 0;
+
+  if (!index || index != job->index || index->serial != job->serial ||
+      !job->breaks)
+    return FALSE;
+
+  // Get the lines of the job before the blocks are merged (the first lines
+  // may have been dropped since the job was prepared)
+  lines = g_new0(GList*, job->pos->len);
+  for (i = 0; i < job->pos->len; i++) {
+    guint pos = g_array_index(job->pos, guint, i);
+    if (pos >= index->first)
+      lines[i] = g_ptr_array_index(index->lines, pos);
+  }
+
+  first_elt = *p_hbuf = hbuf_get_nth(*p_hbuf, 0);
+  hbuf_merge_blocks(first_elt);
+
+  for (i = 0; i < job->pos->len; i++) {
+    GList *elt = lines[i];
+    guint offset;
+
+    while ((offset = g_array_index(job->breaks, guint, b++))) {
+      if (elt)
+        elt = hbuf_split_block(elt, ((hbuf_block*)lines[i]->data)->ptr +
+                               offset, FALSE);
+    }
+    if (elt)
+      tail = elt;
+  }
+  g_free(lines);
+
+  // The lines added meanwhile
+  if (job->width)
+    do_wrap(tail ? g_list_next(tail) : first_elt, job->width);
+  hbuf_index_rebuild(index, first_elt);
+  return TRUE;
+}
+
+void hbuf_wrap_job_free(hbuf_wrap_job *job)
+{
+  g_array_free(job->pos, TRUE);
+  g_string_free(job->text, TRUE);
+  if (job->breaks)
+    g_array_free(job->breaks, TRUE);
+  g_free(job);
 }
 
 //  hbuf_previous_persistent()
@@ -306,19 +834,19 @@ GList *hbuf_previous_persistent(GList *l_line)
   return NULL;
 }
 
-//  hbuf_get_lines(hbuf, n)
-// Returns an array of n hbb_line pointers
-// (The first line will be the line currently pointed by hbuf)
-// Note: The caller should free the array, the hbb_line pointers and the
-// text pointers after use.
-hbb_line **hbuf_get_lines(GList *hbuf, unsigned int n)
+//  hbuf_get_line_views(hbuf, views, n)
+// Fill the views array with up to n lines, starting from the line currently
+// pointed by hbuf, and return the number of lines found.
+// The text pointers are borrowed from the buffer storage: they are not
+// null-terminated (use the len field) and are only valid until the buffer
+// is modified.
+guint hbuf_get_line_views(GList *hbuf, hbb_line_view *views, guint n)
 {
-  unsigned int i;
+  guint i;
   hbuf_block *blk;
   guint last_persist_prefixflags = 0;
   GList *last_persist;  // last persistent flags
-  hbb_line **array, **array_elt;
-  hbb_line *prev_array_elt = NULL;
+  hbb_line *line, *prev_line = NULL;
 
   // To be able to correctly highlight multi-line messages,
   // we need to look at the last non-null prefix, which should be the first
@@ -327,66 +855,79 @@ hbb_line **hbuf_get_lines(GList *hbuf, unsigned int n)
   last_persist = hbuf_previous_persistent(hbuf);
   while (last_persist) {
     blk = (hbuf_block*)last_persist->data;
-    if ((blk->flags & HBB_FLAG_PERSISTENT) && blk->prefix.flags) {
+    if ((blk->flags & HBB_FLAG_PERSISTENT) && get_prefix(blk)->flags) {
       // This can be either the beginning of the message,
       // or a persistent line with a readmark flag (or both).
-      if (blk->prefix.flags & ~HBB_PREFIX_READMARK) { // First message line
-        last_persist_prefixflags |= blk->prefix.flags;
+      if (get_prefix(blk)->flags & ~HBB_PREFIX_READMARK) { // First message line
+        last_persist_prefixflags |= get_prefix(blk)->flags;
         break;
       } else { // Not the first line, but we need to keep the readmark flag
-        last_persist_prefixflags = blk->prefix.flags;
+        last_persist_prefixflags = get_prefix(blk)->flags;
       }
     }
     last_persist = g_list_previous(last_persist);
   }
 
-  array = g_new0(hbb_line*, n);
-  array_elt = array;
-
-  for (i = 0 ; i < n ; i++) {
-    if (hbuf) {
-      int maxlen;
-
-      blk = (hbuf_block*)(hbuf->data);
-      maxlen = blk->ptr_end - blk->ptr;
-      *array_elt = (hbb_line*)g_new(hbb_line, 1);
-      (*array_elt)->timestamp  = blk->prefix.timestamp;
-      (*array_elt)->flags      = blk->prefix.flags;
-      (*array_elt)->mucnicklen = blk->prefix.mucnicklen;
-      (*array_elt)->text       = g_strndup(blk->ptr, maxlen);
-
-      if ((blk->flags & HBB_FLAG_PERSISTENT) &&
-          (blk->prefix.flags & ~HBB_PREFIX_READMARK)) {
-        // This is a new message: persistent block flag and no prefix flag
-        // (except a possible readmark flag)
-        last_persist_prefixflags = blk->prefix.flags;
-      } else {
-        // Propagate highlighting flags
-        (*array_elt)->flags |= last_persist_prefixflags &
-                               (HBB_PREFIX_HLIGHT_OUT | HBB_PREFIX_HLIGHT |
-                                HBB_PREFIX_INFO | HBB_PREFIX_IN |
-                                HBB_PREFIX_READMARK);
-        // Continuation of a message - omit the prefix
-        (*array_elt)->flags |= HBB_PREFIX_CONT;
-        (*array_elt)->mucnicklen = 0; // The nick is in the first one
-
-        // If there is a readmark on this line, update last_persist_prefixflags
-        if (blk->flags & HBB_FLAG_PERSISTENT)
-          last_persist_prefixflags |= blk->prefix.flags & HBB_PREFIX_READMARK;
-        // Remove readmark flag from the previous line
-        if (prev_array_elt && last_persist_prefixflags & HBB_PREFIX_READMARK)
-          prev_array_elt->flags &= ~HBB_PREFIX_READMARK;
-      }
+  for (i = 0 ; i < n && hbuf ; i++, hbuf = g_list_next(hbuf)) {
+    blk = (hbuf_block*)(hbuf->data);
+    line = &views[i].line;
+    views[i].len = blk->ptr_end - blk->ptr;
+    line->timestamp  = get_prefix(blk)->timestamp;
+    line->flags      = get_prefix(blk)->flags;
+    line->mucnicklen = get_prefix(blk)->mucnicklen;
+    line->text       = blk->ptr;
 
-      prev_array_elt = *array_elt;
+    if ((blk->flags & HBB_FLAG_PERSISTENT) &&
+        (get_prefix(blk)->flags & ~HBB_PREFIX_READMARK)) {
+      // This is a new message: persistent block flag and no prefix flag
+      // (except a possible readmark flag)
+      last_persist_prefixflags = get_prefix(blk)->flags;
+    } else {
+      // Propagate highlighting flags
+      line->flags |= last_persist_prefixflags &
+                     (HBB_PREFIX_HLIGHT_OUT | HBB_PREFIX_HLIGHT |
+                      HBB_PREFIX_INFO | HBB_PREFIX_IN |
+                      HBB_PREFIX_READMARK);
+      // Continuation of a message - omit the prefix
+      line->flags |= HBB_PREFIX_CONT;
+      line->mucnicklen = 0; // The nick is in the first one
+
+      // If there is a readmark on this line, update last_persist_prefixflags
+      if (blk->flags & HBB_FLAG_PERSISTENT)
+        last_persist_prefixflags |= get_prefix(blk)->flags & HBB_PREFIX_READMARK;
+      // Remove readmark flag from the previous line
+      if (prev_line && last_persist_prefixflags & HBB_PREFIX_READMARK)
+        prev_line->flags &= ~HBB_PREFIX_READMARK;
+    }
 
-      hbuf = g_list_next(hbuf);
-    } else
-      break;
+    prev_line = line;
+  }
 
-    array_elt++;
+  return i;
+}
+
+//  hbuf_get_lines(hbuf, n)
+// Returns an array of n hbb_line pointers
+// (The first line will be the line currently pointed by hbuf)
+// Note: The caller should free the array, the hbb_line pointers and the
+// text pointers after use.
+hbb_line **hbuf_get_lines(GList *hbuf, unsigned int n)
+{
+  guint i, count;
+  hbb_line **array;
+  hbb_line_view *views;
+
+  array = g_new0(hbb_line*, n);
+  views = g_new(hbb_line_view, n);
+  count = hbuf_get_line_views(hbuf, views, n);
+
+  for (i = 0 ; i < count ; i++) {
+    array[i] = g_new(hbb_line, 1);
+    *array[i] = views[i].line;
+    array[i]->text = g_strndup(views[i].line.text, views[i].len);
   }
 
+  g_free(views);
   return array;
 }
 
@@ -421,11 +962,11 @@ GList *hbuf_jump_date(GList *hbuf, time_t t)
 {
   hbuf_block *blk;
 
-  hbuf = g_list_first(hbuf);
+  hbuf = hbuf_get_nth(hbuf, 0);
 
   for ( ; hbuf && g_list_next(hbuf); hbuf = g_list_next(hbuf)) {
     blk = (hbuf_block*)(hbuf->data);
-    if (blk->prefix.timestamp >= t) break;
+    if (get_prefix(blk)->timestamp >= t) break;
   }
 
   return hbuf;
@@ -437,10 +978,9 @@ GList *hbuf_jump_percent(GList *hbuf, int pc)
 {
   guint hlen;
 
-  hbuf = g_list_first(hbuf);
-  hlen = g_list_length(hbuf);
+  hlen = hbuf_get_lines_number(hbuf);
 
-  return g_list_nth(hbuf, pc*hlen/100);
+  return hbuf_get_nth(hbuf, pc*hlen/100);
 }
 
 //  hbuf_jump_readmark(hbuf)
@@ -451,13 +991,13 @@ GList *hbuf_jump_readmark(GList *hbuf)
   hbuf_block *blk;
   GList *r = NULL;
 
-  hbuf = g_list_last(hbuf);
+  hbuf = hbuf_get_last(hbuf);
   for ( ; hbuf; hbuf = g_list_previous(hbuf)) {
     blk = (hbuf_block*)(hbuf->data);
-    if (blk->prefix.flags & HBB_PREFIX_READMARK)
+    if (get_prefix(blk)->flags & HBB_PREFIX_READMARK)
       return r;
     if ((blk->flags & HBB_FLAG_PERSISTENT) &&
-        (blk->prefix.flags & ~HBB_PREFIX_READMARK))
+        (get_prefix(blk)->flags & ~HBB_PREFIX_READMARK))
       r = hbuf;
   }
 
@@ -489,21 +1029,21 @@ void hbuf_dump_to_file(GList *hbuf, const char *filename)
   prefixwidth = scr_getprefixwidth();
   prefixwidth = MIN(prefixwidth, sizeof pref);
 
-  for (hbuf = g_list_first(hbuf); hbuf; hbuf = g_list_next(hbuf)) {
+  for (hbuf = hbuf_get_nth(hbuf, 0); hbuf; hbuf = g_list_next(hbuf)) {
     int maxlen;
 
     blk = (hbuf_block*)(hbuf->data);
     maxlen = blk->ptr_end - blk->ptr;
 
     memset(&line, 0, sizeof(line));
-    line.timestamp  = blk->prefix.timestamp;
-    line.flags      = blk->prefix.flags;
-    line.mucnicklen = blk->prefix.mucnicklen;
+    line.timestamp  = get_prefix(blk)->timestamp;
+    line.flags      = get_prefix(blk)->flags;
+    line.mucnicklen = get_prefix(blk)->mucnicklen;
     line.text       = g_strndup(blk->ptr, maxlen);
 
     if ((blk->flags & HBB_FLAG_PERSISTENT) &&
-        (blk->prefix.flags & ~HBB_PREFIX_READMARK)) {
-      last_persist_prefixflags = blk->prefix.flags;
+        (get_prefix(blk)->flags & ~HBB_PREFIX_READMARK)) {
+      last_persist_prefixflags = get_prefix(blk)->flags;
     } else {
       // Propagate necessary highlighting flags
       line.flags |= last_persist_prefixflags &
@@ -522,6 +1062,156 @@ void hbuf_dump_to_file(GList *hbuf, const char *filename)
   return;
 }
 
+// Message records of the files written by hbuf_save_messages():
+// "timestamp flags mucnicklen textlen xep184len\n" followed by the text,
+// the receipt id and a newline.
+
+static gboolean write_message(FILE *fp, const char *text, gsize textlen,
+                              time_t timestamp, guint prefix_flags,
+                              unsigned mucnicklen, const char *xep184)
+{
+  gsize idlen = xep184 ? strlen(xep184) : 0;
+
+  if (fprintf(fp, "%ld %u %u %lu %lu\n", (long)timestamp, prefix_flags,
+              mucnicklen, (unsigned long)textlen, (unsigned long)idlen) < 0)
+    return FALSE;
+  if (fwrite(text, 1, textlen, fp) != textlen ||
+      (idlen && fwrite(xep184, 1, idlen, fp) != idlen) ||
+      fputc('\n', fp) == EOF)
+    return FALSE;
+  return TRUE;
+}
+
+//  hbuf_save_messages(hbuf, filename)
+// Write all the messages of the buffer to a file, so that the buffer can be
+// freed and restored later with hbuf_load_messages().
+// Wrapped lines are joined back; readmark and receipt flags are kept.
+// Returns TRUE on success.
+gboolean hbuf_save_messages(GList *hbuf, const char *filename)
+{
+  hbuf_block *blk;
+  const hbuf_line_info *prefix, *msg = NULL;
+  guint msgflags = 0;
+  GString *text;
+  FILE *fp;
+  gboolean ok = TRUE;
+
+  fp = fopen(filename, "w");
+  if (!fp)
+    return FALSE;
+
+  text = g_string_new(NULL);
+
+  for (hbuf = hbuf_get_nth(hbuf, 0); hbuf && ok; hbuf = g_list_next(hbuf)) {
+    const char *end;
+
+    blk = (hbuf_block*)(hbuf->data);
+    prefix = get_prefix(blk);
+
+    if (!msg || ((blk->flags & HBB_FLAG_PERSISTENT) &&
+                 (prefix->flags & ~HBB_PREFIX_READMARK))) {
+      // This is a new message
+      if (msg)
+        ok = write_message(fp, text->str, text->len, msg->timestamp,
+                           msgflags, msg->mucnicklen, msg->xep184);
+      g_string_truncate(text, 0);
+      msg = prefix;
+      msgflags = prefix->flags;
+    } else {
+      // Continuation line; persistent lines come from a CR
+      if (blk->flags & HBB_FLAG_PERSISTENT)
+        g_string_append_c(text, '\n');
+      msgflags |= prefix->flags & HBB_PREFIX_READMARK;
+    }
+
+    end = memchr(blk->ptr, 0, blk->ptr_end - blk->ptr);
+    g_string_append_len(text, blk->ptr, (end ? end : blk->ptr_end) - blk->ptr);
+  }
+  if (msg && ok)
+    ok = write_message(fp, text->str, text->len, msg->timestamp,
+                       msgflags, msg->mucnicklen, msg->xep184);
+
+  g_string_free(text, TRUE);
+  if (fclose(fp))
+    ok = FALSE;
+  return ok;
+}
+
+//  hbuf_append_message_to_file(filename, text, timestamp, prefix_flags,
+//                              mucnicklen, xep184)
+// Append a message to a file written by hbuf_save_messages().
+// Returns TRUE on success.
+gboolean hbuf_append_message_to_file(const char *filename, const char *text,
+                                     time_t timestamp, guint prefix_flags,
+                                     unsigned mucnicklen, const char *xep184)
+{
+  FILE *fp;
+  gboolean ok;
+
+  fp = fopen(filename, "a");
+  if (!fp)
+    return FALSE;
+
+  prefix_flags |= (xep184 ? HBB_PREFIX_RECEIPT : 0);
+  ok = write_message(fp, text, strlen(text), timestamp, prefix_flags,
+                     mucnicklen, xep184);
+  if (fclose(fp))
+    ok = FALSE;
+  return ok;
+}
+
+//  hbuf_load_messages(p_hbuf, filename, width, maxhbufblocks)
+// Add the messages saved in a file by hbuf_save_messages() to the buffer.
+// See hbuf_add_line() for the width and maxhbufblocks parameters.
+// Returns FALSE if the file could not be read completely.
+gboolean hbuf_load_messages(GList **p_hbuf, const char *filename,
+                            guint width, guint maxhbufblocks)
+{
+  FILE *fp;
+  long timestamp;
+  guint flags;
+  unsigned mucnicklen;
+  unsigned long textlen, idlen;
+  gboolean ok = TRUE;
+
+  fp = fopen(filename, "r");
+  if (!fp)
+    return FALSE;
+
+  while (fscanf(fp, "%ld %u %u %lu %lu", &timestamp, &flags, &mucnicklen,
+                &textlen, &idlen) == 5) {
+    char *text, *xep184 = NULL;
+
+    if (fgetc(fp) != '\n') {
+      ok = FALSE;
+      break;
+    }
+    text = g_new(char, textlen+1);
+    if (idlen)
+      xep184 = g_new(char, idlen+1);
+    if (fread(text, 1, textlen, fp) != textlen ||
+        (idlen && fread(xep184, 1, idlen, fp) != idlen) ||
+        fgetc(fp) != '\n') {
+      g_free(text);
+      g_free(xep184);
+      ok = FALSE;
+      break;
+    }
+    text[textlen] = 0;
+    if (xep184)
+      xep184[idlen] = 0;
+
+    hbuf_add_line(p_hbuf, text, (time_t)timestamp, flags, width,
+                  maxhbufblocks, mucnicklen, xep184);
+    g_free(text);
+  }
+
+  if (!feof(fp))
+    ok = FALSE;
+  fclose(fp);
+  return ok;
+}
+
 //  hbuf_remove_receipt(hbuf, xep184)
 // Remove the Receipt Flag for the message with the given xep184 id
 // Returns TRUE if it was found and removed, otherwise FALSE
@@ -529,14 +1219,14 @@ gboolean hbuf_remove_receipt(GList *hbuf, gconstpointer xep184)
 {
   hbuf_block *blk;
 
-  hbuf = g_list_last(hbuf);
+  hbuf = hbuf_get_last(hbuf);
 
   for ( ; hbuf; hbuf = g_list_previous(hbuf)) {
     blk = (hbuf_block*)(hbuf->data);
-    if (!g_strcmp0(blk->prefix.xep184, xep184)) {
-      g_free(blk->prefix.xep184);
-      blk->prefix.xep184 = NULL;
-      blk->prefix.flags ^= HBB_PREFIX_RECEIPT;
+    if (blk->prefix && !g_strcmp0(blk->prefix->xep184, xep184)) {
+      g_free(blk->prefix->xep184);
+      blk->prefix->xep184 = NULL;
+      blk->prefix->flags ^= HBB_PREFIX_RECEIPT;
       return TRUE;
     }
   }
@@ -553,12 +1243,12 @@ void hbuf_set_readmark(GList *hbuf, gboolean action)
 
   if (!hbuf) return;
 
-  hbuf = hbuf_previous_persistent(g_list_last(hbuf));
+  hbuf = hbuf_previous_persistent(hbuf_get_last(hbuf));
 
   if (action) {
     // Add a readmark flag
     blk = (hbuf_block*)(hbuf->data);
-    blk->prefix.flags |= HBB_PREFIX_READMARK;
+    get_prefix_rw(blk)->flags |= HBB_PREFIX_READMARK;
 
     // Shift hbuf in order to remove previous flags
     // (maybe it can be optimized out, if there's no risk
@@ -569,8 +1259,8 @@ void hbuf_set_readmark(GList *hbuf, gboolean action)
   // Remove old mark
   for ( ; hbuf; hbuf = g_list_previous(hbuf)) {
     blk = (hbuf_block*)(hbuf->data);
-    if (blk->prefix.flags & HBB_PREFIX_READMARK) {
-      blk->prefix.flags &= ~HBB_PREFIX_READMARK;
+    if (get_prefix(blk)->flags & HBB_PREFIX_READMARK) {
+      blk->prefix->flags &= ~HBB_PREFIX_READMARK;
       break;
     }
   }
@@ -584,9 +1274,10 @@ void hbuf_remove_trailing_readmark(GList *hbuf)
 
   if (!hbuf) return;
 
-  hbuf = g_list_last(hbuf);
+  hbuf = hbuf_get_last(hbuf);
   blk = (hbuf_block*)(hbuf->data);
-  blk->prefix.flags &= ~HBB_PREFIX_READMARK;
+  if (blk->prefix)
+    blk->prefix->flags &= ~HBB_PREFIX_READMARK;
 }
 
 //  hbuf_get_blocks_number()
@@ -596,7 +1287,7 @@ guint hbuf_get_blocks_number(GList *hbuf)
   hbuf_block *hbuf_b_elt;
   guint count = 0U;
 
-  for (hbuf = g_list_first(hbuf); hbuf; hbuf = g_list_next(hbuf)) {
+  for (hbuf = hbuf_get_nth(hbuf, 0); hbuf; hbuf = g_list_next(hbuf)) {
     hbuf_b_elt = (hbuf_block*)(hbuf->data);
     if (hbuf_b_elt->flags & HBB_FLAG_ALLOC)
       count++;
@@ -604,4 +1295,88 @@ guint hbuf_get_blocks_number(GList *hbuf)
   return count;
 }
 
+//  hbuf_get_lines_number(hbuf)
+// Returns the number of lines of the buffer.
+guint hbuf_get_lines_number(GList *hbuf)
+{
+  hbuf_index *index = get_index(hbuf);
+
+  if (!index)
+    return 0U;
+  return index->lines->len - index->first;
+}
+
+//  hbuf_get_memory_usage(hbuf)
+// Returns the approximate number of bytes used by the buffer.
+gsize hbuf_get_memory_usage(GList *hbuf)
+{
+  hbuf_index *index = get_index(hbuf);
+
+  return index ? index->memory : 0;
+}
+
+//  hbuf_get_total_memory_usage()
+// Returns the approximate number of bytes used by all the buffers.
+gsize hbuf_get_total_memory_usage(void)
+{
+  return hbuf_total_memory;
+}
+
+//  hbuf_get_nth(hbuf, n)
+// Returns the nth line of the buffer, or NULL if there are not enough lines.
+GList *hbuf_get_nth(GList *hbuf, guint n)
+{
+  hbuf_index *index = get_index(hbuf);
+
+  if (!index || n >= index->lines->len - index->first)
+    return NULL;
+  return g_ptr_array_index(index->lines, index->first + n);
+}
+
+//  hbuf_get_first_timestamp(hbuf)
+// Returns the timestamp of the first message of the buffer, or 0 if there
+// is none.
+time_t hbuf_get_first_timestamp(GList *hbuf)
+{
+  hbuf_index *index = get_index(hbuf);
+  guint i;
+
+  if (!index)
+    return 0;
+  for (i = index->first; i < index->lines->len; i++) {
+    GList *elt = g_ptr_array_index(index->lines, i);
+    const hbuf_line_info *prefix = get_prefix(elt->data);
+    if (prefix->timestamp)
+      return prefix->timestamp;
+  }
+  return 0;
+}
+
+//  hbuf_get_last(hbuf)
+// Returns the last line of the buffer.
+GList *hbuf_get_last(GList *hbuf)
+{
+  hbuf_index *index = get_index(hbuf);
+
+  if (!index)
+    return NULL;
+  return g_ptr_array_index(index->lines, index->lines->len - 1);
+}
+
+//  hbuf_get_position(hbuf, line)
+// Returns the position of line in the buffer, or -1 if line is NULL or
+// belongs to another buffer.
+gint hbuf_get_position(GList *hbuf, GList *line)
+{
+  hbuf_index *index = get_index(hbuf);
+  hbuf_block *blk;
+
+  if (!index || !line)
+    return -1;
+  blk = line->data;
+  if (blk->index != index || blk->pos < index->first)
+    return -1;
+  return blk->pos - index->first;
+}
+
 /* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
@@ -39,14 +39,31 @@ typedef struct {
   char *text;
 } hbb_line;
 
+// A line borrowed from the buffer storage (see hbuf_get_line_views()).
+// line.text is not null-terminated, len is its size in bytes.
+typedef struct {
+  hbb_line line;
+  unsigned len;
+} hbb_line_view;
+
+typedef struct hbuf_wrap_job hbuf_wrap_job;
+
 void hbuf_add_line(GList **p_hbuf, const char *text, time_t timestamp,
         guint prefix_flags, guint width, guint maxhbufblocks,
         unsigned mucnicklen, gpointer xep184);
 void hbuf_free(GList **p_hbuf);
 void hbuf_rebuild(GList **p_hbuf, unsigned int width);
+void hbuf_prepend(GList **p_hbuf, GList **p_head);
+gsize hbuf_shrink(GList **p_hbuf, gsize size);
 GList *hbuf_previous_persistent(GList *l_line);
 
+hbuf_wrap_job *hbuf_wrap_prepare(GList *hbuf, guint width);
+void hbuf_wrap_compute(hbuf_wrap_job *job);
+gboolean hbuf_wrap_apply(GList **p_hbuf, hbuf_wrap_job *job);
+void hbuf_wrap_job_free(hbuf_wrap_job *job);
+
 hbb_line **hbuf_get_lines(GList *hbuf, unsigned int n);
+guint hbuf_get_line_views(GList *hbuf, hbb_line_view *views, guint n);
 GList *hbuf_search(GList *hbuf, int direction, const char *string);
 GList *hbuf_jump_date(GList *hbuf, time_t t);
 GList *hbuf_jump_percent(GList *hbuf, int pc);
@@ -56,8 +73,21 @@ void hbuf_set_readmark(GList *hbuf, gboolean action);
 void hbuf_remove_trailing_readmark(GList *hbuf);
 
 void hbuf_dump_to_file(GList *hbuf, const char *filename);
+gboolean hbuf_save_messages(GList *hbuf, const char *filename);
+gboolean hbuf_append_message_to_file(const char *filename, const char *text,
+                                     time_t timestamp, guint prefix_flags,
+                                     unsigned mucnicklen, const char *xep184);
+gboolean hbuf_load_messages(GList **p_hbuf, const char *filename,
+                            guint width, guint maxhbufblocks);
 
 guint hbuf_get_blocks_number(GList *p_hbuf);
+guint hbuf_get_lines_number(GList *hbuf);
+gsize hbuf_get_memory_usage(GList *hbuf);
+gsize hbuf_get_total_memory_usage(void);
+GList *hbuf_get_nth(GList *hbuf, guint n);
+time_t hbuf_get_first_timestamp(GList *hbuf);
+GList *hbuf_get_last(GList *hbuf);
+gint hbuf_get_position(GList *hbuf, GList *line);
 
 #endif /* __MCABBER_HBUF_H__ */
 
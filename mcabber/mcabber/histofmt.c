@@ -0,0 +1,125 @@
+/*
+ * histofmt.c   -- History file record format
+ *
+ * Copyright (C) 2005-2010 Mikael Berthe <mikael@lilotux.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* These functions only depend on glib, so that they can be shared by
+ * mcabber and the mcabber-history tool. */
+
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+
+#include "histofmt.h"
+
+//  parse_histo_timestamp(str, &timestamp)
+// Parse the "yyyymmddThh:mm:ssZ" UTC timestamp of a history record.
+// The format is fixed, so this is much cheaper than from_iso8601().
+// Returns FALSE if the timestamp is not valid.
+gboolean parse_histo_timestamp(const char *str, time_t *p_timestamp)
+{
+  static const char format[] = "ddddddddTdd:dd:ddZ";
+  guint i;
+  int year, mon, day, yoe, doy;
+  long era, days;
+
+  for (i = 0; i < sizeof format - 1; i++) {
+    if (format[i] == 'd' ? !isdigit((unsigned char)str[i])
+                         : str[i] != format[i])
+      return FALSE;
+  }
+
+#define DIGITS2(p) (((p)[0]-'0')*10 + ((p)[1]-'0'))
+  year = DIGITS2(str) * 100 + DIGITS2(str+2);
+  mon  = DIGITS2(str+4);
+  day  = DIGITS2(str+6);
+  if (mon < 1 || mon > 12 || day < 1 || day > 31)
+    return FALSE;
+
+  // Number of days since the epoch (proleptic Gregorian calendar), the
+  // year starting in March so that the leap day is the last one.
+  if (mon <= 2)
+    year--;
+  era = (year >= 0 ? year : year - 399) / 400;
+  yoe = year - era * 400;
+  doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+  days = era * 146097L + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468L;
+
+  *p_timestamp = (time_t)days * 86400 + DIGITS2(str+9) * 3600 +
+                 DIGITS2(str+12) * 60 + DIGITS2(str+15);
+#undef DIGITS2
+  return TRUE;
+}
+
+//  parse_histo_header(line, len, &type, &timestamp, &nlines)
+// Check if line (len bytes, not necessarily null-terminated) starts with a
+// history record header "TI yyyymmddThh:mm:ssZ LLL ", and parse it.
+// p_timestamp can be NULL.
+// Returns the offset of the space before the record data, or 0 if the
+// header is not valid.
+guint parse_histo_header(const char *line, gsize len, guchar *p_type,
+                         time_t *p_timestamp, guint *p_nlines)
+{
+  guint i, nlines = 0;
+  time_t timestamp;
+
+  if (len < 26 || (line[0] != 'M' && line[0] != 'S') || line[2] != ' ' ||
+      line[21] != ' ' || !parse_histo_timestamp(line+3, &timestamp))
+    return 0;
+  // The number of lines can be written with 3 or 4 bytes.
+  for (i = 22; i < 26 && i < len && isdigit((unsigned char)line[i]); i++)
+    nlines = nlines * 10 + (line[i] - '0');
+  if (i < 25 || i >= len || line[i] != ' ')
+    return 0;
+
+  *p_type = line[0];
+  *p_nlines = nlines;
+  if (p_timestamp)
+    *p_timestamp = timestamp;
+  return i;
+}
+
+//  histo_month(timestamp)
+// Return the month of the (UTC) date, as a number of months since year 0.
+int histo_month(time_t timestamp)
+{
+  struct tm tm;
+
+  gmtime_r(&timestamp, &tm);
+  return (tm.tm_year + 1900) * 12 + tm.tm_mon;
+}
+
+//  is_segment_suffix(suffix)
+// Check if the file name suffix is ".yyyy-mm", optionally followed by
+// ".gz".
+gboolean is_segment_suffix(const char *suffix)
+{
+  static const char format[] = ".dddd-dd";
+  guint i;
+
+  for (i = 0; i < HLOG_SEGMENT_SUFFIX_LEN; i++) {
+    if (format[i] == 'd' ? !isdigit((unsigned char)suffix[i])
+                         : suffix[i] != format[i])
+      return FALSE;
+  }
+  suffix += HLOG_SEGMENT_SUFFIX_LEN;
+  return !*suffix || !strcmp(suffix, ".gz");
+}
+
+/* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
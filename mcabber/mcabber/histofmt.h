@@ -0,0 +1,23 @@
+#ifndef __MCABBER_HISTOFMT_H__
+#define __MCABBER_HISTOFMT_H__ 1
+
+#include <time.h>
+#include <glib.h>
+
+/* Line format: "TI yyyymmddThh:mm:ssZ LLL [data]"
+ * T=Type, I=Info, yyyymmddThh:mm:ssZ=date, LLL=0-padded-len
+ * (see write_histo_line() in histolog.c)
+ */
+
+// Segment files are named "<jid>.yyyy-mm", with an optional ".gz" suffix
+#define HLOG_SEGMENT_SUFFIX_LEN 8   // ".yyyy-mm"
+
+gboolean parse_histo_timestamp(const char *str, time_t *p_timestamp);
+guint parse_histo_header(const char *line, gsize len, guchar *p_type,
+                         time_t *p_timestamp, guint *p_nlines);
+int histo_month(time_t timestamp);
+gboolean is_segment_suffix(const char *suffix);
+
+#endif /* __MCABBER_HISTOFMT_H__ */
+
+/* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
@@ -30,18 +30,102 @@
 #include <unistd.h>
 
 #include "histolog.h"
+#include "histofmt.h"
 #include "hbuf.h"
 #include "utils.h"
+#include "utf8.h"
 #include "screen.h"
 #include "settings.h"
 #include "utils.h"
 #include "roster.h"
 #include "xmpp.h"
 
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
+
 static guint UseFileLogging;
 static guint FileLoadLogs;
+static guint UseSegments;
 static char *RootDir;
 
+// With the logging_segments option, the history file only contains the
+// records of the current month.  The records of the previous months are
+// moved to segments named "<jid>.yyyy-mm" (the month of their first record),
+// which are compressed ("<jid>.yyyy-mm.gz") if zlib is available.
+#define HLOG_COMPRESS_CHUNK     262144
+
+#ifdef HAVE_LIBZ
+typedef gzFile hlog_segfile;
+# define hlog_segopen(name)             gzopen(name, "rb")
+# define hlog_seggets(f, buf, len)      gzgets(f, buf, len)
+# define hlog_segclose(f)               gzclose(f)
+# define hlog_segseek(f, off)           (gzseek(f, off, SEEK_SET) < 0)
+#else
+typedef FILE *hlog_segfile;
+# define hlog_segopen(name)             fopen(name, "r")
+# define hlog_seggets(f, buf, len)      fgets(buf, len, f)
+# define hlog_segclose(f)               fclose(f)
+# define hlog_segseek(f, off)           fseeko(f, off, SEEK_SET)
+#endif
+
+// History files being written.  Records are buffered and written when the
+// buffer is full, when the flush timer expires, or immediately depending on
+// the logging_sync option.  Only HLOG_MAX_OPEN_FILES files are kept open;
+// the least recently used ones are closed first.  The state of the closed
+// files (size, index and segment) is kept, so that it does not need to be
+// read again when they are reopened.
+#define HLOG_MAX_OPEN_FILES 16
+#define HLOG_WRITE_BUFSIZE  8192
+#define HLOG_FLUSH_DELAY    2     // seconds
+
+// Each history file has an index file (same name in the HLOG_INDEX_DIR
+// subdirectory, so that it cannot be mistaken for the history of a jid),
+// with the timestamp and the offset of one record every HLOG_INDEX_INTERVAL
+// bytes, so that we can seek to a given date.  The index is updated when
+// records are written, and rebuilt when it is missing or out of date.
+// Older versions used to write the index next to the history file, with
+// the HLOG_OLD_INDEX_SUFFIX suffix.
+#define HLOG_INDEX_DIR      ".index"
+#define HLOG_OLD_INDEX_SUFFIX ".idx"
+#define HLOG_INDEX_INTERVAL 65536
+
+typedef struct {
+  char *filename;
+  int fd;
+  GString *buffer;
+  GList *lru_link;      // Link in hlog_files_lru, if the file is open
+  off_t size;           // File size, including the buffered records
+  off_t indexed;        // Offset of the last indexed record
+  gboolean index_ok;    // The index file is up to date
+  int month;            // Month of the first record (segments), or -1
+  gboolean rotate_failed; // The file could not be moved to a segment
+  GSList *jid_files;    // Keys of this file in hlog_jid_files
+} hlog_file;
+
+static GHashTable *hlog_files;    // filename -> hlog_file
+// With segments, the history file of a jid can be a symbolic link; the
+// link is resolved when the file is opened.
+static GHashTable *hlog_jid_files;  // jid filename -> hlog_file
+// Segments of the history files (see hlog_segments_get()): filename ->
+// list of the segment names, the newest first.  The logging directory is
+// only read the first time the segments of a file are needed, the lists
+// are updated when segments are created or compressed.
+static GHashTable *hlog_segments;
+
+// Readers which have not opened their files yet.  The size of the history
+// file is saved before records are appended, see hlog_reader_create().
+static GSList *hlog_pending_readers;
+static gboolean hlog_readers_mark(const char *jidfile);
+static void hlog_readers_set_limit(off_t size);
+static GQueue hlog_files_lru = G_QUEUE_INIT;
+static guint hlog_flush_source;
+
+// The state file is saved HLOG_STATE_DELAY seconds after the unread
+// messages list has changed.
+#define HLOG_STATE_DELAY    1     // seconds
+static guint hlog_state_source;
+
 
 //  user_histo_file(jid)
 // Returns history filename for the given jid
@@ -74,22 +158,2478 @@ char *hlog_get_log_jid(const char *bjid)
   char *path;
   char *log_jid = NULL;
 
-  path = user_histo_file(bjid);
-  while (path) {
-    if (lstat(path, &bufstat) != 0)
-      break;
-    if (S_ISLNK(bufstat.st_mode)) {
-      g_free(log_jid);
-      log_jid = g_new0(char, bufstat.st_size+1);
-      if (readlink(path, log_jid, bufstat.st_size) < 0) return NULL;
-      g_free(path);
-      path = user_histo_file(log_jid);
-    } else
-      break;
+  path = user_histo_file(bjid);
+  while (path) {
+    if (lstat(path, &bufstat) != 0)
+      break;
+    if (S_ISLNK(bufstat.st_mode)) {
+      g_free(log_jid);
+      log_jid = g_new0(char, bufstat.st_size+1);
+      if (readlink(path, log_jid, bufstat.st_size) < 0) return NULL;
+      g_free(path);
+      path = user_histo_file(log_jid);
+    } else
+      break;
+  }
+
+  g_free(path);
+  return log_jid;
+}
+
+//  hlog_index_filename(filename)
+// Return the name of the index file of a history file (to be freed).
+static char *hlog_index_filename(const char *filename)
+{
+  char *dir = g_path_get_dirname(filename);
+  char *base = g_path_get_basename(filename);
+  char *idxname = g_strdup_printf("%s/%s/%s", dir, HLOG_INDEX_DIR, base);
+
+  g_free(dir);
+  g_free(base);
+  return idxname;
+}
+
+//  hlog_index_old_remove(path)
+// Remove an index file left over by a previous version, if it looks like
+// one: it could also be the history of a jid ending with the suffix.
+static void hlog_index_old_remove(const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  char line[64];
+  gboolean is_index = TRUE;
+
+  if (!fp)
+    return;
+  if (fgets(line, sizeof line, fp)) {
+    char *end;
+    g_ascii_strtoll(line, &end, 10);
+    if (end == line || *end != ' ')
+      is_index = FALSE;
+    else {
+      char *p = end + 1;
+      g_ascii_strtoll(p, &end, 10);
+      if (end == p || *end != '\n')
+        is_index = FALSE;
+    }
+  }
+  fclose(fp);
+  if (is_index)
+    unlink(path);
+}
+
+//  hlog_index_dir_init()
+// Create the index directory.  The first time, the index files written
+// next to the history files by previous versions are removed.
+static void hlog_index_dir_init(void)
+{
+  char *dirname = g_strdup_printf("%s%s", RootDir, HLOG_INDEX_DIR);
+  GDir *dir;
+  const char *name;
+
+  if (mkdir(dirname, 0700)) {
+    if (errno != EEXIST)
+      scr_LogPrint(LPRINT_LOGNORM, "Cannot create the history index "
+                   "directory");
+    g_free(dirname);
+    return;
+  }
+  g_free(dirname);
+
+  dir = g_dir_open(RootDir, 0, NULL);
+  if (!dir)
+    return;
+  while ((name = g_dir_read_name(dir))) {
+    if (*name != '.' && g_str_has_suffix(name, HLOG_OLD_INDEX_SUFFIX)) {
+      char *path = g_strdup_printf("%s%s", RootDir, name);
+      hlog_index_old_remove(path);
+      g_free(path);
+    }
+  }
+  g_dir_close(dir);
+}
+
+//  hlog_index_read(filename)
+// Read the index of the history file.  The entries (timestamp and offset)
+// are stored as pairs in the returned array, which must be freed by the
+// caller.
+// Returns NULL if the index file cannot be read.
+static GArray *hlog_index_read(const char *filename)
+{
+  char *idxname = hlog_index_filename(filename);
+  FILE *fp = fopen(idxname, "r");
+  GArray *entries;
+  char line[64];
+
+  g_free(idxname);
+  if (!fp)
+    return NULL;
+
+  entries = g_array_new(FALSE, FALSE, sizeof(gint64));
+  while (fgets(line, sizeof line, fp)) {
+    gint64 ts, offset;
+    char *end;
+
+    ts = g_ascii_strtoll(line, &end, 10);
+    if (*end != ' ')
+      break;
+    offset = g_ascii_strtoll(end+1, &end, 10);
+    if (*end != '\n')
+      break;
+    g_array_append_val(entries, ts);
+    g_array_append_val(entries, offset);
+  }
+  fclose(fp);
+  return entries;
+}
+
+//  hlog_index_check_entry(fp, size, timestamp, offset)
+// Check that there is a record with this timestamp at this offset of the
+// history file.
+static gboolean hlog_index_check_entry(FILE *fp, off_t size, time_t timestamp,
+                                       off_t offset)
+{
+  char line[32];
+  guchar type;
+  guint nlines;
+  time_t ts;
+
+  if (offset < 0 || offset >= size || fseeko(fp, offset, SEEK_SET) ||
+      !fgets(line, sizeof line, fp))
+    return FALSE;
+  if (offset && (fseeko(fp, offset-1, SEEK_SET) || getc(fp) != '\n'))
+    return FALSE;
+  return parse_histo_header(line, strlen(line), &type, &ts, &nlines) &&
+         ts == timestamp;
+}
+
+// Index files being rebuilt, HLOG_INDEX_STEP bytes of the history file
+// are read per idle call.  Until the index is rebuilt, the history files
+// are scanned backwards (see hlog_find_start_offset()).
+#define HLOG_INDEX_STEP     (1024*1024)
+
+typedef struct {
+  char *filename;
+  FILE *fp;
+  off_t pos;            // Offset of the next line
+  GArray *entries;
+  gint64 last;          // Offset of the last entry
+  guint skip;           // Remaining lines of the current record
+  gboolean bol;
+} hlog_index_job;
+
+static GQueue hlog_index_jobs = G_QUEUE_INIT;
+static guint hlog_index_source;
+
+static gboolean hlog_file_flush(hlog_file *hf);
+
+static void hlog_index_job_free(hlog_index_job *job)
+{
+  if (job->fp)
+    fclose(job->fp);
+  g_array_free(job->entries, TRUE);
+  g_free(job->filename);
+  g_free(job);
+}
+
+//  hlog_index_job_end(job)
+// Write the index file, and update the state of the history file if it is
+// being written.
+static void hlog_index_job_end(hlog_index_job *job)
+{
+  char *idxname;
+  FILE *idxfp;
+  hlog_file *hf;
+
+  idxname = hlog_index_filename(job->filename);
+  idxfp = fopen(idxname, "w");
+  g_free(idxname);
+  if (idxfp) {
+    guint i;
+    for (i = 0; i+1 < job->entries->len; i += 2)
+      fprintf(idxfp, "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+              g_array_index(job->entries, gint64, i),
+              g_array_index(job->entries, gint64, i+1));
+    fclose(idxfp);
+  }
+
+  if (hlog_files && (hf = g_hash_table_lookup(hlog_files, job->filename))) {
+    hf->index_ok = (idxfp != NULL && hf->size == job->pos);
+    hf->indexed = job->last;
+  }
+}
+
+//  hlog_index_step(job)
+// Index the next HLOG_INDEX_STEP bytes of the history file.
+// Returns FALSE when the index has been written (or cannot be).
+static gboolean hlog_index_step(hlog_index_job *job)
+{
+  char line[64];
+  off_t stop = job->pos + HLOG_INDEX_STEP;
+  hlog_file *hf = NULL;
+
+  if (!job->fp) {
+    job->fp = fopen(job->filename, "r");
+    if (!job->fp)
+      return FALSE;
+  }
+
+  while (job->pos < stop) {
+    gsize n;
+    guchar type;
+    guint nlines;
+    time_t ts;
+
+    if (!fgets(line, sizeof line, job->fp)) {
+      // Index the records written meanwhile as well
+      if (!hf && hlog_files &&
+          (hf = g_hash_table_lookup(hlog_files, job->filename)) &&
+          hf->size > job->pos && hlog_file_flush(hf)) {
+        clearerr(job->fp);
+        continue;
+      }
+      break;
+    }
+    n = strlen(line);
+    if (!n)
+      break; // NUL character, we cannot go further
+    if (job->bol) {
+      if (job->skip) {
+        job->skip--;
+      } else if (parse_histo_header(line, n, &type, &ts, &nlines)) {
+        job->skip = nlines;
+        if (job->pos >= job->last + HLOG_INDEX_INTERVAL) {
+          gint64 ts64 = ts, pos64 = job->pos;
+          g_array_append_val(job->entries, ts64);
+          g_array_append_val(job->entries, pos64);
+          job->last = job->pos;
+        }
+      }
+    }
+    job->bol = (line[n-1] == '\n');
+    job->pos += n;
+  }
+  if (job->pos >= stop)
+    return TRUE;
+
+  hlog_index_job_end(job);
+  return FALSE;
+}
+
+static gboolean hlog_index_idle_callback(gpointer data)
+{
+  hlog_index_job *job = g_queue_peek_head(&hlog_index_jobs);
+
+  if (job && !hlog_index_step(job)) {
+    g_queue_pop_head(&hlog_index_jobs);
+    hlog_index_job_free(job);
+  }
+  if (g_queue_is_empty(&hlog_index_jobs)) {
+    // source will be destroyed after return
+    hlog_index_source = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static gint hlog_index_job_cmp(gconstpointer a, gconstpointer b)
+{
+  return strcmp(((const hlog_index_job *)a)->filename, b);
+}
+
+//  hlog_index_schedule(filename)
+// Rebuild the index of the history file in the background.
+static void hlog_index_schedule(const char *filename)
+{
+  hlog_index_job *job;
+
+  if (g_queue_find_custom(&hlog_index_jobs, filename, hlog_index_job_cmp))
+    return;
+  job = g_new0(hlog_index_job, 1);
+  job->filename = g_strdup(filename);
+  job->entries = g_array_new(FALSE, FALSE, sizeof(gint64));
+  job->last = -HLOG_INDEX_INTERVAL;
+  job->bol = TRUE;
+  g_queue_push_tail(&hlog_index_jobs, job);
+  if (!hlog_index_source)
+    hlog_index_source = g_idle_add(hlog_index_idle_callback, NULL);
+}
+
+//  hlog_index_cancel(filename)
+// Stop rebuilding the index of the history file (all of them if filename
+// is NULL).
+static void hlog_index_cancel(const char *filename)
+{
+  GList *elt, *next;
+
+  for (elt = hlog_index_jobs.head; elt; elt = next) {
+    hlog_index_job *job = elt->data;
+    next = elt->next;
+    if (!filename || !strcmp(job->filename, filename)) {
+      g_queue_delete_link(&hlog_index_jobs, elt);
+      hlog_index_job_free(job);
+    }
+  }
+  if (g_queue_is_empty(&hlog_index_jobs) && hlog_index_source) {
+    g_source_remove(hlog_index_source);
+    hlog_index_source = 0;
+  }
+}
+
+//  hlog_index_add(hf, timestamp)
+// Update the index of the history file, before a record is appended.
+static void hlog_index_add(hlog_file *hf, time_t timestamp)
+{
+  char *idxname;
+  FILE *fp;
+
+  if (!hf->index_ok || hf->size < hf->indexed + HLOG_INDEX_INTERVAL)
+    return;
+
+  idxname = hlog_index_filename(hf->filename);
+  fp = fopen(idxname, "a");
+  g_free(idxname);
+  if (!fp) {
+    hf->index_ok = FALSE;
+    return;
+  }
+  fprintf(fp, "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+          (gint64)timestamp, (gint64)hf->size);
+  fclose(fp);
+  hf->indexed = hf->size;
+}
+
+//  hlog_index_init(hf)
+// Check the index of a history file we are going to write to.
+// If the index is missing or out of date, it will be rebuilt when it is
+// needed.
+static void hlog_index_init(hlog_file *hf)
+{
+  struct stat bufstat;
+  GArray *entries;
+  FILE *fp;
+
+  if (stat(hf->filename, &bufstat) || !bufstat.st_size) {
+    // New file, create an empty index (an old one could be left over)
+    char *idxname = hlog_index_filename(hf->filename);
+    hf->size = 0;
+    hf->indexed = -HLOG_INDEX_INTERVAL;
+    fp = fopen(idxname, "w");
+    g_free(idxname);
+    hf->index_ok = (fp != NULL);
+    if (fp)
+      fclose(fp);
+    return;
+  }
+
+  hf->size = bufstat.st_size;
+  hf->index_ok = FALSE;
+  entries = hlog_index_read(hf->filename);
+  if (!entries)
+    return;
+
+  if (entries->len) {
+    // Check the last entry
+    time_t ts = g_array_index(entries, gint64, entries->len-2);
+    off_t offset = g_array_index(entries, gint64, entries->len-1);
+    fp = fopen(hf->filename, "r");
+    if (fp) {
+      hf->index_ok = hlog_index_check_entry(fp, hf->size, ts, offset);
+      hf->indexed = offset;
+      fclose(fp);
+    }
+  } else if (hf->size < HLOG_INDEX_INTERVAL) {
+    hf->index_ok = TRUE;
+    hf->indexed = -HLOG_INDEX_INTERVAL;
+  }
+  g_array_free(entries, TRUE);
+}
+
+//  hlog_index_find(filename, fp, size, starttime)
+// Look up the index of the history file (fp, size bytes), and return the
+// offset of the last indexed record older than starttime (0 if there is
+// none).
+// Returns -1 if there is no usable index; the index is then rebuilt in the
+// background.
+static off_t hlog_index_find(const char *filename, FILE *fp, off_t size,
+                             time_t starttime)
+{
+  GArray *entries = hlog_index_read(filename);
+  off_t offset = 0;
+  guint i;
+
+  // The last entry must be valid.  (Missing entries at the end would only
+  // make us read a bit more.)
+  if (entries && entries->len) {
+    if (!hlog_index_check_entry(fp, size,
+                                g_array_index(entries, gint64,
+                                              entries->len-2),
+                                g_array_index(entries, gint64,
+                                              entries->len-1))) {
+      g_array_free(entries, TRUE);
+      entries = NULL;
+    }
+  } else if (entries && size >= HLOG_INDEX_INTERVAL) {
+    g_array_free(entries, TRUE);
+    entries = NULL;
+  }
+  if (!entries) {
+    // (We do not write to the logging directory if logging is disabled)
+    if (UseFileLogging)
+      hlog_index_schedule(filename);
+    return -1;
+  }
+
+  for (i = entries->len; i >= 2; i -= 2) {
+    if (g_array_index(entries, gint64, i-2) <= starttime) {
+      offset = g_array_index(entries, gint64, i-1);
+      break;
+    }
+  }
+  g_array_free(entries, TRUE);
+  return offset;
+}
+
+static void hlog_segment_init(hlog_file *hf);
+
+//  hlog_file_check(hf)
+// Check the state of a history file which has just been (re)opened: if the
+// file has been modified by another program while it was closed, its state
+// is read again.
+static void hlog_file_check(hlog_file *hf)
+{
+  struct stat bufstat;
+
+  if (fstat(hf->fd, &bufstat) ||
+      bufstat.st_size == hf->size - (off_t)hf->buffer->len)
+    return;
+  // The buffered records are not indexed, the index will be completed
+  // when it is rebuilt.
+  hlog_index_init(hf);
+  hf->size += hf->buffer->len;
+  if (UseSegments)
+    hlog_segment_init(hf);
+}
+
+//  hlog_file_flush(hf)
+// Write the buffered records of the file to disk.
+// Returns FALSE in case of error.
+static gboolean hlog_file_flush(hlog_file *hf)
+{
+  const char *p = hf->buffer->str;
+  gsize left = hf->buffer->len;
+
+  if (!left)
+    return TRUE;
+
+  if (hf->fd < 0) {
+    // Close the least recently used file if there are too many open files
+    if (hlog_files_lru.length >= HLOG_MAX_OPEN_FILES) {
+      hlog_file *old = g_queue_peek_tail(&hlog_files_lru);
+      hlog_file_flush(old);
+      close(old->fd);
+      old->fd = -1;
+      g_queue_delete_link(&hlog_files_lru, old->lru_link);
+      old->lru_link = NULL;
+      // Only the state of the file is kept, not the buffer memory
+      g_string_free(old->buffer, TRUE);
+      old->buffer = g_string_new(NULL);
+    }
+    hf->fd = open(hf->filename, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (hf->fd < 0) {
+      g_string_truncate(hf->buffer, 0);
+      scr_LogPrint(LPRINT_LOGNORM, "Unable to write history "
+                   "(cannot open logfile)");
+      return FALSE;
+    }
+    hlog_file_check(hf);
+    g_queue_push_head(&hlog_files_lru, hf);
+    hf->lru_link = hlog_files_lru.head;
+  } else if (hf->lru_link != hlog_files_lru.head) {
+    g_queue_unlink(&hlog_files_lru, hf->lru_link);
+    g_queue_push_head_link(&hlog_files_lru, hf->lru_link);
+  }
+
+  while (left) {
+    ssize_t n = write(hf->fd, p, left);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      g_string_truncate(hf->buffer, 0);
+      scr_LogPrint(LPRINT_LOGNORM, "Error while writing to log file: %s",
+                   strerror(errno));
+      return FALSE;
+    }
+    p += n;
+    left -= n;
+  }
+  g_string_truncate(hf->buffer, 0);
+
+  if (settings_opt_get_int("logging_sync") > 1) {
+#ifdef HAVE_FDATASYNC
+    fdatasync(hf->fd);
+#else
+    fsync(hf->fd);
+#endif
+  }
+  return TRUE;
+}
+
+static void hlog_file_close(hlog_file *hf)
+{
+  hlog_file_flush(hf);
+  if (hf->fd >= 0)
+    close(hf->fd);
+  if (hf->lru_link)
+    g_queue_delete_link(&hlog_files_lru, hf->lru_link);
+  while (hf->jid_files) {
+    char *jidfile = hf->jid_files->data;
+    g_hash_table_remove(hlog_jid_files, jidfile);
+    g_free(jidfile);
+    hf->jid_files = g_slist_delete_link(hf->jid_files, hf->jid_files);
+  }
+  g_string_free(hf->buffer, TRUE);
+  g_free(hf->filename);
+  g_free(hf);
+}
+
+static void flush_file(gpointer key, gpointer value, gpointer data)
+{
+  hlog_file_flush(value);
+}
+
+static void hlog_search_flush(void);
+static void hlog_search_abort(void);
+static void hlog_search_rename(const char *filename, const char *newname);
+
+//  hlog_flush()
+// Write all the buffered history records to disk.
+// (The pending search index postings are written when there are enough of
+// them, see hlog_search_add_words(), and when the files are closed.)
+void hlog_flush(void)
+{
+  if (hlog_files)
+    g_hash_table_foreach(hlog_files, flush_file, NULL);
+  if (hlog_flush_source) {
+    g_source_remove(hlog_flush_source);
+    hlog_flush_source = 0;
+  }
+}
+
+static gboolean hlog_flush_timeout_callback(gpointer data)
+{
+  if (hlog_files)
+    g_hash_table_foreach(hlog_files, flush_file, NULL);
+  // source will be destroyed after return
+  hlog_flush_source = 0;
+  return FALSE;
+}
+
+static void hlog_compress_abort(void);
+static void hlog_page_cache_clear(void);
+
+//  hlog_close_files()
+// Write the buffered history records and close all the history files.
+void hlog_close_files(void)
+{
+  hlog_compress_abort();
+  hlog_search_abort();
+  hlog_index_cancel(NULL);
+  hlog_page_cache_clear();
+  hlog_flush();
+  if (hlog_files) {
+    g_hash_table_destroy(hlog_files);
+    hlog_files = NULL;
+  }
+  if (hlog_segments) {
+    g_hash_table_destroy(hlog_segments);
+    hlog_segments = NULL;
+  }
+  if (hlog_jid_files) {
+    g_hash_table_destroy(hlog_jid_files);
+    hlog_jid_files = NULL;
+  }
+}
+
+//  hlog_flush_filename(filename)
+// Write the buffered records of the given file, if any.
+static void hlog_flush_filename(const char *filename)
+{
+  hlog_file *hf;
+
+  if (hlog_files && (hf = g_hash_table_lookup(hlog_files, filename)))
+    hlog_file_flush(hf);
+}
+
+static void segments_free(gpointer data)
+{
+  g_slist_free_full(data, g_free);
+}
+
+//  hlog_segments_scan(filename)
+// Read the segments of the history file from the logging directory.
+static GSList *hlog_segments_scan(const char *filename)
+{
+  char *dirname = g_path_get_dirname(filename);
+  char *basename = g_path_get_basename(filename);
+  gsize len = strlen(basename);
+  GSList *segments = NULL, *elt, *next;
+  const char *name;
+  GDir *dir;
+
+  dir = g_dir_open(dirname, 0, NULL);
+  if (dir) {
+    while ((name = g_dir_read_name(dir))) {
+      if (strncmp(name, basename, len) || !is_segment_suffix(name + len))
+        continue;
+#ifndef HAVE_LIBZ
+      if (name[len + HLOG_SEGMENT_SUFFIX_LEN])
+        continue; // We cannot read compressed segments
+#endif
+      segments = g_slist_prepend(segments,
+                                 g_build_filename(dirname, name, NULL));
+    }
+    g_dir_close(dir);
+  }
+  g_free(basename);
+  g_free(dirname);
+
+  // Newest first; "x.yyyy-mm.gz" comes before "x.yyyy-mm"
+  segments = g_slist_sort(segments, (GCompareFunc)strcmp);
+  segments = g_slist_reverse(segments);
+
+  for (elt = segments; elt; elt = next) {
+    gsize nlen = strlen(elt->data);
+
+    next = g_slist_next(elt);
+    // If the compression has been interrupted, both files can exist
+    if (next && nlen == strlen(next->data) + 3 &&
+        !strncmp(elt->data, next->data, nlen - 3)) {
+      g_free(elt->data);
+      segments = g_slist_delete_link(segments, elt);
+    }
+  }
+  return segments;
+}
+
+//  hlog_segments_get(filename)
+// Return the segments of the history file, the newest first.
+// The list belongs to the cache and must not be modified.
+static const GSList *hlog_segments_get(const char *filename)
+{
+  GSList *segments;
+
+  if (!hlog_segments)
+    hlog_segments = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          g_free, segments_free);
+  if (g_hash_table_lookup_extended(hlog_segments, filename, NULL,
+                                   (gpointer *)&segments))
+    return segments;
+  segments = hlog_segments_scan(filename);
+  g_hash_table_insert(hlog_segments, g_strdup(filename), segments);
+  return segments;
+}
+
+//  hlog_segments_add(filename, segname)
+// Add a new segment (the newest one) to the cached list of the file.
+static void hlog_segments_add(const char *filename, const char *segname)
+{
+  GSList *segments;
+  gpointer key;
+
+  // If the list is not cached, it will be read from the directory
+  if (!hlog_segments ||
+      !g_hash_table_lookup_extended(hlog_segments, filename, &key,
+                                    (gpointer *)&segments))
+    return;
+  // (The list must not be freed when its head is replaced)
+  g_hash_table_steal(hlog_segments, filename);
+  segments = g_slist_prepend(segments, g_strdup(segname));
+  g_hash_table_insert(hlog_segments, key, segments);
+}
+
+#ifdef HAVE_LIBZ
+//  hlog_segments_compressed(segname)
+// The segment has been compressed, update the cached list of its file.
+static void hlog_segments_compressed(const char *segname)
+{
+  char *filename;
+  GSList *segments, *elt;
+
+  if (!hlog_segments)
+    return;
+  filename = g_strndup(segname, strlen(segname) - HLOG_SEGMENT_SUFFIX_LEN);
+  if (g_hash_table_lookup_extended(hlog_segments, filename, NULL,
+                                   (gpointer *)&segments)) {
+    for (elt = segments; elt; elt = g_slist_next(elt)) {
+      if (!strcmp(elt->data, segname)) {
+        g_free(elt->data);
+        elt->data = g_strdup_printf("%s.gz", segname);
+        break;
+      }
+    }
+  }
+  g_free(filename);
+}
+#endif
+
+#ifdef HAVE_LIBZ
+// Segments waiting to be compressed; the first one is being compressed.
+static GQueue hlog_compress_queue = G_QUEUE_INIT;
+static guint hlog_compress_source;
+static FILE *compress_in;
+static gzFile compress_out;
+
+//  hlog_compress_end(success)
+// Finish the compression of the first segment of the queue.  The segment
+// is replaced by the compressed file if success is TRUE.
+static void hlog_compress_end(gboolean success)
+{
+  char *segname = g_queue_pop_head(&hlog_compress_queue);
+  char *gzname = g_strdup_printf("%s.gz", segname);
+  char *tmpname = g_strdup_printf("%s.tmp", gzname);
+
+  if (compress_in)
+    fclose(compress_in);
+  if (compress_out && gzclose(compress_out) != Z_OK)
+    success = FALSE;
+  compress_in = NULL;
+  compress_out = NULL;
+
+  if (success && !rename(tmpname, gzname)) {
+    unlink(segname);
+    hlog_segments_compressed(segname);
+  } else {
+    unlink(tmpname);
+    scr_LogPrint(LPRINT_LOGNORM, "Cannot compress history segment <%s>",
+                 segname);
+  }
+  g_free(tmpname);
+  g_free(gzname);
+  g_free(segname);
+}
+
+//  hlog_compress_idle_callback()
+// Compress a chunk of the first segment of the queue.
+// This is done when the main loop is idle, because it can take a while.
+static gboolean hlog_compress_idle_callback(gpointer data)
+{
+  const char *segname = g_queue_peek_head(&hlog_compress_queue);
+  char buf[8192];
+  gsize done = 0;
+
+  if (!segname) {
+    // source will be destroyed after return
+    hlog_compress_source = 0;
+    return FALSE;
+  }
+
+  if (!compress_in) {
+    char *tmpname = g_strdup_printf("%s.gz.tmp", segname);
+    compress_in = fopen(segname, "r");
+    if (compress_in)
+      compress_out = gzopen(tmpname, "wb");
+    g_free(tmpname);
+    if (!compress_out) {
+      hlog_compress_end(FALSE);
+      return TRUE;
+    }
+  }
+
+  while (done < HLOG_COMPRESS_CHUNK) {
+    size_t n = fread(buf, 1, sizeof buf, compress_in);
+    if (!n) {
+      hlog_compress_end(!ferror(compress_in));
+      break;
+    }
+    if (gzwrite(compress_out, buf, n) != (int)n) {
+      hlog_compress_end(FALSE);
+      break;
+    }
+    done += n;
+  }
+  return TRUE;
+}
+#endif
+
+//  hlog_compress_segment(segname)
+// Compress the segment in the background, if zlib is available.
+// segname is freed by this function.
+static void hlog_compress_segment(char *segname)
+{
+#ifdef HAVE_LIBZ
+  g_queue_push_tail(&hlog_compress_queue, segname);
+  if (!hlog_compress_source)
+    hlog_compress_source = g_idle_add(hlog_compress_idle_callback, NULL);
+#else
+  g_free(segname);
+#endif
+}
+
+//  hlog_compress_abort()
+// Stop compressing segments (the pending ones are left uncompressed).
+static void hlog_compress_abort(void)
+{
+#ifdef HAVE_LIBZ
+  char *segname;
+
+  if (compress_in)
+    hlog_compress_end(FALSE);
+  while ((segname = g_queue_pop_head(&hlog_compress_queue)))
+    g_free(segname);
+  if (hlog_compress_source) {
+    g_source_remove(hlog_compress_source);
+    hlog_compress_source = 0;
+  }
+#endif
+}
+
+//  hlog_segment_init(hf)
+// Get the month of the first record of a history file we are going to
+// write to.
+static void hlog_segment_init(hlog_file *hf)
+{
+  char line[32];
+  guchar type;
+  guint nlines;
+  time_t ts;
+  FILE *fp;
+
+  hf->month = -1;
+  fp = fopen(hf->filename, "r");
+  if (!fp)
+    return;
+  if (fgets(line, sizeof line, fp) &&
+      parse_histo_header(line, strlen(line), &type, &ts, &nlines))
+    hf->month = histo_month(ts);
+  fclose(fp);
+  // Read the segments now, the list is kept up to date from now on
+  hlog_segments_get(hf->filename);
+}
+
+//  hlog_segment_rotate(hf, timestamp)
+// Before a record is appended to the history file, move the file to a
+// segment if the record belongs to a new month.
+static void hlog_segment_rotate(hlog_file *hf, time_t timestamp)
+{
+  int month = histo_month(timestamp);
+  struct stat bufstat;
+  char *segname, *gzname;
+  gboolean exists;
+
+  if (hf->month < 0) {
+    // Empty file
+    hf->month = month;
+    return;
+  }
+  if (month <= hf->month)
+    return;
+
+  segname = g_strdup_printf("%s.%04d-%02d", hf->filename, hf->month / 12,
+                            hf->month % 12 + 1);
+  gzname = g_strdup_printf("%s.gz", segname);
+  exists = !stat(segname, &bufstat) || !stat(gzname, &bufstat);
+  g_free(gzname);
+
+  // Never overwrite an existing segment.
+  // If the file cannot be moved, the records are appended to it, and we
+  // will try again with the next record.
+  hlog_file_flush(hf);
+  if (exists || rename(hf->filename, segname)) {
+    if (!hf->rotate_failed)
+      scr_LogPrint(LPRINT_LOGNORM, "Cannot create history segment <%s>",
+                   segname);
+    hf->rotate_failed = TRUE;
+    g_free(segname);
+    return;
+  }
+  hf->rotate_failed = FALSE;
+  hf->month = month;
+
+  // The file has been moved, its index is not needed anymore
+  hlog_index_cancel(hf->filename);
+  if (hf->fd >= 0) {
+    close(hf->fd);
+    hf->fd = -1;
+    g_queue_delete_link(&hlog_files_lru, hf->lru_link);
+    hf->lru_link = NULL;
+  }
+  hlog_search_rename(hf->filename, segname);
+  hlog_segments_add(hf->filename, segname);
+  hlog_compress_segment(segname);
+  // The new file needs a new index
+  hlog_index_init(hf);
+}
+
+//  hlog_segment_size(segname)
+// Return the size of the segment data (uncompressed).
+static off_t hlog_segment_size(const char *segname)
+{
+  struct stat bufstat;
+  gsize len = strlen(segname);
+  guchar isize[4];
+  FILE *fp;
+
+  if (stat(segname, &bufstat))
+    return 0;
+  if (len < 3 || strcmp(segname + len - 3, ".gz"))
+    return bufstat.st_size;
+
+  // The size of the uncompressed data (modulo 2^32) is at the end of
+  // the gzip file.
+  fp = fopen(segname, "r");
+  if (!fp)
+    return 0;
+  if (fseeko(fp, -4, SEEK_END) || fread(isize, 1, 4, fp) != 4) {
+    fclose(fp);
+    return bufstat.st_size;
+  }
+  fclose(fp);
+  return isize[0] | (isize[1] << 8) | (isize[2] << 16) |
+         ((off_t)isize[3] << 24);
+}
+
+//  hlog_segments_list(filename, starttime, endtime, budget)
+// Return the segments of the history file we need to load, the oldest
+// first: the segments containing records newer than starttime (if not
+// null) and older than endtime (if not null), and at most the segments
+// needed to get budget bytes (if not null).
+static GSList *hlog_segments_list(const char *filename, time_t starttime,
+                                  time_t endtime, gsize budget)
+{
+  const GSList *elt;
+  GSList *segments = NULL;
+  gsize total = 0;
+
+  for (elt = hlog_segments_get(filename); elt; elt = g_slist_next(elt)) {
+    const char *segname = elt->data;
+    gsize nlen = strlen(segname);
+    int month;
+
+    if (segname[nlen-1] == 'z')
+      nlen -= 3;
+    month = atoi(segname + nlen - 7) * 12 + atoi(segname + nlen - 2) - 1;
+
+    // Skip the segments which only contain records newer than endtime
+    if (endtime && month > histo_month(endtime))
+      continue;
+
+    segments = g_slist_prepend(segments, g_strdup(segname));
+    // Do we need the older segments?
+    if (budget) {
+      total += hlog_segment_size(segname);
+      if (total >= budget)
+        break;
+    }
+    if (starttime && month <= histo_month(starttime))
+      break;
+  }
+  return segments;
+}
+
+// Full-text search index (logging_search_index option)
+// The index is stored in the HLOG_SEARCH_DIR subdirectory of the logging
+// directory.  The words of the messages are dispatched in
+// HLOG_SEARCH_BUCKETS buckets (by word hash).  Each bucket is a set of
+// sorted runs, written when the pending postings are flushed:
+//  - "bb.N.dict" is the term dictionary of the run: fixed-size records
+//    (the word, padded to HLOG_SEARCH_MAXWORD bytes, and the offset and
+//    length of its postings), sorted by word;
+//  - "bb.N" contains the postings lists, one "id timestamp offset\n" line
+//    per record containing the word; id is the id of the history file.
+// The runs of a bucket are merged when the newest one is at least half the
+// size of the previous one, so that a bucket has few runs.  The pending
+// postings are written and the runs are merged from the idle callback,
+// never from the write path.
+// The "files" file contains the id of each history file (and segment),
+// and the number of bytes already indexed.  When a file has to be indexed
+// again, it gets a new id: the postings of the previous id are ignored,
+// and dropped when the runs are merged (all the runs are merged in the
+// background after that).
+// New records are indexed when they are written; the files which are not
+// up to date (e.g. when the index is created) are indexed in the
+// background, from an idle callback.
+#define HLOG_SEARCH_DIR       ".search"
+#define HLOG_SEARCH_VERSION   2
+#define HLOG_SEARCH_BUCKETS   16
+#define HLOG_SEARCH_RECORDS   500   // Records indexed per idle call
+#define HLOG_SEARCH_RESULTS   20
+#define HLOG_SEARCH_MINWORD   2     // characters
+#define HLOG_SEARCH_MAXWORD   64    // bytes
+#define HLOG_SEARCH_BUFSIZE   (1024*1024) // Pending postings
+#define HLOG_SEARCH_MERGE_STEP 4096       // Postings merged per idle call
+#define HLOG_SEARCH_DICTREC   (HLOG_SEARCH_MAXWORD + 16)
+
+typedef struct {
+  guint id;
+  gint64 offset;        // Number of bytes indexed
+} search_file;
+
+typedef struct {
+  guint seq;            // Run number (in the file names)
+  gint64 size;          // Size of the postings file
+} search_run;
+
+static guint UseSearchIndex;
+static char *SearchDir;
+static GHashTable *search_files;  // name -> search_file
+static GHashTable *search_ids;    // id -> name (key of search_files)
+static guint search_next_id;
+static gboolean search_files_dirty;
+static GArray *search_runs[HLOG_SEARCH_BUCKETS];  // Oldest first
+static guint search_next_seq;
+static GHashTable *search_pending[HLOG_SEARCH_BUCKETS]; // word -> GString
+static gsize search_postings_size;
+static guint search_purge = HLOG_SEARCH_BUCKETS;  // Next bucket to purge
+static guint search_source;
+static GSList *search_todo;       // Files to index in the background
+static hlog_segfile search_fp;    // File being indexed
+static gint64 search_pos;         // Position in this file
+
+//  search_file_key(name)
+// Return the key of a history file in the search index (the base name,
+// without the ".gz" extension of compressed segments).
+static char *search_file_key(const char *name)
+{
+  char *key = g_path_get_basename(name);
+  gsize len = strlen(key);
+
+  if (len > 3 && !strcmp(key + len - 3, ".gz"))
+    key[len - 3] = 0;
+  return key;
+}
+
+//  search_key_is_segment(key)
+// Check if the key is the name of a segment.
+static gboolean search_key_is_segment(const char *key)
+{
+  gsize len = strlen(key);
+
+  return len > HLOG_SEGMENT_SUFFIX_LEN &&
+         is_segment_suffix(key + len - HLOG_SEGMENT_SUFFIX_LEN);
+}
+
+//  search_save_next_id()
+// The file ids must never be reused, even if the state of the index is
+// not saved: the next id is saved as soon as an id is used.
+static void search_save_next_id(void)
+{
+  char *idname = g_strdup_printf("%s/nextid", SearchDir);
+  char *tmpname = g_strdup_printf("%s.tmp", idname);
+  FILE *fp = fopen(tmpname, "w");
+
+  if (fp) {
+    fprintf(fp, "%u\n", search_next_id);
+    if (fclose(fp) || rename(tmpname, idname))
+      unlink(tmpname);
+  }
+  g_free(tmpname);
+  g_free(idname);
+}
+
+//  search_file_add(key, id, offset)
+// Add a history file to the index state.
+static search_file *search_file_add(const char *key, guint id, gint64 offset)
+{
+  search_file *sf = g_new(search_file, 1);
+  char *name = g_strdup(key);
+
+  sf->id = id;
+  sf->offset = offset;
+  g_hash_table_replace(search_files, name, sf);
+  g_hash_table_replace(search_ids, GUINT_TO_POINTER(id), name);
+  if (id >= search_next_id)
+    search_next_id = id + 1;
+  search_files_dirty = TRUE;
+  return sf;
+}
+
+//  search_file_get(key)
+// Return the index state of a history file (a new id is used for a new
+// file).
+static search_file *search_file_get(const char *key)
+{
+  search_file *sf = g_hash_table_lookup(search_files, key);
+
+  if (!sf) {
+    sf = search_file_add(key, search_next_id, 0);
+    search_save_next_id();
+  }
+  return sf;
+}
+
+//  search_file_remove(key)
+// Forget a history file: the postings of its id will be dropped.
+static void search_file_remove(const char *key)
+{
+  search_file *sf = g_hash_table_lookup(search_files, key);
+
+  if (!sf)
+    return;
+  g_hash_table_remove(search_ids, GUINT_TO_POINTER(sf->id));
+  g_hash_table_remove(search_files, key);
+  search_files_dirty = TRUE;
+  // Purge the index in the background
+  search_purge = 0;
+}
+
+static gint64 search_file_get_offset(const char *key)
+{
+  search_file *sf = g_hash_table_lookup(search_files, key);
+  return sf ? sf->offset : 0;
+}
+
+static void search_file_set_offset(const char *key, gint64 offset)
+{
+  search_file_get(key)->offset = offset;
+  search_files_dirty = TRUE;
+}
+
+//  search_tokenize(text, words)
+// Add the words of the text to the words hash table (lowercase keys, which
+// must be freed by the caller).  Words are sequences of alphanumeric
+// characters; words shorter than HLOG_SEARCH_MINWORD characters or longer
+// than HLOG_SEARCH_MAXWORD bytes are ignored.
+static void search_tokenize(const char *text, GHashTable *words)
+{
+  GString *word = g_string_new(NULL);
+  guint nchars = 0;
+  const char *p = text;
+
+  while (1) {
+    gunichar c = *p ? g_utf8_get_char_validated(p, -1) : 0;
+    gboolean valid = (c < (gunichar)-2);
+
+    if (c && valid && g_unichar_isalnum(c)) {
+      g_string_append_unichar(word, g_unichar_tolower(c));
+      nchars++;
+    } else {
+      if (nchars >= HLOG_SEARCH_MINWORD && word->len <= HLOG_SEARCH_MAXWORD &&
+          !g_hash_table_lookup(words, word->str))
+        g_hash_table_insert(words, g_strdup(word->str), words);
+      g_string_truncate(word, 0);
+      nchars = 0;
+    }
+    if (!*p)
+      break;
+    p = valid ? g_utf8_next_char(p) : p + 1;
+  }
+  g_string_free(word, TRUE);
+}
+
+static void hlog_search_start(void);
+
+static void search_string_free(GString *str)
+{
+  g_string_free(str, TRUE);
+}
+
+//  hlog_search_add_words(id, timestamp, offset, text)
+// Add the words of a message to the pending postings.
+static void hlog_search_add_words(guint id, time_t timestamp, gint64 offset,
+                                  const char *text)
+{
+  GHashTable *words = g_hash_table_new(g_str_hash, g_str_equal);
+  GHashTableIter iter;
+  gpointer w;
+  char posting[64];
+  gsize len;
+
+  len = g_snprintf(posting, sizeof posting, "%u %ld %" G_GINT64_FORMAT "\n",
+                   id, (long)timestamp, offset);
+
+  search_tokenize(text, words);
+  g_hash_table_iter_init(&iter, words);
+  while (g_hash_table_iter_next(&iter, &w, NULL)) {
+    guint bucket = g_str_hash(w) % HLOG_SEARCH_BUCKETS;
+    GString *postings;
+
+    if (!search_pending[bucket])
+      search_pending[bucket] = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                     g_free,
+                                                     (GDestroyNotify)
+                                                     search_string_free);
+    postings = g_hash_table_lookup(search_pending[bucket], w);
+    if (postings) {
+      g_free(w);
+    } else {
+      postings = g_string_new(NULL);
+      g_hash_table_insert(search_pending[bucket], w, postings);
+      search_postings_size += strlen(w) + sizeof(GString);
+    }
+    g_string_append_len(postings, posting, len);
+    search_postings_size += len;
+  }
+  g_hash_table_destroy(words);
+
+  // The postings are written by the idle callback
+  if (search_postings_size >= HLOG_SEARCH_BUFSIZE)
+    hlog_search_start();
+}
+
+//  hlog_search_add_record(key, offset, record)
+// Index a history record (header and data), written at the given offset
+// of the file.  Only messages are indexed.
+static void hlog_search_add_record(const char *key, gint64 offset,
+                                   const char *record)
+{
+  guchar type;
+  guint nlines, dataoffset;
+  time_t timestamp;
+
+  dataoffset = parse_histo_header(record, strlen(record), &type, &timestamp,
+                                  &nlines);
+  if (dataoffset && type == 'M')
+    hlog_search_add_words(search_file_get(key)->id, timestamp, offset,
+                          record + dataoffset + 1);
+}
+
+static void search_put64(guchar *p, gint64 v)
+{
+  int i;
+  for (i = 0; i < 8; i++)
+    p[i] = (guchar)(((guint64)v >> (8*i)) & 0xff);
+}
+
+static gint64 search_get64(const guchar *p)
+{
+  guint64 v = 0;
+  int i;
+  for (i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return (gint64)v;
+}
+
+//  search_word_record(word, rec)
+// Copy the word to a dictionary record (the words are compared with
+// memcmp() on HLOG_SEARCH_MAXWORD bytes).
+static void search_word_record(const char *word, guchar *rec)
+{
+  memset(rec, 0, HLOG_SEARCH_DICTREC);
+  memcpy(rec, word, MIN(strlen(word), HLOG_SEARCH_MAXWORD));
+}
+
+static char *search_run_name(guint bucket, guint seq, const char *suffix)
+{
+  return g_strdup_printf("%s/%02x.%u%s", SearchDir, bucket, seq, suffix);
+}
+
+//  search_posting_alive(line)
+// Check that the file of a posting is still indexed.
+static gboolean search_posting_alive(const char *line)
+{
+  guint id = strtoul(line, NULL, 10);
+  return g_hash_table_lookup(search_ids, GUINT_TO_POINTER(id)) != NULL;
+}
+
+// A run being written
+typedef struct {
+  guint bucket;
+  guint seq;
+  FILE *post, *dict;
+  gint64 size;          // Size of the postings written so far
+  guint nwords;
+} search_writer;
+
+//  search_writer_open(w, bucket)
+// Create the (temporary) files of a new run.
+static gboolean search_writer_open(search_writer *w, guint bucket)
+{
+  char *postname, *dictname;
+
+  memset(w, 0, sizeof *w);
+  w->bucket = bucket;
+  w->seq = search_next_seq++;
+  postname = search_run_name(bucket, w->seq, ".tmp");
+  dictname = search_run_name(bucket, w->seq, ".dict.tmp");
+  w->post = fopen(postname, "w");
+  w->dict = fopen(dictname, "w");
+  g_free(postname);
+  g_free(dictname);
+  if (w->post && w->dict)
+    return TRUE;
+  scr_LogPrint(LPRINT_LOGNORM, "Cannot write the history search index");
+  if (w->post)
+    fclose(w->post);
+  if (w->dict)
+    fclose(w->dict);
+  w->post = w->dict = NULL;
+  return FALSE;
+}
+
+//  search_writer_add(w, rec, start)
+// Add the word of the record to the dictionary, with the postings written
+// since the start offset (if any).
+static void search_writer_add(search_writer *w, const guchar *rec,
+                              gint64 start)
+{
+  guchar dictrec[HLOG_SEARCH_DICTREC];
+
+  if (w->size == start)
+    return;
+  memcpy(dictrec, rec, HLOG_SEARCH_MAXWORD);
+  search_put64(dictrec + HLOG_SEARCH_MAXWORD, start);
+  search_put64(dictrec + HLOG_SEARCH_MAXWORD + 8, w->size - start);
+  fwrite(dictrec, 1, sizeof dictrec, w->dict);
+  w->nwords++;
+}
+
+//  search_writer_close(w, run)
+// Close the files of the run, and move them to their final names (an
+// empty run is deleted).
+// Returns FALSE if the run cannot be written.
+static gboolean search_writer_close(search_writer *w, search_run *run)
+{
+  char *postname = search_run_name(w->bucket, w->seq, "");
+  char *dictname = search_run_name(w->bucket, w->seq, ".dict");
+  char *posttmp = g_strdup_printf("%s.tmp", postname);
+  char *dicttmp = g_strdup_printf("%s.tmp", dictname);
+  gboolean ok;
+
+  ok = !fclose(w->post);
+  ok = !fclose(w->dict) && ok;
+  // The dictionary is renamed last: a run without dictionary is ignored
+  if (ok && w->nwords)
+    ok = !rename(posttmp, postname) && !rename(dicttmp, dictname);
+  if (ok && w->nwords) {
+    run->seq = w->seq;
+    run->size = w->size;
+  } else {
+    if (!ok)
+      scr_LogPrint(LPRINT_LOGNORM, "Cannot write the history search index");
+    unlink(posttmp);
+    unlink(dicttmp);
+    unlink(postname);
+  }
+  g_free(dicttmp);
+  g_free(posttmp);
+  g_free(dictname);
+  g_free(postname);
+  return ok;
+}
+
+//  search_run_unlink(bucket, run)
+// Delete the files of a run.
+static void search_run_unlink(guint bucket, search_run *run)
+{
+  char *name = search_run_name(bucket, run->seq, ".dict");
+  unlink(name);
+  g_free(name);
+  name = search_run_name(bucket, run->seq, "");
+  unlink(name);
+  g_free(name);
+}
+
+// A run being read
+typedef struct {
+  FILE *post, *dict;
+  guchar rec[HLOG_SEARCH_DICTREC];
+  gboolean eof;
+} search_cursor;
+
+// A merge of runs of a bucket.  The runs are merged in steps of
+// HLOG_SEARCH_MERGE_STEP postings, from the idle callback.  They are still
+// used by the searches until the merged run replaces them, and new runs can
+// be appended to the bucket meanwhile.
+typedef struct {
+  guint first, count;   // Runs being merged
+  gboolean purge;       // The bucket is being purged (see search_purge)
+  search_cursor *cur;
+  search_writer w;
+  gboolean in_word;     // A word is being merged
+  guchar word[HLOG_SEARCH_MAXWORD];
+  gint64 start;         // Offset of its merged postings
+  guint run;            // Run whose postings of the word are being copied
+  gint64 left;          // Size of these postings still to copy, or -1
+} search_merge;
+
+static search_merge *search_merges[HLOG_SEARCH_BUCKETS];
+
+static void search_bucket_compact(guint bucket);
+
+//  search_copy_postings(in, &left, out, &budget)
+// Copy (at most budget lines of) a postings list, without the postings of
+// the files which are not indexed anymore.
+// Returns the number of bytes written.
+static gint64 search_copy_postings(FILE *in, gint64 *left, FILE *out,
+                                   guint *budget)
+{
+  char line[64];
+  gint64 written = 0;
+
+  while (*left > 0 && *budget) {
+    gsize n;
+    if (!fgets(line, sizeof line, in)) {
+      *left = 0;
+      break;
+    }
+    n = strlen(line);
+    *left -= n;
+    (*budget)--;
+    if (search_posting_alive(line)) {
+      fwrite(line, 1, n, out);
+      written += n;
+    }
+  }
+  return written;
+}
+
+//  search_merge_free(bucket)
+// Close the runs of the merge of the bucket.
+static void search_merge_free(guint bucket)
+{
+  search_merge *m = search_merges[bucket];
+  guint i;
+
+  for (i = 0; i < m->count; i++) {
+    if (m->cur[i].post)
+      fclose(m->cur[i].post);
+    if (m->cur[i].dict)
+      fclose(m->cur[i].dict);
+  }
+  g_free(m->cur);
+  g_free(m);
+  search_merges[bucket] = NULL;
+}
+
+//  search_merge_abort(bucket)
+// Cancel the merge of the bucket, if any (its runs are left unchanged).
+static void search_merge_abort(guint bucket)
+{
+  search_merge *m = search_merges[bucket];
+  search_run merged;
+
+  if (!m)
+    return;
+  if (m->w.post) {
+    m->w.nwords = 0;
+    search_writer_close(&m->w, &merged);
+  }
+  search_merge_free(bucket);
+}
+
+static void hlog_search_start(void);
+
+//  search_merge_start(bucket, first, count, purge)
+// Start merging count runs of the bucket (from the first one), dropping
+// the postings of the files which are not indexed anymore.
+// Returns FALSE if the runs cannot be merged.
+static gboolean search_merge_start(guint bucket, guint first, guint count,
+                                   gboolean purge)
+{
+  GArray *runs = search_runs[bucket];
+  search_merge *m = g_new0(search_merge, 1);
+  gboolean ok;
+  guint i;
+
+  m->first = first;
+  m->count = count;
+  m->purge = purge;
+  m->cur = g_new0(search_cursor, count);
+  search_merges[bucket] = m;
+  // The merged run gets its number now, so that it comes before the runs
+  // which are written meanwhile.
+  ok = search_writer_open(&m->w, bucket);
+
+  for (i = 0; ok && i < count; i++) {
+    search_run *run = &g_array_index(runs, search_run, first + i);
+    search_cursor *cur = &m->cur[i];
+    char *name = search_run_name(bucket, run->seq, "");
+    cur->post = fopen(name, "r");
+    g_free(name);
+    name = search_run_name(bucket, run->seq, ".dict");
+    cur->dict = fopen(name, "r");
+    g_free(name);
+    if (!cur->post || !cur->dict)
+      ok = FALSE;
+    else
+      cur->eof = (fread(cur->rec, 1, HLOG_SEARCH_DICTREC, cur->dict)
+                  != HLOG_SEARCH_DICTREC);
+  }
+  if (!ok) {
+    search_merge_abort(bucket);
+    return FALSE;
+  }
+  hlog_search_start();
+  return TRUE;
+}
+
+//  search_merge_end(bucket)
+// Replace the runs of the merge of the bucket with the merged run.
+static void search_merge_end(guint bucket)
+{
+  search_merge *m = search_merges[bucket];
+  GArray *runs = search_runs[bucket];
+  search_run merged;
+  gboolean purge = m->purge;
+  guint i;
+
+  if (search_writer_close(&m->w, &merged)) {
+    // The merged run replaces the runs (it can be empty)
+    for (i = 0; i < m->count; i++)
+      search_run_unlink(bucket,
+                        &g_array_index(runs, search_run, m->first + i));
+    g_array_remove_range(runs, m->first, m->count);
+    if (m->w.nwords)
+      g_array_insert_val(runs, m->first, merged);
+  }
+  search_merge_free(bucket);
+  // (The purge may have been started again meanwhile)
+  if (purge && search_purge == bucket) {
+    search_purge++;
+    search_files_dirty = TRUE;
+  }
+  search_bucket_compact(bucket);
+}
+
+//  search_merge_step(bucket)
+// Merge at most HLOG_SEARCH_MERGE_STEP postings of the runs of the bucket.
+static void search_merge_step(guint bucket)
+{
+  search_merge *m = search_merges[bucket];
+  guint budget = HLOG_SEARCH_MERGE_STEP;
+  guint i;
+
+  while (budget) {
+    search_cursor *cur;
+
+    if (!m->in_word) {
+      // Smallest word of the runs
+      gboolean found = FALSE;
+      for (i = 0; i < m->count; i++)
+        if (!m->cur[i].eof &&
+            (!found ||
+             memcmp(m->cur[i].rec, m->word, HLOG_SEARCH_MAXWORD) < 0)) {
+          memcpy(m->word, m->cur[i].rec, HLOG_SEARCH_MAXWORD);
+          found = TRUE;
+        }
+      if (!found) {
+        search_merge_end(bucket);
+        return;
+      }
+      m->in_word = TRUE;
+      m->start = m->w.size;
+      m->run = 0;
+      m->left = -1;
+    }
+    // Concatenate its postings, oldest first
+    if (m->run == m->count) {
+      search_writer_add(&m->w, m->word, m->start);
+      m->in_word = FALSE;
+      continue;
+    }
+    cur = &m->cur[m->run];
+    if (m->left < 0) {
+      if (cur->eof || memcmp(cur->rec, m->word, HLOG_SEARCH_MAXWORD)) {
+        m->run++;
+        continue;
+      }
+      m->left = search_get64(cur->rec + HLOG_SEARCH_MAXWORD + 8);
+      if (fseeko(cur->post, search_get64(cur->rec + HLOG_SEARCH_MAXWORD),
+                 SEEK_SET))
+        m->left = 0;
+    }
+    m->w.size += search_copy_postings(cur->post, &m->left, m->w.post,
+                                      &budget);
+    if (m->left > 0)
+      break;
+    cur->eof = (fread(cur->rec, 1, HLOG_SEARCH_DICTREC, cur->dict)
+                != HLOG_SEARCH_DICTREC);
+    m->run++;
+    m->left = -1;
+  }
+}
+
+//  search_merging()
+// Return the first bucket being merged, or HLOG_SEARCH_BUCKETS if none.
+static guint search_merging(void)
+{
+  guint bucket;
+
+  for (bucket = 0; bucket < HLOG_SEARCH_BUCKETS; bucket++)
+    if (search_merges[bucket])
+      break;
+  return bucket;
+}
+
+//  search_bucket_compact(bucket)
+// Merge the newest runs of the bucket if the newest one is at least half
+// the size of the previous one.  (The bucket is compacted again when the
+// merge is done.)
+static void search_bucket_compact(guint bucket)
+{
+  GArray *runs = search_runs[bucket];
+  search_run *last;
+
+  if (search_merges[bucket] || runs->len < 2)
+    return;
+  last = &g_array_index(runs, search_run, runs->len - 1);
+  if (last->size * 2 >= (last-1)->size)
+    search_merge_start(bucket, runs->len - 2, 2, FALSE);
+}
+
+static gint search_word_cmp(gconstpointer a, gconstpointer b)
+{
+  return strcmp(*(const char**)a, *(const char**)b);
+}
+
+//  search_bucket_flush(bucket)
+// Write the pending postings of the bucket to a new run.
+static void search_bucket_flush(guint bucket)
+{
+  GHashTable *pending = search_pending[bucket];
+  GPtrArray *words;
+  GHashTableIter iter;
+  gpointer w;
+  search_writer sw;
+  search_run run;
+  guint i;
+
+  if (!pending || !g_hash_table_size(pending))
+    return;
+
+  words = g_ptr_array_sized_new(g_hash_table_size(pending));
+  g_hash_table_iter_init(&iter, pending);
+  while (g_hash_table_iter_next(&iter, &w, NULL))
+    g_ptr_array_add(words, w);
+  g_ptr_array_sort(words, search_word_cmp);
+
+  if (search_writer_open(&sw, bucket)) {
+    for (i = 0; i < words->len; i++) {
+      const char *word = g_ptr_array_index(words, i);
+      GString *postings = g_hash_table_lookup(pending, word);
+      guchar rec[HLOG_SEARCH_DICTREC];
+      gint64 start = sw.size;
+
+      fwrite(postings->str, 1, postings->len, sw.post);
+      sw.size += postings->len;
+      search_word_record(word, rec);
+      search_writer_add(&sw, rec, start);
+    }
+    if (search_writer_close(&sw, &run) && sw.nwords) {
+      g_array_append_val(search_runs[bucket], run);
+      search_bucket_compact(bucket);
+    }
+  }
+  g_ptr_array_free(words, TRUE);
+  g_hash_table_remove_all(pending);
+}
+
+//  hlog_search_flush()
+// Write the pending postings and the state of the index.
+// The state is written last, so that it never refers to postings which
+// have not been written.
+static void hlog_search_flush(void)
+{
+  guint i;
+
+  if (!UseSearchIndex)
+    return;
+
+  for (i = 0; i < HLOG_SEARCH_BUCKETS; i++)
+    search_bucket_flush(i);
+  search_postings_size = 0;
+
+  if (search_files_dirty) {
+    char *filesname = g_strdup_printf("%s/files", SearchDir);
+    char *tmpname = g_strdup_printf("%s.tmp", filesname);
+    FILE *fp = fopen(tmpname, "w");
+
+    if (fp) {
+      GHashTableIter iter;
+      gpointer key, value;
+
+      fprintf(fp, "v%d %u\n", HLOG_SEARCH_VERSION, search_purge);
+      g_hash_table_iter_init(&iter, search_files);
+      while (g_hash_table_iter_next(&iter, &key, &value)) {
+        search_file *sf = value;
+        fprintf(fp, "%u %" G_GINT64_FORMAT " %s\n", sf->id, sf->offset,
+                (char*)key);
+      }
+      if (!fclose(fp) && !rename(tmpname, filesname))
+        search_files_dirty = FALSE;
+    }
+    g_free(tmpname);
+    g_free(filesname);
+  }
+}
+
+//  hlog_search_list_files()
+// Return the list of the history files (and segments) which have not been
+// completely indexed.
+static GSList *hlog_search_list_files(void)
+{
+  GDir *dir = g_dir_open(RootDir, 0, NULL);
+  GSList *todo = NULL;
+  const char *name;
+
+  if (!dir)
+    return NULL;
+
+  while ((name = g_dir_read_name(dir))) {
+    gsize len = strlen(name);
+    struct stat bufstat;
+    char *path, *key;
+    off_t size;
+
+    if (*name == '.' ||
+        (len > 4 && !strcmp(name + len - 4, ".tmp")))
+      continue;
+    path = g_strdup_printf("%s%s", RootDir, name);
+    if (lstat(path, &bufstat) || !S_ISREG(bufstat.st_mode)) {
+      g_free(path);
+      continue;
+    }
+    size = bufstat.st_size;
+    key = search_file_key(name);
+    if (strcmp(key, name)) {
+#ifdef HAVE_LIBZ
+      size = hlog_segment_size(path);
+#else
+      size = 0; // We cannot read compressed segments
+#endif
+    }
+    // The file has been rewritten (e.g. by a script), index it again
+    if (size < search_file_get_offset(key))
+      search_file_remove(key);
+    if (size > search_file_get_offset(key))
+      todo = g_slist_prepend(todo, path);
+    else
+      g_free(path);
+    g_free(key);
+  }
+  g_dir_close(dir);
+  return todo;
+}
+
+//  hlog_search_next_file()
+// Stop indexing the current file.
+static void hlog_search_next_file(void)
+{
+  if (search_fp)
+    hlog_segclose(search_fp);
+  search_fp = NULL;
+  g_free(search_todo->data);
+  search_todo = g_slist_delete_link(search_todo, search_todo);
+}
+
+//  hlog_search_idle_callback()
+// Write the pending postings if there are enough of them, merge some
+// postings of the runs being merged, or index some records of the files
+// which are not up to date, and then purge the buckets if needed.
+static gboolean hlog_search_idle_callback(gpointer data)
+{
+  GString *record;
+  char *line, *key;
+  guint n;
+  hlog_file *hf;
+
+  if (search_postings_size >= HLOG_SEARCH_BUFSIZE) {
+    hlog_search_flush();
+    return TRUE;
+  }
+  if ((n = search_merging()) < HLOG_SEARCH_BUCKETS) {
+    search_merge_step(n);
+    return TRUE;
+  }
+
+  if (!search_todo) {
+    if (search_purge < HLOG_SEARCH_BUCKETS) {
+      // Drop the postings of the files which are not indexed anymore
+      GArray *runs = search_runs[search_purge];
+      if (!runs->len || !search_merge_start(search_purge, 0, runs->len,
+                                            TRUE)) {
+        search_purge++;
+        search_files_dirty = TRUE;
+      }
+      return TRUE;
+    }
+    hlog_search_flush();
+    // The new runs may have to be merged
+    if (search_merging() < HLOG_SEARCH_BUCKETS)
+      return TRUE;
+    // source will be destroyed after return
+    search_source = 0;
+    return FALSE;
+  }
+
+  key = search_file_key(search_todo->data);
+  if (!search_fp) {
+    search_pos = search_file_get_offset(key);
+    search_fp = hlog_segopen(search_todo->data);
+    if (!search_fp || hlog_segseek(search_fp, search_pos)) {
+      hlog_search_next_file();
+      g_free(key);
+      return TRUE;
+    }
+  }
+
+  line = g_new(char, HBB_BLOCKSIZE);
+  record = g_string_new(NULL);
+  for (n = 0; n < HLOG_SEARCH_RECORDS; n++) {
+    gboolean header = TRUE;
+    guchar type;
+    guint nlines = 0;
+    time_t timestamp;
+    gint64 start = search_pos;
+
+    // Stop if new records have been indexed meanwhile
+    if (search_file_get_offset(key) != search_pos)
+      break;
+
+    // Read a record: the header line and its continuation lines
+    g_string_truncate(record, 0);
+    while (hlog_seggets(search_fp, line, HBB_BLOCKSIZE)) {
+      gsize len = strlen(line);
+      g_string_append_len(record, line, len);
+      search_pos += len;
+      if (!len || line[len-1] != '\n')
+        continue;   // Long line
+      if (header) {
+        header = FALSE;
+        if (!parse_histo_header(record->str, record->len, &type, &timestamp,
+                                &nlines))
+          nlines = 0;
+      } else {
+        nlines--;
+      }
+      if (!nlines)
+        break;
+    }
+    if (search_pos == start)
+      break;        // End of file
+    hlog_search_add_record(key, start, record->str);
+    search_file_set_offset(key, search_pos);
+  }
+  g_string_free(record, TRUE);
+  g_free(line);
+
+  if (n < HLOG_SEARCH_RECORDS) {
+    // If the file is being written, its last records can be buffered:
+    // write them, and read them from the next call.
+    if (search_file_get_offset(key) == search_pos && hlog_files &&
+        (hf = g_hash_table_lookup(hlog_files, search_todo->data)) &&
+        hf->size > search_pos && hlog_file_flush(hf)) {
+      hlog_segclose(search_fp);
+      search_fp = NULL;
+    } else {
+      hlog_search_next_file();
+    }
+  }
+  g_free(key);
+  return TRUE;
+}
+
+//  hlog_search_start()
+// Start the background indexer, if needed.
+static void hlog_search_start(void)
+{
+  if (!search_source &&
+      (search_todo || search_purge < HLOG_SEARCH_BUCKETS ||
+       search_postings_size >= HLOG_SEARCH_BUFSIZE ||
+       search_merging() < HLOG_SEARCH_BUCKETS))
+    search_source = g_idle_add(hlog_search_idle_callback, NULL);
+}
+
+//  hlog_search_schedule()
+// Start indexing the history files which are not up to date, in the
+// background.
+static void hlog_search_schedule(void)
+{
+  if (search_source)
+    return;
+  search_todo = hlog_search_list_files();
+  hlog_search_start();
+}
+
+//  hlog_search_update(hf, record)
+// A record is being appended to the history file.  Index it if the file is
+// up to date, or let the background indexer read it from the file.
+static void hlog_search_update(hlog_file *hf, const char *record)
+{
+  char *key;
+
+  if (!UseSearchIndex)
+    return;
+
+  key = search_file_key(hf->filename);
+  if (search_file_get_offset(key) == hf->size) {
+    hlog_search_add_record(key, hf->size, record);
+    search_file_set_offset(key, hf->size + strlen(record));
+  } else if (!g_slist_find_custom(search_todo, hf->filename,
+                                  (GCompareFunc)strcmp)) {
+    // (The indexer writes the buffered records when it needs them)
+    search_todo = g_slist_append(search_todo, g_strdup(hf->filename));
+    hlog_search_start();
+  }
+  g_free(key);
+}
+
+//  hlog_search_rename(filename, newname)
+// The history file has been moved to a segment: the segment keeps the id
+// (and the postings) of the file.
+static void hlog_search_rename(const char *filename, const char *newname)
+{
+  char *key, *newkey;
+  search_file *sf;
+
+  if (!UseSearchIndex)
+    return;
+
+  key = search_file_key(filename);
+  newkey = search_file_key(newname);
+  sf = g_hash_table_lookup(search_files, key);
+  if (sf) {
+    guint id = sf->id;
+    gint64 offset = sf->offset;
+    // Do not purge the postings of this id
+    g_hash_table_remove(search_ids, GUINT_TO_POINTER(id));
+    g_hash_table_remove(search_files, key);
+    search_file_remove(newkey);
+    search_file_add(newkey, id, offset);
+  }
+  g_free(newkey);
+  g_free(key);
+  // The indexer could be reading the file
+  if (search_todo && !strcmp(search_todo->data, filename) && search_fp) {
+    hlog_segclose(search_fp);
+    search_fp = NULL;
+    g_free(search_todo->data);
+    search_todo->data = g_strdup(newname);
+  }
+  hlog_search_schedule();
+}
+
+//  hlog_search_abort()
+// Stop indexing the history files, write the pending postings, and cancel
+// the merges (they will be started again when the buckets are written).
+static void hlog_search_abort(void)
+{
+  guint i;
+
+  while (search_todo)
+    hlog_search_next_file();
+  hlog_search_flush();
+  for (i = 0; i < HLOG_SEARCH_BUCKETS; i++)
+    search_merge_abort(i);
+  if (search_source) {
+    g_source_remove(search_source);
+    search_source = 0;
+  }
+}
+
+static gint search_run_cmp(gconstpointer a, gconstpointer b)
+{
+  const search_run *ra = a, *rb = b;
+  return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+//  hlog_search_load_runs(reset)
+// List the runs of the buckets.  The temporary files are removed, as well
+// as all the files of the index if reset is TRUE.
+static void hlog_search_load_runs(gboolean reset)
+{
+  GDir *dir = g_dir_open(SearchDir, 0, NULL);
+  const char *name;
+  guint i;
+
+  for (i = 0; i < HLOG_SEARCH_BUCKETS; i++)
+    search_runs[i] = g_array_new(FALSE, FALSE, sizeof(search_run));
+  search_next_seq = 0;
+  if (!dir)
+    return;
+
+  while ((name = g_dir_read_name(dir))) {
+    char *path = g_strdup_printf("%s/%s", SearchDir, name);
+    guint bucket, seq;
+    int len = 0;
+
+    if (reset || g_str_has_suffix(name, ".tmp")) {
+      if (strcmp(name, "nextid"))
+        unlink(path);
+    } else if (sscanf(name, "%2x.%u.dict%n", &bucket, &seq, &len) == 2 &&
+               len && !name[len] && bucket < HLOG_SEARCH_BUCKETS) {
+      char *postname = search_run_name(bucket, seq, "");
+      struct stat bufstat;
+      search_run run;
+
+      if (!stat(postname, &bufstat)) {
+        run.seq = seq;
+        run.size = bufstat.st_size;
+        g_array_append_val(search_runs[bucket], run);
+        search_next_seq = MAX(search_next_seq, seq + 1);
+      }
+      g_free(postname);
+    } else if (sscanf(name, "%2x.%u%n", &bucket, &seq, &len) == 2 &&
+               len && !name[len]) {
+      char *dictname = search_run_name(bucket, seq, ".dict");
+      struct stat bufstat;
+
+      // The dictionary may not have been written
+      if (stat(dictname, &bufstat))
+        unlink(path);
+      g_free(dictname);
+      search_next_seq = MAX(search_next_seq, seq + 1);
+    }
+    g_free(path);
+  }
+  g_dir_close(dir);
+
+  for (i = 0; i < HLOG_SEARCH_BUCKETS; i++)
+    g_array_sort(search_runs[i], search_run_cmp);
+}
+
+//  hlog_search_init()
+// Load the state of the search index, and start indexing the history files
+// which are not up to date.
+// The index is created again if it has been written by a previous version.
+static void hlog_search_init(void)
+{
+  char *filesname;
+  FILE *fp;
+  char line[1024];
+  gboolean valid = FALSE;
+
+  SearchDir = g_strdup_printf("%s%s", RootDir, HLOG_SEARCH_DIR);
+  if (mkdir(SearchDir, 0700) && errno != EEXIST) {
+    scr_LogPrint(LPRINT_LOGNORM, "Cannot create the history search index "
+                 "directory");
+    g_free(SearchDir);
+    SearchDir = NULL;
+    UseSearchIndex = FALSE;
+    return;
+  }
+
+  search_files = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                       g_free, g_free);
+  search_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+  search_next_id = 1;
+  search_purge = HLOG_SEARCH_BUCKETS;
+
+  filesname = g_strdup_printf("%s/nextid", SearchDir);
+  fp = fopen(filesname, "r");
+  g_free(filesname);
+  if (fp) {
+    if (fgets(line, sizeof line, fp))
+      search_next_id = MAX(1, strtoul(line, NULL, 10));
+    fclose(fp);
+  }
+
+  filesname = g_strdup_printf("%s/files", SearchDir);
+  fp = fopen(filesname, "r");
+  g_free(filesname);
+  if (fp) {
+    int version = 0;
+    if (fgets(line, sizeof line, fp) &&
+        sscanf(line, "v%d %u", &version, &search_purge) == 2 &&
+        version == HLOG_SEARCH_VERSION)
+      valid = TRUE;
+    while (valid && fgets(line, sizeof line, fp)) {
+      char *p, *name;
+      guint id = strtoul(line, &p, 10);
+      gint64 offset = g_ascii_strtoll(p, &name, 10);
+      gsize len = strlen(line);
+      if (*p != ' ' || *name != ' ' || line[len-1] != '\n' || !id)
+        continue;
+      line[len-1] = 0;
+      search_file_add(name + 1, id, offset);
+    }
+    fclose(fp);
+  }
+  search_files_dirty = !valid;
+  if (search_purge > HLOG_SEARCH_BUCKETS)
+    search_purge = 0;
+
+  // Without a valid state, the postings cannot be used
+  hlog_search_load_runs(!valid);
+  search_save_next_id();
+
+  hlog_search_schedule();
+}
+
+//  hlog_search_deinit()
+// Free the state of the search index.  (The index must have been flushed.)
+static void hlog_search_deinit(void)
+{
+  guint i;
+
+  for (i = 0; i < HLOG_SEARCH_BUCKETS; i++) {
+    if (search_pending[i])
+      g_hash_table_destroy(search_pending[i]);
+    search_pending[i] = NULL;
+    if (search_runs[i])
+      g_array_free(search_runs[i], TRUE);
+    search_runs[i] = NULL;
+  }
+  search_postings_size = 0;
+  g_hash_table_destroy(search_ids);
+  search_ids = NULL;
+  g_hash_table_destroy(search_files);
+  search_files = NULL;
+  g_free(SearchDir);
+  SearchDir = NULL;
+}
+
+//  hlog_search_fetch(key, timestamp, offset)
+// Return the data of a history record found in the index (the first line
+// only), or NULL if the record cannot be found.
+static char *hlog_search_fetch(const char *key, time_t timestamp,
+                               gint64 offset)
+{
+  char *path = g_strdup_printf("%s%s", RootDir, key);
+  GSList *candidates = NULL, *elt;
+  char *text = NULL;
+  char line[512];
+
+  // The record can be in the file, or in a segment if the file has been
+  // moved since it was indexed.
+  candidates = g_slist_prepend(candidates, g_strdup_printf("%s.gz", path));
+  candidates = g_slist_prepend(candidates, g_strdup(path));
+  if (UseSegments && !search_key_is_segment(key)) {
+    // The most recent segments first
+    GSList *segments = hlog_segments_list(path, 0, 0, 0);
+    candidates = g_slist_concat(candidates, g_slist_reverse(segments));
+  }
+  g_free(path);
+
+  for (elt = candidates; elt && !text; elt = g_slist_next(elt)) {
+    hlog_segfile fp = hlog_segopen(elt->data);
+    guchar type;
+    guint nlines, dataoffset;
+    time_t ts;
+
+    if (!fp)
+      continue;
+    if (!hlog_segseek(fp, offset) && hlog_seggets(fp, line, sizeof line)) {
+      dataoffset = parse_histo_header(line, strlen(line), &type, &ts,
+                                      &nlines);
+      if (dataoffset && ts == timestamp) {
+        text = g_strdup(g_strchomp(line + dataoffset + 1));
+      }
+    }
+    hlog_segclose(fp);
+  }
+  g_slist_foreach(candidates, (GFunc)g_free, NULL);
+  g_slist_free(candidates);
+  return text;
+}
+
+typedef struct {
+  char *key;
+  time_t timestamp;
+  gint64 offset;
+} search_result;
+
+static gint search_result_cmp(gconstpointer a, gconstpointer b)
+{
+  const search_result *ra = *(search_result**)a;
+  const search_result *rb = *(search_result**)b;
+
+  if (ra->timestamp != rb->timestamp)
+    return ra->timestamp < rb->timestamp ? 1 : -1;
+  return 0;
+}
+
+static void search_result_free(gpointer data)
+{
+  search_result *r = data;
+  g_free(r->key);
+  g_free(r);
+}
+
+//  search_results_add(results, line)
+// Add a posting ("id timestamp offset") to the results, unless its file
+// is not indexed anymore.
+static void search_results_add(GHashTable *results, const char *line)
+{
+  search_result *r;
+  const char *name;
+  char *p, *end;
+  guint id;
+  gint64 offset;
+  long timestamp;
+
+  id = strtoul(line, &p, 10);
+  timestamp = strtol(p, &end, 10);
+  if (*p != ' ' || *end != ' ')
+    return;
+  offset = g_ascii_strtoll(end, NULL, 10);
+  name = g_hash_table_lookup(search_ids, GUINT_TO_POINTER(id));
+  if (!name)
+    return;
+  r = g_new(search_result, 1);
+  r->key = g_strdup(name);
+  r->timestamp = timestamp;
+  r->offset = offset;
+  g_hash_table_replace(results, g_strdup_printf("%u %" G_GINT64_FORMAT, id,
+                                                offset), r);
+}
+
+//  search_run_lookup(bucket, run, rec, results)
+// Look up the word (dictionary record) in a run, and add its postings to
+// the results.
+static void search_run_lookup(guint bucket, search_run *run,
+                              const guchar *rec, GHashTable *results)
+{
+  char *name = search_run_name(bucket, run->seq, ".dict");
+  FILE *dict = fopen(name, "r");
+  guchar dictrec[HLOG_SEARCH_DICTREC];
+  struct stat bufstat;
+  off_t lo = 0, hi;
+  FILE *post;
+  char line[64];
+  gint64 len;
+
+  g_free(name);
+  if (!dict)
+    return;
+  if (fstat(fileno(dict), &bufstat)) {
+    fclose(dict);
+    return;
+  }
+
+  // Binary search of the first record which is not smaller than the word
+  hi = bufstat.st_size / HLOG_SEARCH_DICTREC;
+  while (lo < hi) {
+    off_t mid = lo + (hi - lo) / 2;
+    if (fseeko(dict, mid * HLOG_SEARCH_DICTREC, SEEK_SET) ||
+        fread(dictrec, 1, sizeof dictrec, dict) != sizeof dictrec) {
+      fclose(dict);
+      return;
+    }
+    if (memcmp(dictrec, rec, HLOG_SEARCH_MAXWORD) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo * HLOG_SEARCH_DICTREC >= bufstat.st_size ||
+      fseeko(dict, lo * HLOG_SEARCH_DICTREC, SEEK_SET) ||
+      fread(dictrec, 1, sizeof dictrec, dict) != sizeof dictrec ||
+      memcmp(dictrec, rec, HLOG_SEARCH_MAXWORD)) {
+    fclose(dict);
+    return;
+  }
+  fclose(dict);
+
+  name = search_run_name(bucket, run->seq, "");
+  post = fopen(name, "r");
+  g_free(name);
+  if (!post)
+    return;
+  len = search_get64(dictrec + HLOG_SEARCH_MAXWORD + 8);
+  if (!fseeko(post, search_get64(dictrec + HLOG_SEARCH_MAXWORD), SEEK_SET)) {
+    while (len > 0 && fgets(line, sizeof line, post)) {
+      len -= strlen(line);
+      search_results_add(results, line);
+    }
+  }
+  fclose(post);
+}
+
+//  hlog_search_word(word)
+// Return the records containing the word (from the runs and from the
+// pending postings), in a hash table whose keys are "id offset" strings.
+static GHashTable *hlog_search_word(const char *word)
+{
+  GHashTable *results = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, search_result_free);
+  guint bucket = g_str_hash(word) % HLOG_SEARCH_BUCKETS;
+  guchar rec[HLOG_SEARCH_DICTREC];
+  GString *pending;
+  guint i;
+
+  search_word_record(word, rec);
+  for (i = 0; i < search_runs[bucket]->len; i++)
+    search_run_lookup(bucket, &g_array_index(search_runs[bucket], search_run,
+                                             i), rec, results);
+
+  if (search_pending[bucket] &&
+      (pending = g_hash_table_lookup(search_pending[bucket], word))) {
+    const char *p = pending->str;
+    while (*p) {
+      search_results_add(results, p);
+      p = strchr(p, '\n') + 1;
+    }
+  }
+  return results;
+}
+
+static gboolean search_result_missing(gpointer key, gpointer value,
+                                      gpointer data)
+{
+  return !g_hash_table_lookup(data, key);
+}
+
+static void add_search_result(gpointer key, gpointer value, gpointer data)
+{
+  g_ptr_array_add(data, value);
+}
+
+//  hlog_search(query)
+// Search the history logs for the messages containing all the words of
+// the query, and display the most recent ones in the status buffer.
+void hlog_search(const char *query)
+{
+  GHashTable *results = NULL;
+  GHashTable *words = g_hash_table_new(g_str_hash, g_str_equal);
+  GHashTableIter iter;
+  gpointer word;
+  GPtrArray *list;
+  guint i;
+  int nwords = 0;
+
+  if (!UseSearchIndex) {
+    scr_LogPrint(LPRINT_NORMAL, "The history search index is disabled "
+                 "(see the logging_search_index option).");
+    g_hash_table_destroy(words);
+    return;
+  }
+
+  // Make sure the buffered records can be fetched
+  hlog_flush();
+
+  search_tokenize(query, words);
+  g_hash_table_iter_init(&iter, words);
+  while (g_hash_table_iter_next(&iter, &word, NULL)) {
+    GHashTable *wresults = hlog_search_word(word);
+    nwords++;
+    if (results) {
+      // Keep the records containing all the words
+      g_hash_table_foreach_remove(results, search_result_missing, wresults);
+      g_hash_table_destroy(wresults);
+    } else {
+      results = wresults;
+    }
+    g_free(word);
+  }
+  g_hash_table_destroy(words);
+
+  if (!nwords) {
+    scr_LogPrint(LPRINT_NORMAL, "Please specify at least one word of %d "
+                 "characters or more.", HLOG_SEARCH_MINWORD);
+    return;
+  }
+
+  list = g_ptr_array_new();
+  g_hash_table_foreach(results, add_search_result, list);
+  g_ptr_array_sort(list, search_result_cmp);
+
+  scr_LogPrint(LPRINT_NORMAL, "History search: %u result(s)%s", list->len,
+               search_source ? " (indexing in progress)" : "");
+  for (i = 0; i < list->len && i < HLOG_SEARCH_RESULTS; i++) {
+    search_result *r = g_ptr_array_index(list, i);
+    char *text = hlog_search_fetch(r->key, r->timestamp, r->offset);
+    int jidlen = strlen(r->key);
+    char date[32];
+
+    if (search_key_is_segment(r->key))
+      jidlen -= HLOG_SEGMENT_SUFFIX_LEN;
+    strftime(date, sizeof date, "%Y-%m-%d %H:%M", localtime(&r->timestamp));
+    if (text && g_utf8_strlen(text, -1) > 80) {
+      *g_utf8_offset_to_pointer(text, 80) = 0;
+      scr_LogPrint(LPRINT_NORMAL, "%s <%.*s> %s...", date, jidlen, r->key,
+                   text);
+    } else {
+      scr_LogPrint(LPRINT_NORMAL, "%s <%.*s> %s", date, jidlen, r->key,
+                   text ? text : "(record not found)");
+    }
+    g_free(text);
+  }
+  if (list->len > HLOG_SEARCH_RESULTS)
+    scr_LogPrint(LPRINT_NORMAL, "(%u more)", list->len - HLOG_SEARCH_RESULTS);
+  g_ptr_array_free(list, TRUE);
+  g_hash_table_destroy(results);
+}
+
+//  hlog_file_get(bjid, jidfile)
+// Return the history file of the jid (jidfile is its history filename, it
+// will be freed), or NULL.
+// With segments, the file is named after the actual history file.  The
+// symbolic link is only resolved when the file is opened, so a link
+// created while the file is open is used after the file is closed.
+static hlog_file *hlog_file_get(const char *bjid, char *jidfile)
+{
+  hlog_file *hf;
+  char *filename = jidfile;
+
+  if (!hlog_files)
+    hlog_files = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                       (GDestroyNotify)hlog_file_close);
+
+  if (UseSegments) {
+    char *logjid;
+
+    if (!hlog_jid_files)
+      hlog_jid_files = g_hash_table_new(g_str_hash, g_str_equal);
+    hf = g_hash_table_lookup(hlog_jid_files, jidfile);
+    if (hf) {
+      g_free(jidfile);
+      return hf;
+    }
+    logjid = hlog_get_log_jid(bjid);
+    if (logjid) {
+      filename = user_histo_file(logjid);
+      g_free(logjid);
+      if (!filename) {
+        g_free(jidfile);
+        return NULL;
+      }
+    } else {
+      filename = g_strdup(jidfile);
+    }
+  }
+
+  hf = g_hash_table_lookup(hlog_files, filename);
+  if (!hf) {
+    hf = g_new0(hlog_file, 1);
+    hf->filename = filename;
+    hf->fd = -1;
+    hf->buffer = g_string_new(NULL);
+    g_hash_table_insert(hlog_files, hf->filename, hf);
+    hlog_index_init(hf);
+    hf->month = -1;
+    if (UseSegments)
+      hlog_segment_init(hf);
+  } else if (filename != jidfile) {
+    g_free(filename);
+  }
+
+  if (UseSegments) {
+    hf->jid_files = g_slist_prepend(hf->jid_files, jidfile);
+    g_hash_table_insert(hlog_jid_files, jidfile, hf);
+  } else if (hf->filename != jidfile) {
+    g_free(jidfile);
   }
+  return hf;
+}
 
-  g_free(path);
-  return log_jid;
+//  hlog_append(bjid, filename, timestamp, record)
+// Append a record to the history file of the jid (filename is the history
+// filename of the jid, it will be freed), using the write buffer.
+static void hlog_append(const char *bjid, char *filename, time_t timestamp,
+                        const char *record)
+{
+  gboolean pending = hlog_pending_readers && hlog_readers_mark(filename);
+  hlog_file *hf = hlog_file_get(bjid, filename);
+
+  if (!hf)
+    return;
+
+  if (UseSegments)
+    hlog_segment_rotate(hf, timestamp);
+  if (pending)
+    hlog_readers_set_limit(hf->size);
+  hlog_index_add(hf, timestamp);
+  hlog_search_update(hf, record);
+  g_string_append(hf->buffer, record);
+  hf->size += strlen(record);
+
+  if (settings_opt_get_int("logging_sync") > 0 ||
+      hf->buffer->len >= HLOG_WRITE_BUFSIZE) {
+    hlog_file_flush(hf);
+  } else if (!hlog_flush_source)
+    hlog_flush_source = g_timeout_add_seconds(HLOG_FLUSH_DELAY,
+                                              hlog_flush_timeout_callback,
+                                              NULL);
 }
 
 //  write_histo_line()
@@ -98,12 +2638,11 @@ static void write_histo_line(const char *bjid,
         time_t timestamp, guchar type, guchar info, const char *data)
 {
   guint len = 0;
-  FILE *fp;
   time_t ts;
   const char *p;
   char *filename;
+  char *record;
   char str_ts[20];
-  int err;
 
   if (!UseFileLogging)
     return;
@@ -138,93 +2677,689 @@ static void write_histo_line(const char *bjid,
    * locally by mcabber.)
    */
 
-  fp = fopen(filename, "a");
-  g_free(filename);
-  if (!fp) {
-    scr_LogPrint(LPRINT_LOGNORM, "Unable to write history "
-                 "(cannot open logfile)");
+  if (!filename)
     return;
-  }
 
   to_iso8601(str_ts, ts);
-  err = fprintf(fp, "%c%c %-18.18s %03d %s\n", type, info, str_ts, len, data);
-  fclose(fp);
-  if (err < 0) {
-    scr_LogPrint(LPRINT_LOGNORM, "Error while writing to log file: %s",
-                 strerror(errno));
+  record = g_strdup_printf("%c%c %-18.18s %03d %s\n", type, info, str_ts, len,
+                           data);
+  hlog_append(bjid, filename, ts, record);
+  g_free(record);
+}
+
+#define HLOG_SCAN_CHUNK 65536
+
+//  hlog_find_start_offset(fp, size, budget, starttime)
+// Scan the history file backwards, and return the offset of the oldest
+// record we need to load: loading stops when the messages read since the
+// end of the file are larger than budget (if not null), or older than
+// starttime (if not null).
+// The line count of the record headers is used to tell headers from
+// message lines which would look like headers.
+static off_t hlog_find_start_offset(FILE *fp, off_t size, gsize budget,
+                                    time_t starttime)
+{
+  char *chunk;
+  char head[32];        // Beginning of the chunk following the current one
+  gsize headlen = 0;
+  off_t pos = size;     // Offset of the current chunk end
+  off_t line_end = size;
+  guint lines_after = 0;  // Lines after the current line, in the record
+  gsize record_bytes = 0; // Size of these lines
+  gsize msg_bytes = 0;    // Size of the message records found so far
+
+  chunk = g_new(char, HLOG_SCAN_CHUNK);
+
+  while (pos > 0) {
+    gsize chunklen = MIN(pos, HLOG_SCAN_CHUNK);
+    gssize i;
+
+    pos -= chunklen;
+    if (fseeko(fp, pos, SEEK_SET) ||
+        fread(chunk, 1, chunklen, fp) != chunklen) {
+      pos = 0;
+      break;
+    }
+
+    for (i = chunklen-1; i >= -1; i--) {
+      char header[32];
+      gsize hlen, n;
+      off_t line_start;
+      guchar type;
+      guint nlines;
+      time_t timestamp;
+
+      // A line starts after each newline, and at the beginning of the file
+      if (i >= 0 && chunk[i] != '\n')
+        continue;
+      if (i < 0 && pos > 0)
+        break;
+      line_start = pos + i + 1;
+      if (line_start >= line_end)
+        continue; // Trailing newline
+
+      // Get the beginning of the line
+      n = MIN((gsize)(chunklen - (i+1)), sizeof header);
+      memcpy(header, chunk+i+1, n);
+      hlen = n;
+      if (hlen < sizeof header) {
+        n = MIN(headlen, sizeof header - hlen);
+        memcpy(header+hlen, head, n);
+        hlen += n;
+      }
+      hlen = MIN(hlen, (gsize)(line_end - line_start));
+
+      record_bytes += line_end - line_start;
+      line_end = line_start;
+
+      if (!parse_histo_header(header, hlen, &type,
+                              starttime ? &timestamp : NULL, &nlines) ||
+          nlines != lines_after) {
+        lines_after++;
+        continue;
+      }
+
+      // This is the beginning of a record
+      if (type == 'M')
+        msg_bytes += record_bytes;
+      lines_after = 0;
+      record_bytes = 0;
+      if ((budget && msg_bytes >= budget) ||
+          (starttime && timestamp <= starttime)) {
+        g_free(chunk);
+        return line_start;
+      }
+    }
+
+    headlen = MIN(chunklen, sizeof head);
+    memcpy(head, chunk, headlen);
   }
+
+  g_free(chunk);
+  return 0;
 }
 
-//  hlog_read_history()
-// Reads the jid's history logfile
-void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width)
+//  hlog_scan_end_offset(fp, pos, size, endtime)
+// Return the offset of the first record which is not older than endtime,
+// reading the file from pos (which must be the offset of an older record).
+static off_t hlog_scan_end_offset(FILE *fp, off_t pos, off_t size,
+                                  time_t endtime)
+{
+  char line[64];
+  gboolean bol = TRUE;  // At the beginning of a line
+  guint skip = 0;       // Continuation lines to skip
+
+  if (fseeko(fp, pos, SEEK_SET))
+    return size;
+
+  while (pos < size && fgets(line, sizeof line, fp)) {
+    gsize len = strlen(line);
+    guchar type;
+    guint nlines;
+    time_t timestamp;
+
+    if (bol) {
+      if (skip) {
+        skip--;
+      } else if (parse_histo_header(line, len, &type, &timestamp, &nlines)) {
+        if (timestamp >= endtime)
+          return pos;
+        skip = nlines;
+      }
+    }
+    bol = (len && line[len-1] == '\n');
+    pos = ftello(fp);
+  }
+  return MIN(pos, size);
+}
+
+//  hlog_find_end_offset(filename, fp, size, endtime)
+// Return the offset of the first record of the history file which is not
+// older than endtime (size if there is none).
+static off_t hlog_find_end_offset(const char *filename, FILE *fp, off_t size,
+                                  time_t endtime)
+{
+  off_t pos;
+
+  // Start from a record older than endtime
+  pos = hlog_index_find(filename, fp, size, endtime - 1);
+  if (pos < 0)
+    pos = hlog_find_start_offset(fp, size, 0, endtime - 1);
+  return hlog_scan_end_offset(fp, pos, size, endtime);
+}
+
+// When older history is paged in, the segment of the last page is kept
+// (uncompressed) for a while, with the position of the page, so that each
+// page only reads its own records instead of the whole segment.
+// Compressed segments are decompressed in chunks when the main loop is
+// idle; the page is read again when the segment is ready (see
+// hlog_reader_pending()).
+#define HLOG_PAGE_CACHE_DELAY 60  // seconds
+
+static struct {
+  char *segname;
+  time_t mtime;     // Modification time of the segment
+  FILE *fp;         // Uncompressed data of the segment, or NULL on error
+  off_t size;
+  off_t pos;        // Offset of the first record of the last page, or -1
+  time_t timestamp; // Timestamp of this record
+  guint source;     // Timeout releasing the segment
+#ifdef HAVE_LIBZ
+  gzFile gz;        // Segment being decompressed to fp
+  guint gz_source;  // Idle source decompressing the segment
+#endif
+} hlog_page_cache;
+
+//  hlog_page_cache_clear()
+// Close the segment of the last history page.
+static void hlog_page_cache_clear(void)
+{
+  if (hlog_page_cache.source)
+    g_source_remove(hlog_page_cache.source);
+#ifdef HAVE_LIBZ
+  if (hlog_page_cache.gz_source)
+    g_source_remove(hlog_page_cache.gz_source);
+  if (hlog_page_cache.gz)
+    gzclose(hlog_page_cache.gz);
+#endif
+  if (hlog_page_cache.fp)
+    fclose(hlog_page_cache.fp);
+  g_free(hlog_page_cache.segname);
+  memset(&hlog_page_cache, 0, sizeof hlog_page_cache);
+}
+
+static gboolean hlog_page_cache_timeout_callback(gpointer data)
+{
+  // source will be destroyed after return
+  hlog_page_cache.source = 0;
+  hlog_page_cache_clear();
+  return FALSE;
+}
+
+#ifdef HAVE_LIBZ
+//  hlog_page_cache_inflate_callback()
+// Decompress a chunk of the segment of the page cache.
+static gboolean hlog_page_cache_inflate_callback(gpointer data)
+{
+  char *chunk = g_new(char, HLOG_COMPRESS_CHUNK);
+  int n = gzread(hlog_page_cache.gz, chunk, HLOG_COMPRESS_CHUNK);
+
+  if (n > 0 && fwrite(chunk, 1, n, hlog_page_cache.fp) != (size_t)n)
+    n = -1;
+  g_free(chunk);
+  if (n > 0)
+    return TRUE;
+
+  gzclose(hlog_page_cache.gz);
+  hlog_page_cache.gz = NULL;
+  if (n < 0 || fflush(hlog_page_cache.fp) ||
+      (hlog_page_cache.size = ftello(hlog_page_cache.fp)) < 0) {
+    // The error is reported when the page is read again
+    fclose(hlog_page_cache.fp);
+    hlog_page_cache.fp = NULL;
+  }
+  // source will be destroyed after return
+  hlog_page_cache.gz_source = 0;
+  scr_history_page_ready();
+  return FALSE;
+}
+#endif
+
+//  hlog_page_cache_open(segname, &pending)
+// Return the uncompressed data of the segment, from the cache if possible.
+// If the segment is compressed, it is decompressed in the background:
+// NULL is returned, and pending is set, until it is ready.
+static FILE *hlog_page_cache_open(const char *segname, gboolean *pending)
 {
-  char *filename;
-  guchar type, info;
-  char *data, *tail;
-  guint data_size;
-  char *xtext;
-  time_t timestamp;
-  guint prefix_flags;
-  guint len;
-  FILE *fp;
   struct stat bufstat;
-  guint err = 0;
-  guint ln = 0; // line number
+
+  if (stat(segname, &bufstat))
+    return NULL;
+
+  if (!hlog_page_cache.segname || strcmp(hlog_page_cache.segname, segname) ||
+      hlog_page_cache.mtime != bufstat.st_mtime) {
+    FILE *fp;
+
+    hlog_page_cache_clear();
+    hlog_page_cache.segname = g_strdup(segname);
+    hlog_page_cache.mtime = bufstat.st_mtime;
+    hlog_page_cache.pos = -1;
+#ifdef HAVE_LIBZ
+    if (g_str_has_suffix(segname, ".gz")) {
+      hlog_page_cache.gz = gzopen(segname, "rb");
+      if (hlog_page_cache.gz && (hlog_page_cache.fp = tmpfile())) {
+        hlog_page_cache.gz_source =
+          g_idle_add(hlog_page_cache_inflate_callback, NULL);
+      } else if (hlog_page_cache.gz) {
+        gzclose(hlog_page_cache.gz);
+        hlog_page_cache.gz = NULL;
+      }
+    } else
+#endif
+    {
+      fp = fopen(segname, "r");
+      if (fp && (fseeko(fp, 0, SEEK_END) ||
+                 (hlog_page_cache.size = ftello(fp)) < 0)) {
+        fclose(fp);
+        fp = NULL;
+      }
+      hlog_page_cache.fp = fp;
+    }
+  }
+
+  // Release the segment when the user stops paging
+  if (hlog_page_cache.source)
+    g_source_remove(hlog_page_cache.source);
+  hlog_page_cache.source = g_timeout_add_seconds(HLOG_PAGE_CACHE_DELAY,
+                                        hlog_page_cache_timeout_callback,
+                                        NULL);
+#ifdef HAVE_LIBZ
+  if (hlog_page_cache.gz) {
+    *pending = TRUE;
+    return NULL;
+  }
+#endif
+  return hlog_page_cache.fp;
+}
+
+//  hlog_segment_page(segname, endtime, budget, data, &pending)
+// Insert before data the last records of the segment which are older than
+// endtime, until budget bytes of messages are found.
+// Returns the number of bytes found (at least budget if the records we
+// need are all in this segment).
+// If the segment is not ready yet, pending is set (see
+// hlog_page_cache_open()).
+static gsize hlog_segment_page(const char *segname, time_t endtime,
+                               gsize budget, GString *data,
+                               gboolean *pending)
+{
+  FILE *fp = hlog_page_cache_open(segname, pending);
+  off_t size, pos, start, end;
+  char *chunk;
+
+  if (*pending)
+    return 0;
+  if (!fp) {
+    scr_LogPrint(LPRINT_LOGNORM, "Cannot read history segment <%s>",
+                 segname);
+    return 0;
+  }
+  size = hlog_page_cache.size;
+  pos = hlog_page_cache.pos;
+
+  // The previous page usually follows this one: look for the end of this
+  // page from its first record, or backwards from there.
+  if (pos < 0 || hlog_page_cache.timestamp >= endtime)
+    pos = hlog_find_start_offset(fp, pos >= 0 ? pos : size, 0, endtime - 1);
+  end = hlog_scan_end_offset(fp, pos, size, endtime);
+  start = hlog_find_start_offset(fp, end, budget, 0);
+
+  hlog_page_cache.pos = -1;
+  if (start >= end || fseeko(fp, start, SEEK_SET))
+    return start ? budget : (gsize)end;
+  chunk = g_new(char, end - start + 1);
+  if (fread(chunk, 1, end - start, fp) == (gsize)(end - start)) {
+    guchar type;
+    guint nlines;
+    time_t timestamp;
+
+    chunk[end - start] = 0;
+    g_string_prepend_len(data, chunk, end - start);
+    if (parse_histo_header(chunk, end - start, &type, &timestamp, &nlines)) {
+      hlog_page_cache.pos = start;
+      hlog_page_cache.timestamp = timestamp;
+    }
+  }
+  g_free(chunk);
+  return start ? budget : (gsize)end;
+}
+
+struct hlog_reader {
+  char *bjid;
+  char *jidfile;    // History filename of the jid
+  gboolean opened;  // The files have been opened (see hlog_reader_open())
+  off_t limit;      // Size of the file when the reader was created, or -1
+  GSList *segments; // Segments to read before the file
+  gboolean pending; // A compressed segment is being decompressed
+  hlog_segfile seg; // Segment being read
+  GString *segdata; // Records of the segments, when paging (or NULL)
+  gsize segpos;     // Position in segdata
+  FILE *fp;
+  off_t end;        // Size of the file to read
+  char *data;
+  guint data_size;
+  guint err;
+  guint ln;         // line number
   time_t starttime;
-  int max_num_of_blocks;
+  time_t endtime;   // Only read the records older than endtime
+  guint max_num_of_blocks;
+};
+
+//  hlog_reader_create(bjid, endtime, maxblocks)
+// Return a reader for the jid's history records, or NULL if the history
+// is not loaded for this jid.  The files are only opened when the records
+// are read, but only the records which were written when the reader is
+// created, and which are older than endtime (if not null), are read.
+// If maxblocks is not null, only the most recent records which fit in
+// maxblocks hbuf blocks are kept.
+static hlog_reader *hlog_reader_create(const char *bjid, time_t endtime,
+                                       guint maxblocks)
+{
+  hlog_reader *r;
+  char *jidfile;
 
   if (!FileLoadLogs)
-    return;
+    return NULL;
 
   if ((roster_gettype(bjid) & ROSTER_TYPE_ROOM) &&
       (settings_opt_get_int("load_muc_logs") != 1))
-    return;
+    return NULL;
 
-  data_size = HBB_BLOCKSIZE+32;
-  data = g_new(char, data_size);
-  if (!data) {
-    scr_LogPrint(LPRINT_LOGNORM, "Not enough memory to read history file");
-    return;
+  jidfile = user_histo_file(bjid);
+  if (!jidfile)
+    return NULL;
+
+  r = g_new0(hlog_reader, 1);
+  r->bjid = g_strdup(bjid);
+  r->jidfile = jidfile;
+  r->limit = -1;
+  r->endtime = endtime;
+  r->max_num_of_blocks = maxblocks;
+  hlog_pending_readers = g_slist_prepend(hlog_pending_readers, r);
+  return r;
+}
+
+//  hlog_readers_mark(jidfile)
+// A record is going to be appended to the history file of a jid: mark
+// its readers which do not know the file size yet.
+// Returns TRUE if a reader has been marked.
+static gboolean hlog_readers_mark(const char *jidfile)
+{
+  GSList *elt;
+  gboolean found = FALSE;
+
+  for (elt = hlog_pending_readers; elt; elt = g_slist_next(elt)) {
+    hlog_reader *r = elt->data;
+    if (r->limit == -1 && !strcmp(r->jidfile, jidfile)) {
+      r->limit = -2;
+      found = TRUE;
+    }
   }
+  return found;
+}
 
-  filename = user_histo_file(bjid);
+//  hlog_readers_set_limit(size)
+// Save the size of the history file (before the record is appended) in
+// the readers marked by hlog_readers_mark().
+static void hlog_readers_set_limit(off_t size)
+{
+  GSList *elt;
 
-  fp = fopen(filename, "r");
-  g_free(filename);
-  if (!fp) {
-    g_free(data);
-    return;
+  for (elt = hlog_pending_readers; elt; elt = g_slist_next(elt)) {
+    hlog_reader *r = elt->data;
+    if (r->limit == -2)
+      r->limit = size;
   }
+}
 
-  // If file is large (> 3MB here), display a message to inform the user
-  // (it can take a while...)
-  if (!fstat(fileno(fp), &bufstat)) {
-    if (bufstat.st_size > 3145728) {
-      scr_LogPrint(LPRINT_NORMAL, "Reading <%s> history file...", bjid);
-      scr_do_update();
-    }
+//  hlog_reader_page_segments(r, filename, budget)
+// Read the last records of the segments which are older than the reader
+// endtime, until budget bytes of messages are found.  Only the records we
+// need are read (see hlog_segment_page()).
+static void hlog_reader_page_segments(hlog_reader *r, const char *filename,
+                                      gsize budget)
+{
+  GSList *segments, *elt;
+
+  // Newest first
+  segments = hlog_segments_list(filename, 0, r->endtime, 0);
+  segments = g_slist_reverse(segments);
+  r->segdata = g_string_new(NULL);
+  for (elt = segments; elt && budget && !r->pending;
+       elt = g_slist_next(elt)) {
+    gsize found = hlog_segment_page(elt->data, r->endtime, budget,
+                                    r->segdata, &r->pending);
+    budget = found < budget ? budget - found : 0;
+  }
+  g_slist_foreach(segments, (GFunc)g_free, NULL);
+  g_slist_free(segments);
+  if (!r->segdata->len || r->pending) {
+    g_string_free(r->segdata, TRUE);
+    r->segdata = NULL;
+  }
+}
+
+//  hlog_reader_open(r)
+// Open the jid's history logfile and find the first record to read.
+// Returns FALSE if there is nothing to load.
+static gboolean hlog_reader_open(hlog_reader *r)
+{
+  const char *bjid = r->bjid;
+  time_t endtime = r->endtime;
+  char *filename;
+  FILE *fp;
+  struct stat bufstat;
+  off_t offset = 0;
+
+  if (r->opened)
+    return r->fp || r->seg || r->segments || r->segdata;
+  r->opened = TRUE;
+  hlog_pending_readers = g_slist_remove(hlog_pending_readers, r);
+
+  if (UseSegments) {
+    // The segments are named after the actual history file
+    char *logjid = hlog_get_log_jid(bjid);
+    filename = user_histo_file(logjid ? logjid : bjid);
+    g_free(logjid);
+  } else {
+    filename = user_histo_file(bjid);
   }
+  if (!filename)
+    return FALSE;
 
-  max_num_of_blocks = get_max_history_blocks();
+  // Make sure the pending records have been written
+  hlog_flush_filename(filename);
+  fp = fopen(filename, "r");
+  if (fp && (fstat(fileno(fp), &bufstat) || !bufstat.st_size)) {
+    fclose(fp);
+    fp = NULL;
+  }
+  // (There can be segments without the current history file)
+  if (!fp && !UseSegments) {
+    g_free(filename);
+    return FALSE;
+  }
 
-  starttime = 0L;
-  if (settings_opt_get_int("max_history_age") > 0) {
+  r->fp = fp;
+  r->end = fp ? bufstat.st_size : 0;
+  // The records written since the reader creation are not ours
+  if (r->limit >= 0 && r->limit < r->end)
+    r->end = r->limit;
+  r->data_size = HBB_BLOCKSIZE+32;
+  r->data = g_new(char, r->data_size);
+
+  // max_history_age is only used when the buffer history is loaded
+  if (!endtime && settings_opt_get_int("max_history_age") > 0) {
     int maxdays = settings_opt_get_int("max_history_age");
-    time(&starttime);
-    if (maxdays >= starttime/86400L)
-      starttime = 0L;
+    time(&r->starttime);
+    if (maxdays >= r->starttime/86400L)
+      r->starttime = 0L;
+    else
+      r->starttime -= maxdays * 86400L;
+  }
+
+  if (fp && endtime)
+    r->end = hlog_find_end_offset(filename, fp, r->end, endtime);
+
+  if (fp) {
+    // Only the last records will be kept if the number of blocks is
+    // limited, so we look for the first record we need from the end.
+    // If only the age is limited, the index tells us where to start.
+    if (!r->max_num_of_blocks && r->starttime)
+      offset = hlog_index_find(filename, fp, r->end, r->starttime);
+    if (offset < 0 || r->max_num_of_blocks)
+      offset = hlog_find_start_offset(fp, r->end,
+                                      r->max_num_of_blocks * HBB_BLOCKSIZE,
+                                      r->starttime);
+    if (fseeko(fp, offset, SEEK_SET))
+      fseeko(fp, 0, SEEK_SET);
+  }
+  // If we need the beginning of the file, we may need the previous
+  // segments as well.
+  if (UseSegments && offset <= 0) {
+    gsize budget = r->max_num_of_blocks * HBB_BLOCKSIZE;
+    // What is missing to fill the buffer (a null budget means no limit)
+    if (budget)
+      budget = (gsize)r->end < budget ? budget - r->end : 1;
+    if (endtime && budget)
+      hlog_reader_page_segments(r, filename, budget);
     else
-      starttime -= maxdays * 86400L;
+      r->segments = hlog_segments_list(filename, r->starttime, endtime,
+                                       budget);
+  }
+  g_free(filename);
+
+  // The page will be read again when the segment is ready
+  if (r->pending && r->fp) {
+    fclose(r->fp);
+    r->fp = NULL;
+  }
+  if (r->fp && !r->end) {
+    fclose(r->fp);
+    r->fp = NULL;
+  }
+  return r->fp || r->segments || r->segdata;
+}
+
+//  hlog_reader_new(bjid)
+// Return a reader for the jid's history, or NULL if the history is not
+// loaded for this jid.  The max_history_blocks and max_history_age options
+// are used.
+// The files are not read until hlog_reader_read() is called.
+hlog_reader *hlog_reader_new(const char *bjid)
+{
+  return hlog_reader_create(bjid, 0, get_max_history_blocks());
+}
+
+//  hlog_reader_new_before(bjid, endtime, maxblocks)
+// Return a reader for the history records older than endtime, or NULL if
+// the history is not loaded for this jid.  Only the most recent records
+// which fit in maxblocks hbuf blocks are read.
+hlog_reader *hlog_reader_new_before(const char *bjid, time_t endtime,
+                                    guint maxblocks)
+{
+  return hlog_reader_create(bjid, endtime, maxblocks);
+}
+
+//  hlog_reader_pending(r)
+// Return TRUE if the records could not be read yet, because a compressed
+// segment is being decompressed.  scr_history_page_ready() is called when
+// the segment is ready.
+gboolean hlog_reader_pending(hlog_reader *r)
+{
+  return r->pending;
+}
+
+//  hlog_reader_remaining(r)
+// Return the number of bytes the reader still has to read.
+off_t hlog_reader_remaining(hlog_reader *r)
+{
+  GSList *elt;
+  off_t pos, size = 0;
+
+  if (!hlog_reader_open(r))
+    return 0;
+  for (elt = r->segments; elt; elt = g_slist_next(elt))
+    size += hlog_segment_size(elt->data);
+  if (r->segdata)
+    size += r->segdata->len - r->segpos;
+  if (!r->fp)
+    return size;
+  pos = ftello(r->fp);
+  return pos >= 0 && pos < r->end ? size + r->end - pos : size;
+}
+
+//  hlog_reader_gets(r, buf, size)
+// Read a line from the segments, and then from the history file.
+static char *hlog_reader_gets(hlog_reader *r, char *buf, int size)
+{
+  if (r->segdata && r->segpos < r->segdata->len) {
+    const char *line = r->segdata->str + r->segpos;
+    const char *eol;
+    gsize len = r->segdata->len - r->segpos;
+
+    eol = memchr(line, '\n', len);
+    if (eol)
+      len = eol - line + 1;
+    len = MIN(len, (gsize)size - 1);
+    memcpy(buf, line, len);
+    buf[len] = 0;
+    r->segpos += len;
+    return buf;
+  }
+
+  while (r->seg || r->segments) {
+    if (!r->seg) {
+      char *segname = r->segments->data;
+      r->segments = g_slist_delete_link(r->segments, r->segments);
+      r->seg = hlog_segopen(segname);
+      if (!r->seg)
+        scr_LogPrint(LPRINT_LOGNORM, "Cannot read history segment <%s>",
+                     segname);
+      g_free(segname);
+      continue;
+    }
+    if (hlog_seggets(r->seg, buf, size))
+      return buf;
+    hlog_segclose(r->seg);
+    r->seg = NULL;
   }
 
+  // Records written after the reader creation are not ours
+  if (!r->fp || feof(r->fp) || ftello(r->fp) >= r->end)
+    return NULL;
+  return fgets(buf, size, r->fp);
+}
+
+//  hlog_reader_read(r, p_buddyhbuf, width, maxrecords)
+// Read at most maxrecords records (0 means no limit) and add the messages
+// to the buffer.
+// Returns TRUE if there are more records to read.
+gboolean hlog_reader_read(hlog_reader *r, GList **p_buddyhbuf, guint width,
+                          guint maxrecords)
+{
+  guchar type, info;
+  char *data, *tail;
+  guint data_size;
+  char *xtext;
+  time_t timestamp;
+  guint prefix_flags;
+  guint len;
+  guint err = r->err;
+  guint ln = r->ln;
+  time_t starttime;
+  guint max_num_of_blocks = r->max_num_of_blocks;
+  const char *bjid = r->bjid;
+  guint nrecords = 0;
+  gboolean more = TRUE;
+
+  if (!hlog_reader_open(r))
+    return FALSE;
+  data = r->data;
+  data_size = r->data_size;
+  starttime = r->starttime;
+
   /* See write_histo_line() for line format... */
-  while (!feof(fp)) {
-    guint dataoffset = 25;
+  while (1) {
+    guint dataoffset;
     guint noeol;
 
-    if (fgets(data, data_size-1, fp) == NULL)
+    if (maxrecords && nrecords++ >= maxrecords)
+      break;
+    if (hlog_reader_gets(r, data, data_size-1) == NULL) {
+      more = FALSE;
       break;
+    }
     ln++;
 
     while (1) {
@@ -250,7 +3385,7 @@ void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width)
           data = g_renew(char, data, data_size);
           // Update the tail pointer, as the data may have been moved.
           tail = data + toffset;
-          if (fgets(tail, data_size-1 - (tail-data), fp) == NULL)
+          if (hlog_reader_gets(r, tail, data_size-1 - (tail-data)) == NULL)
             break;
         } else {
           scr_LogPrint(LPRINT_LOGNORM, "Line too long in history file!");
@@ -260,13 +3395,9 @@ void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width)
       }
     }
 
-    type = data[0];
-    info = data[1];
-
-    if ((type != 'M' && type != 'S') ||
-        ((data[11] != 'T') || (data[20] != 'Z') ||
-         (data[21] != ' ') ||
-         (data[25] != ' ' && data[26] != ' '))) {
+    dataoffset = parse_histo_header(data, tail - data, &type, &timestamp,
+                                    &len);
+    if (!dataoffset) {
       if (!err) {
         scr_LogPrint(LPRINT_LOGNORM,
                      "Error in history file format (%s), l.%u", bjid, ln);
@@ -274,11 +3405,7 @@ void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width)
       }
       continue;
     }
-    // The number of lines can be written with 3 or 4 bytes.
-    if (data[25] != ' ') dataoffset = 26;
-    data[21] = data[dataoffset] = 0;
-    timestamp = from_iso8601(&data[3], 1);
-    len = (guint) atoi(&data[22]);
+    info = data[1];
 
     // Some checks
     if (((type == 'M') && (info != 'S' && info != 'R' && info != 'I')) ||
@@ -293,7 +3420,7 @@ void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width)
 
     while (len--) {
       ln++;
-      if (fgets(tail, data_size-1 - (tail-data), fp) == NULL)
+      if (hlog_reader_gets(r, tail, data_size-1 - (tail-data)) == NULL)
         break;
 
       while (*tail) tail++;
@@ -324,6 +3451,10 @@ void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width)
     if ((tail > data+dataoffset+1) && (*(tail-1) == '\n'))
       *(tail-1) = 0;
 
+    // The records of a segment can be more recent than endtime
+    if (r->endtime && timestamp >= r->endtime)
+      continue;
+
     // Check if the data is older than max_history_age
     if (starttime) {
       if (timestamp > starttime)
@@ -341,20 +3472,70 @@ void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width)
         if (info == 'I')
           prefix_flags = HBB_PREFIX_INFO;
       }
-      converted = from_utf8(&data[dataoffset+1]);
+      // With an UTF-8 locale, there is nothing to convert; the data only
+      // has to be valid.
+      if (utf8_mode)
+        converted = g_utf8_validate(&data[dataoffset+1], -1, NULL) ?
+                    &data[dataoffset+1] : NULL;
+      else
+        converted = from_utf8(&data[dataoffset+1]);
       if (converted) {
         xtext = ut_expand_tabs(converted); // Expand tabs
         hbuf_add_line(p_buddyhbuf, xtext, timestamp, prefix_flags, width,
                       max_num_of_blocks, 0, NULL);
         if (xtext != converted)
           g_free(xtext);
-        g_free(converted);
+        if (converted != &data[dataoffset+1])
+          g_free(converted);
       }
       err = 0;
     }
   }
-  fclose(fp);
-  g_free(data);
+  r->data = data;
+  r->data_size = data_size;
+  r->err = err;
+  r->ln = ln;
+  r->starttime = starttime;
+  return more;
+}
+
+//  hlog_reader_free(r)
+// Close the history file and free the reader.
+void hlog_reader_free(hlog_reader *r)
+{
+  if (!r->opened)
+    hlog_pending_readers = g_slist_remove(hlog_pending_readers, r);
+  if (r->seg)
+    hlog_segclose(r->seg);
+  g_slist_foreach(r->segments, (GFunc)g_free, NULL);
+  g_slist_free(r->segments);
+  if (r->segdata)
+    g_string_free(r->segdata, TRUE);
+  if (r->fp)
+    fclose(r->fp);
+  g_free(r->data);
+  g_free(r->jidfile);
+  g_free(r->bjid);
+  g_free(r);
+}
+
+//  hlog_read_history()
+// Reads the jid's history logfile
+void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width)
+{
+  hlog_reader *r = hlog_reader_new(bjid);
+
+  if (!r)
+    return;
+
+  // If the data is large (> 3MB here), display a message to inform the user
+  // (it can take a while...)
+  if (hlog_reader_remaining(r) > 3145728) {
+    scr_LogPrint(LPRINT_NORMAL, "Reading <%s> history file...", bjid);
+    scr_do_update();
+  }
+  hlog_reader_read(r, p_buddyhbuf, width, 0);
+  hlog_reader_free(r);
 }
 
 //  hlog_enable()
@@ -364,6 +3545,7 @@ void hlog_enable(guint enable, const char *root_dir, guint loadfiles)
 {
   UseFileLogging = enable;
   FileLoadLogs = loadfiles;
+  UseSegments = (settings_opt_get_int("logging_segments") > 0);
 
   if (enable || loadfiles) {
     if (root_dir) {
@@ -396,7 +3578,19 @@ void hlog_enable(guint enable, const char *root_dir, guint loadfiles)
                    "history log directory, logging DISABLED");
       UseFileLogging = FileLoadLogs = FALSE;
     }
+    if (RootDir)
+      hlog_index_dir_init();
+    if (UseFileLogging && !UseSearchIndex &&
+        settings_opt_get_int("logging_search_index") > 0) {
+      UseSearchIndex = TRUE;
+      hlog_search_init();
+    }
   } else {  // Disable history logging
+    hlog_close_files();
+    if (UseSearchIndex) {
+      UseSearchIndex = FALSE;
+      hlog_search_deinit();
+    }
     g_free(RootDir);
     RootDir = NULL;
   }
@@ -436,63 +3630,75 @@ inline void hlog_write_status(const char *bjid, time_t timestamp,
 //  hlog_save_state()
 // If enabled, save the current state of the roster
 // (i.e. pending messages) to a temporary file.
+// The file is written atomically (a new file is renamed).
 void hlog_save_state(void)
 {
-  gpointer unread_ptr, first_unread;
-  const char *bjid;
-  char *statefile_xp;
+  GList *unread_jid, *jids;
+  char *statefile_xp, *tmpfile;
   FILE *fp;
   const char *statefile = settings_opt_get("statefile");
 
+  if (hlog_state_source) {
+    g_source_remove(hlog_state_source);
+    hlog_state_source = 0;
+  }
+
   if (!statefile || !UseFileLogging)
     return;
 
-  statefile_xp = expand_filename(statefile);
-  fp = fopen(statefile_xp, "w");
-  if (!fp) {
-    scr_LogPrint(LPRINT_NORMAL, "Cannot open state file [%s]",
-                 strerror(errno));
-    goto hlog_save_state_return;
-  }
-
   if (!xmpp_is_online()) {
     // We're not connected.  Let's use the unread_jids hash.
-    GList *unread_jid = unread_jid_get_list();
-    unread_ptr = unread_jid;
-    for ( ; unread_jid ; unread_jid = g_list_next(unread_jid))
-      fprintf(fp, "%s\n", (char*)unread_jid->data);
-    g_list_free(unread_ptr);
-    goto hlog_save_state_return;
+    jids = unread_jid_get_list();
+  } else {
+    // We're connected.  Let's use the unread messages list.
+    jids = unread_msg_get_jid_list();
   }
 
-  if (!current_buddy) // Safety check -- shouldn't happen.
-    goto hlog_save_state_return;
-
-  // We're connected.  Let's use unread_msg().
-  unread_ptr = first_unread = unread_msg(NULL);
-  if (!first_unread)
-    goto hlog_save_state_return;
+  statefile_xp = expand_filename(statefile);
+  if (!jids) {
+    unlink(statefile_xp);
+    g_free(statefile_xp);
+    return;
+  }
 
-  do {
-    guint type = buddy_gettype(unread_ptr);
-    if (type & (ROSTER_TYPE_USER|ROSTER_TYPE_AGENT)) {
-      bjid = buddy_getjid(unread_ptr);
-      if (bjid)
-        fprintf(fp, "%s\n", bjid);
+  tmpfile = g_strdup_printf("%s.tmp", statefile_xp);
+  fp = fopen(tmpfile, "w");
+  if (!fp) {
+    scr_LogPrint(LPRINT_NORMAL, "Cannot open state file [%s]",
+                 strerror(errno));
+  } else {
+    for (unread_jid = jids; unread_jid; unread_jid = g_list_next(unread_jid))
+      fprintf(fp, "%s\n", (char*)unread_jid->data);
+    if (fclose(fp) || rename(tmpfile, statefile_xp)) {
+      scr_LogPrint(LPRINT_NORMAL, "Cannot write state file [%s]",
+                   strerror(errno));
+      unlink(tmpfile);
     }
-    unread_ptr = unread_msg(unread_ptr);
-  } while (unread_ptr && unread_ptr != first_unread);
-
-hlog_save_state_return:
-  if (fp) {
-    long filelen = ftell(fp);
-    fclose(fp);
-    if (!filelen)
-      unlink(statefile_xp);
   }
+  g_list_free(jids);
+  g_free(tmpfile);
   g_free(statefile_xp);
 }
 
+static gboolean hlog_save_state_timeout_callback(gpointer data)
+{
+  // source will be destroyed after return
+  hlog_state_source = 0;
+  hlog_save_state();
+  return FALSE;
+}
+
+//  hlog_save_state_later()
+// Save the state file a bit later, so that several changes of the unread
+// messages list are saved at once.
+void hlog_save_state_later(void)
+{
+  if (hlog_state_source || !UseFileLogging || !settings_opt_get("statefile"))
+    return;
+  hlog_state_source = g_timeout_add_seconds(HLOG_STATE_DELAY,
+                             hlog_save_state_timeout_callback, NULL);
+}
+
 //  hlog_load_state()
 // If enabled, load the current state of the roster
 // (i.e. pending messages) from a temporary file.
@@ -1,6 +1,7 @@
 #ifndef __MCABBER_HISTOLOG_H__
 #define __MCABBER_HISTOLOG_H__ 1
 
+#include <sys/types.h>
 #include <glib.h>
 
 #include <mcabber/xmpp.h>
@@ -8,11 +9,27 @@
 void hlog_enable(guint enable, const char *root_dir, guint loadfile);
 char *hlog_get_log_jid(const char *bjid);
 void hlog_read_history(const char *bjid, GList **p_buddyhbuf, guint width);
+
+typedef struct hlog_reader hlog_reader;
+
+hlog_reader *hlog_reader_new(const char *bjid);
+hlog_reader *hlog_reader_new_before(const char *bjid, time_t endtime,
+                                    guint maxblocks);
+gboolean hlog_reader_read(hlog_reader *r, GList **p_buddyhbuf, guint width,
+                          guint maxrecords);
+gboolean hlog_reader_pending(hlog_reader *r);
+off_t hlog_reader_remaining(hlog_reader *r);
+void hlog_reader_free(hlog_reader *r);
+
 void hlog_write_message(const char *bjid, time_t timestamp, int sent,
                         const char *msg);
 void hlog_write_status(const char *bjid, time_t timestamp,
                        enum imstatus status, const char *status_msg);
+void hlog_flush(void);
+void hlog_close_files(void);
+void hlog_search(const char *query);
 void hlog_save_state(void);
+void hlog_save_state_later(void);
 void hlog_load_state(void);
 
 #endif /* __MCABBER_HISTOLOG_H__ */
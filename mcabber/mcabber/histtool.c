@@ -0,0 +1,514 @@
+/*
+ * histtool.c   -- mcabber-history, history files maintenance tool
+ *
+ * Copyright (C) 2005-2010 Mikael Berthe <mikael@lilotux.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* mcabber-history merges history files (and segments) in chronological
+ * order, removes duplicate records and drops or repairs the corrupted
+ * ones.  The input files are read as streams: only HIST_REORDER_WINDOW
+ * records per input file are kept in memory, so that large histories can
+ * be processed.  The records which are out of order within this window
+ * are sorted; the ones which are further away are only reported.
+ * The output can be a single history file or monthly segments (see the
+ * logging_segments option).
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "histofmt.h"
+
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+// gzopen() can also read files which are not compressed
+typedef gzFile histfile;
+# define hist_open(name)            gzopen(name, "rb")
+# define hist_read(f, buf, len)     gzread(f, buf, len)
+# define hist_close(f)              gzclose(f)
+#else
+typedef FILE *histfile;
+# define hist_open(name)            fopen(name, "r")
+# define hist_read(f, buf, len)     fread(buf, 1, len, f)
+# define hist_close(f)              fclose(f)
+#endif
+
+#define HIST_LINE_CHUNK     4096
+#define HIST_REORDER_WINDOW 1024  // Records read ahead, per input file
+
+typedef struct {
+  GString *text;
+  time_t timestamp;
+} hist_record;
+
+typedef struct {
+  const char *filename;
+  histfile fp;
+  char buf[HIST_LINE_CHUNK];
+  gsize buflen, bufpos;
+  guint ln;             // Current line number
+  gboolean fileeof;     // All the records have been read from the file
+  GQueue window;        // Records read ahead, sorted by timestamp
+  GString *record;      // Next record, if eof is FALSE
+  time_t timestamp;
+  time_t last;          // Timestamp of the previous record
+  gboolean eof;
+} hist_input;
+
+static struct {
+  guint records;        // Records written
+  guint duplicates;     // Duplicate records removed
+  guint dropped;        // Invalid lines dropped
+  guint repaired;       // Truncated records or NUL characters repaired
+  guint reordered;      // Records sorted in the reorder window
+  guint unordered;      // Records older than the previous one (remaining)
+} stats;
+
+static gboolean quiet;
+
+static void hist_warning(hist_input *in, const char *msg)
+{
+  if (!quiet)
+    fprintf(stderr, "%s:%u: %s\n", in->filename, in->ln, msg);
+}
+
+//  read_line(in, line)
+// Read a complete line (whatever its length) from the input file.
+// A newline is added if the last line of the file does not have one.
+// The NUL characters are removed (mcabber would stop reading the file).
+// Returns FALSE at end of file.
+static gboolean read_line(hist_input *in, GString *line)
+{
+  gboolean eol = FALSE;
+  char *p;
+  gsize n;
+
+  g_string_truncate(line, 0);
+  while (!eol) {
+    if (in->bufpos == in->buflen) {
+      int len = hist_read(in->fp, in->buf, sizeof in->buf);
+      if (len <= 0)
+        break;
+      in->buflen = len;
+      in->bufpos = 0;
+    }
+    n = in->buflen - in->bufpos;
+    p = memchr(in->buf + in->bufpos, '\n', n);
+    if (p) {
+      n = p + 1 - (in->buf + in->bufpos);
+      eol = TRUE;
+    }
+    g_string_append_len(line, in->buf + in->bufpos, n);
+    in->bufpos += n;
+  }
+  if (!line->len)
+    return FALSE;
+  in->ln++;
+  if (memchr(line->str, 0, line->len)) {
+    gsize i, j;
+    for (i = j = 0; i < line->len; i++)
+      if (line->str[i])
+        line->str[j++] = line->str[i];
+    g_string_truncate(line, j);
+    hist_warning(in, "NUL character(s) removed");
+    stats.repaired++;
+  }
+  if (!line->len || line->str[line->len-1] != '\n')
+    g_string_append_c(line, '\n');
+  return TRUE;
+}
+
+//  valid_info(type, info)
+// Check the record info, see write_histo_line() in histolog.c.
+static gboolean valid_info(guchar type, guchar info)
+{
+  if (type == 'M')
+    return info == 'S' || info == 'R' || info == 'I';
+  return info && strchr("_OFDNAI", info);
+}
+
+//  input_read(in, record)
+// Read the next valid record of the input file.
+// Invalid lines are dropped, and the line count of truncated records is
+// fixed.
+// Returns FALSE at end of file.
+static gboolean input_read(hist_input *in, hist_record *record)
+{
+  GString *line = g_string_new(NULL);
+  GString *text = record->text;
+  gboolean found = FALSE;
+  guchar type;
+  guint nlines, dataoffset, n;
+
+  while (1) {
+    if (!read_line(in, text))
+      break;
+    dataoffset = parse_histo_header(text->str, text->len, &type,
+                                    &record->timestamp, &nlines);
+    if (!dataoffset || !valid_info(type, text->str[1])) {
+      // This is what mcabber would skip ("Error in history file format")
+      hist_warning(in, "invalid record header, line dropped");
+      stats.dropped++;
+      continue;
+    }
+
+    for (n = 0; n < nlines && read_line(in, line); n++)
+      g_string_append_len(text, line->str, line->len);
+    if (n < nlines) {
+      char count[16];
+      // The record has been truncated, fix its line count
+      hist_warning(in, "truncated record, line count fixed");
+      stats.repaired++;
+      g_snprintf(count, sizeof count, "%03u", n);
+      g_string_erase(text, 22, dataoffset - 22);
+      g_string_insert(text, 22, count);
+    }
+    found = TRUE;
+    break;
+  }
+  g_string_free(line, TRUE);
+  return found;
+}
+
+//  input_next(in)
+// Get the next record of the input file: the records are read ahead in
+// the reorder window, and the oldest one is used.  For records with the
+// same timestamp, the order of the file is kept.
+static void input_next(hist_input *in)
+{
+  hist_record *record;
+
+  while (!in->fileeof && in->window.length < HIST_REORDER_WINDOW) {
+    GList *prev;
+
+    record = g_new(hist_record, 1);
+    record->text = g_string_new(NULL);
+    if (!input_read(in, record)) {
+      g_string_free(record->text, TRUE);
+      g_free(record);
+      in->fileeof = TRUE;
+      break;
+    }
+    // Most records are in order, we start from the tail
+    for (prev = in->window.tail; prev; prev = prev->prev)
+      if (((hist_record *)prev->data)->timestamp <= record->timestamp)
+        break;
+    if (prev != in->window.tail)
+      stats.reordered++;
+    if (prev)
+      g_queue_insert_after(&in->window, prev, record);
+    else
+      g_queue_push_head(&in->window, record);
+  }
+
+  record = g_queue_pop_head(&in->window);
+  if (!record) {
+    in->eof = TRUE;
+    return;
+  }
+  g_string_free(in->record, TRUE);
+  in->record = record->text;
+  in->timestamp = record->timestamp;
+  g_free(record);
+
+  if (in->timestamp < in->last)
+    stats.unordered++;
+  in->last = in->timestamp;
+}
+
+// Output: a single file, or monthly segments
+typedef struct {
+  const char *filename;   // NULL for the standard output
+  char *tmpname;
+  FILE *fp;
+  gboolean segments;
+  gboolean compress;
+  int month;              // Month of the current segment
+} hist_output;
+
+static gboolean output_open(hist_output *out)
+{
+  if (!out->filename) {
+    out->fp = stdout;
+    return TRUE;
+  }
+  if (!out->tmpname)
+    out->tmpname = g_strdup_printf("%s.tmp", out->filename);
+  out->fp = fopen(out->tmpname, "w");
+  if (!out->fp) {
+    fprintf(stderr, "Cannot create %s: %s\n", out->tmpname, strerror(errno));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+//  output_close(out, destname)
+// Close the temporary output file, and rename it to destname (compressed
+// if destname ends with ".gz").
+static gboolean output_close(hist_output *out, const char *destname)
+{
+  gboolean ok = TRUE;
+
+  if (out->fp == stdout)
+    return !fflush(stdout);
+
+  if (fclose(out->fp)) {
+    fprintf(stderr, "Cannot write %s: %s\n", out->tmpname, strerror(errno));
+    ok = FALSE;
+  }
+  out->fp = NULL;
+  if (ok && !strcmp(destname, out->filename)) {
+    ok = !rename(out->tmpname, destname);
+    // The index of the history file is out of date, mcabber will
+    // rebuild it.
+    if (ok) {
+      char *dir = g_path_get_dirname(destname);
+      char *base = g_path_get_basename(destname);
+      char *idxname = g_strdup_printf("%s/.index/%s", dir, base);
+      unlink(idxname);
+      g_free(idxname);
+      g_free(dir);
+      g_free(base);
+    }
+#ifdef HAVE_LIBZ
+  } else if (ok && g_str_has_suffix(destname, ".gz")) {
+    char buf[HIST_LINE_CHUNK];
+    char *gzname = g_strdup_printf("%s.tmp", destname);
+    FILE *in = fopen(out->tmpname, "r");
+    gzFile gz = gzopen(gzname, "wb");
+    size_t n;
+
+    while (in && gz && (n = fread(buf, 1, sizeof buf, in)) > 0)
+      if (gzwrite(gz, buf, n) != (int)n)
+        break;
+    ok = in && gz && !ferror(in) && feof(in);
+    if (in)
+      fclose(in);
+    if (gz && gzclose(gz) != Z_OK)
+      ok = FALSE;
+    if (ok)
+      ok = !rename(gzname, destname) && !unlink(out->tmpname);
+    else
+      unlink(gzname);
+    g_free(gzname);
+#endif
+  } else if (ok) {
+    ok = !rename(out->tmpname, destname);
+  }
+  if (!ok)
+    fprintf(stderr, "Cannot write %s: %s\n", destname, strerror(errno));
+  return ok;
+}
+
+//  output_record(out, record, timestamp)
+// Write a record.  With segments, a new segment is started when the record
+// belongs to a new month.
+static gboolean output_record(hist_output *out, GString *record,
+                              time_t timestamp)
+{
+  if (out->segments) {
+    int month = histo_month(timestamp);
+    if (out->month < 0) {
+      out->month = month;
+    } else if (month > out->month) {
+      struct stat bufstat;
+      char *segname = g_strdup_printf("%s.%04d-%02d", out->filename,
+                                      out->month / 12, out->month % 12 + 1);
+      char *gzname = g_strdup_printf("%s.gz", segname);
+      gboolean ok;
+
+      // Never overwrite an existing segment
+      if (!stat(segname, &bufstat) || !stat(gzname, &bufstat)) {
+        fprintf(stderr, "Segment %s already exists\n", segname);
+        ok = FALSE;
+      } else {
+        ok = output_close(out, out->compress ? gzname : segname);
+      }
+      g_free(gzname);
+      g_free(segname);
+      out->month = month;
+      if (!ok || !output_open(out))
+        return FALSE;
+    }
+  }
+  stats.records++;
+  return fwrite(record->str, 1, record->len, out->fp) == record->len;
+}
+
+static void usage(const char *name)
+{
+  printf("Usage: %s [-h|-c|[-o file [-s [-z]]]] [-q] histfile...\n", name);
+  printf("Merge mcabber history files (and segments) in chronological "
+         "order.\nDuplicate records are removed, and corrupted records are "
+         "dropped or\nrepaired.  The records of a file which are out of "
+         "order are sorted if\nthey are less than %d records away, the "
+         "others are only reported.\n\n", HIST_REORDER_WINDOW);
+  puts("  -h       display this help\n"
+       "  -c       check the files only\n"
+       "  -o file  write the result to file instead of the standard output\n"
+       "           (file can be one of the input files)\n"
+       "  -s       write monthly segments (file.yyyy-mm), the records of\n"
+       "           the last month are written to file\n"
+#ifdef HAVE_LIBZ
+       "  -z       compress the segments (file.yyyy-mm.gz)\n"
+#endif
+       "  -q       do not display warnings");
+}
+
+int main(int argc, char **argv)
+{
+  hist_output out = { NULL, NULL, NULL, FALSE, FALSE, -1 };
+  hist_input *inputs;
+  GHashTable *seen;
+  time_t seen_timestamp = 0;
+  gboolean check = FALSE, ok = TRUE;
+  int ninputs, i, c;
+
+  while ((c = getopt(argc, argv, "hco:szq")) != -1) {
+    switch (c) {
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    case 'c':
+      check = TRUE;
+      break;
+    case 'o':
+      out.filename = optarg;
+      break;
+    case 's':
+      out.segments = TRUE;
+      break;
+    case 'z':
+      out.compress = TRUE;
+      break;
+    case 'q':
+      quiet = TRUE;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+#ifndef HAVE_LIBZ
+  if (out.compress) {
+    fprintf(stderr, "Compression is not available (no zlib support).\n");
+    return 1;
+  }
+#endif
+  if (optind >= argc || (out.segments && !out.filename) ||
+      (out.compress && !out.segments)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  ninputs = argc - optind;
+  inputs = g_new0(hist_input, ninputs);
+  for (i = 0; i < ninputs; i++) {
+    hist_input *in = &inputs[i];
+    in->filename = argv[optind + i];
+    in->fp = hist_open(in->filename);
+    if (!in->fp) {
+      fprintf(stderr, "Cannot open %s: %s\n", in->filename, strerror(errno));
+      return 1;
+    }
+    in->record = g_string_new(NULL);
+    input_next(in);
+  }
+
+  if (!check && !output_open(&out))
+    return 1;
+
+  // Records with the same timestamp, to find the duplicates
+  seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  // k-way merge: write the oldest record of the input files.  For records
+  // with the same timestamp, the order of the files is kept.
+  while (ok) {
+    hist_input *next = NULL;
+
+    for (i = 0; i < ninputs; i++) {
+      if (!inputs[i].eof &&
+          (!next || inputs[i].timestamp < next->timestamp))
+        next = &inputs[i];
+    }
+    if (!next)
+      break;
+
+    if (next->timestamp != seen_timestamp) {
+      g_hash_table_remove_all(seen);
+      seen_timestamp = next->timestamp;
+    }
+    if (g_hash_table_lookup(seen, next->record->str)) {
+      stats.duplicates++;
+    } else {
+      g_hash_table_insert(seen, g_strdup(next->record->str), &seen);
+      if (check)
+        stats.records++;
+      else
+        ok = output_record(&out, next->record, next->timestamp);
+    }
+    input_next(next);
+  }
+  g_hash_table_destroy(seen);
+
+  for (i = 0; i < ninputs; i++) {
+    hist_record *record;
+    while ((record = g_queue_pop_head(&inputs[i].window)) != NULL) {
+      g_string_free(record->text, TRUE);
+      g_free(record);
+    }
+    hist_close(inputs[i].fp);
+    g_string_free(inputs[i].record, TRUE);
+  }
+  g_free(inputs);
+
+  if (!check) {
+    if (ok)
+      ok = output_close(&out, out.filename);
+    else if (out.tmpname)
+      unlink(out.tmpname);
+    g_free(out.tmpname);
+    if (!ok)
+      fprintf(stderr, "Error while writing the history.\n");
+  }
+
+  if (!quiet || check) {
+    fprintf(stderr, "%u records, %u duplicates removed, %u invalid lines "
+            "dropped, %u records repaired", stats.records, stats.duplicates,
+            stats.dropped, stats.repaired);
+    if (stats.reordered)
+      fprintf(stderr, ", %u records reordered", stats.reordered);
+    if (stats.unordered)
+      fprintf(stderr, ", %u records out of order", stats.unordered);
+    fputs(".\n", stderr);
+  }
+
+  if (!ok)
+    return 1;
+  if (check && (stats.duplicates || stats.dropped || stats.repaired ||
+                stats.reordered || stats.unordered))
+    return 2;
+  return 0;
+}
+
+/* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
@@ -512,6 +512,7 @@ void hk_statuschange(const char *bjid, const char *resname, gchar prio,
   char *logsmsg;
   const char *rn = (resname ? resname : "");
   const char *ename = NULL;
+  GSList *sl_user;
 
   if (settings_opt_get_int("eventcmd_use_nickname"))
     ename = roster_getname(bjid);
@@ -562,7 +563,9 @@ void hk_statuschange(const char *bjid, const char *resname, gchar prio,
 
   roster_setstatus(bjid, rn, prio, status, status_msg, timestamp,
                    role_none, affil_none, NULL);
-  buddylist_build();
+  sl_user = roster_find(bjid, jidsearch, 0);
+  if (sl_user)
+    buddylist_update_buddy(sl_user->data);
   scr_draw_roster();
   hlog_write_status(bjid, timestamp, status, status_msg);
 
@@ -675,6 +678,10 @@ void hk_unread_list_change(guint unread_count, guint attention_count,
   static guint prev_muc_attention = 65535;
   gchar *str_unread;
 
+  // The unread list has (probably) been modified, the state file will be
+  // updated.
+  hlog_save_state_later();
+
   // Do not call the handlers if the unread values haven't changed
   if (unread_count    == prev_unread     &&
       attention_count == prev_attention  &&
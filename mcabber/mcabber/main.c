@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <termios.h>
 #include <sys/types.h>
@@ -65,6 +67,11 @@
 static unsigned int terminate_ui;
 GMainContext *main_context;
 
+// The termination signals are handled in the main loop: the signal handler
+// writes to this pipe (see signal_pipe_init()).
+static int signal_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t terminate_signal;
+
 static struct termios *backup_termios;
 
 char *mcabber_version(void)
@@ -84,6 +91,9 @@ static void mcabber_terminate(const char *msg)
   fifo_deinit();
 #endif
   xmpp_disconnect();
+  /* Save pending message state */
+  hlog_save_state();
+  hlog_close_files();
   scr_terminate_curses();
 
   // Restore term settings, if needed.
@@ -96,6 +106,47 @@ static void mcabber_terminate(const char *msg)
   exit(EXIT_SUCCESS);
 }
 
+//  signal_pipe_callback()
+// Terminate mcabber after a termination signal, from the main loop.
+static gboolean signal_pipe_callback(GIOChannel *channel,
+                                     GIOCondition condition, gpointer data)
+{
+  char buf[16];
+
+  while (read(signal_pipe[0], buf, sizeof buf) > 0)
+    ;
+
+  if (terminate_signal == SIGTERM)
+    mcabber_terminate("Killed by SIGTERM");
+  else if (terminate_signal == SIGINT)
+    mcabber_terminate("Killed by SIGINT");
+  else if (terminate_signal == SIGHUP)
+    mcabber_terminate("Killed by SIGHUP");
+  return TRUE;
+}
+
+//  signal_pipe_init()
+// Create the pipe used to forward the termination signals to the main
+// loop.  If it cannot be created, the signal handler terminates mcabber.
+static void signal_pipe_init(void)
+{
+  GIOChannel *channel;
+  int i;
+
+  if (pipe(signal_pipe) == -1) {
+    signal_pipe[0] = signal_pipe[1] = -1;
+    return;
+  }
+  for (i = 0; i < 2; i++) {
+    fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK);
+    fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  channel = g_io_channel_unix_new(signal_pipe[0]);
+  g_io_add_watch(channel, G_IO_IN, signal_pipe_callback, NULL);
+  g_io_channel_unref(channel);
+}
+
 void sig_handler(int signum)
 {
   if (signum == SIGCHLD) {
@@ -114,12 +165,22 @@ void sig_handler(int signum)
       }
     } while (pid > 0);
     signal(SIGCHLD, sig_handler);
-  } else if (signum == SIGTERM) {
-    mcabber_terminate("Killed by SIGTERM");
-  } else if (signum == SIGINT) {
-    mcabber_terminate("Killed by SIGINT");
-  } else if (signum == SIGHUP) {
-    mcabber_terminate("Killed by SIGHUP");
+  } else if (signum == SIGTERM || signum == SIGINT || signum == SIGHUP) {
+    // mcabber_terminate() saves the state and closes the history files,
+    // which cannot be done safely from a signal handler.
+    if (signal_pipe[1] != -1) {
+      int saved_errno = errno;
+      terminate_signal = signum;
+      // If the pipe is full, a byte is already waiting to be read
+      if (write(signal_pipe[1], "", 1) == -1) {}
+      errno = saved_errno;
+    } else if (signum == SIGTERM) {
+      mcabber_terminate("Killed by SIGTERM");
+    } else if (signum == SIGINT) {
+      mcabber_terminate("Killed by SIGINT");
+    } else {
+      mcabber_terminate("Killed by SIGHUP");
+    }
 #ifdef USE_SIGWINCH
   } else if (signum == SIGWINCH) {
     if (scr_curses_status())
@@ -330,8 +391,15 @@ int main(int argc, char **argv)
   int optval, optval2;
   int ret;
 
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+  // A thread pool is used to rewrap the buffers
+  if (!g_thread_supported())
+    g_thread_init(NULL);
+#endif
+
   credits();
 
+  signal_pipe_init();
   signal(SIGTERM, sig_handler);
   signal(SIGINT,  sig_handler);
   signal(SIGHUP,  sig_handler);
@@ -514,6 +582,7 @@ int main(int argc, char **argv)
   scr_terminate_curses();
   /* Save pending message state */
   hlog_save_state();
+  hlog_close_files();
   caps_free();
 
   printf("\n\nThanks for using mcabber!\n");
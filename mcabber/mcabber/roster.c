@@ -19,14 +19,13 @@
  * USA
  */
 
+#include <ctype.h>
 #include <string.h>
 
 #include "roster.h"
 #include "utils.h"
 #include "hooks.h"
 
-extern void hlog_save_state(void);
-
 char *strrole[] = {   /* Should match enum in roster.h */
   "none",
   "moderator",
@@ -111,6 +110,23 @@ typedef struct {
   guint flags;
   guint ui_prio;  // Boolean, positive if "attention" is requested
 
+  /* Unread messages set (see unread_add()) */
+  GSequenceIter *unread_iter; // Position in unread_set, NULL if not in it
+  guint unread_serial;        // Insertion order in the set
+
+  /* Buddylist state (see buddylist_update_buddy()) */
+  guint in_buddylist; // User passes the buddylist filters
+  guint bl_members;   // Group: number of members passing the filters
+  guint in_statusfilter;  // User status passes the display filter
+  guint bl_status_members; // Group: number of members with such a status
+
+  /* Group unread state (see group_unread_update()) */
+  guint unread_members; // Group: number of members with ROSTER_FLAG_MSG
+
+  /* Search keys (see roster_search_keys()) */
+  gchar *search_jid;  // Normalized, case-folded jid
+  gchar *search_name; // Normalized, case-folded name
+
   // list: user -> points to his group; group -> points to its users list
   GSList *list;
 } roster;
@@ -120,16 +136,41 @@ typedef struct {
 
 static guchar display_filter;
 static GSList *groups;
-static GSList *unread_list;
+// Items with unread messages, sorted by ui (attn) priority, the most
+// recently added first for a given priority.  The counters passed to the
+// unread list change hook are updated when the set is modified.
+static GSequence *unread_set;
+static guint unread_serial;
+static struct {
+  guint unread, attention, muc_unread, muc_attention;
+} unread_counters;
 static GHashTable *unread_jids;
+// Indexes used by roster_find():
+// - roster_jids: bare jid -> user GSList element (in the group users list)
+// - roster_groups: group name -> group GSList element (in groups)
+static GHashTable *roster_jids;
+static GHashTable *roster_groups;
+// Bulk loading state (see roster_bulk_begin())
+static gboolean roster_bulk;
 GList *buddylist;
 GList *current_buddy;
 GList *alternate_buddy;
 GList *last_activity_buddy;
+// Buddylist index: roster item -> buddylist element
+static GHashTable *buddylist_nodes;
+static GList *buddylist_tail;
 
 static roster roster_special;
 
+// Fuzzy search state (see buddy_fuzzy_search())
+static struct {
+  gchar *query;       // Case-folded query of the last search
+  GPtrArray *matches; // Matching roster items, best match first
+  guint index;        // Index of the selected item in matches
+} fuzzy;
+
 static int  unread_jid_del(const char *jid);
+static void buddylist_remove_node(roster *roster_usr);
 
 #define DFILTER_ALL     63
 #define DFILTER_ONLINE  62
@@ -281,15 +322,150 @@ static inline void free_roster_user_data(roster *roster_usr)
   g_free((gchar*)roster_usr->nickname);
   g_free((gchar*)roster_usr->topic);
   g_free((gchar*)roster_usr->offline_status_message);
+  g_free(roster_usr->search_jid);
+  g_free(roster_usr->search_name);
   free_all_resources(&roster_usr->resource);
   g_free(roster_usr);
 }
 
-// Comparison function used to search in the roster (compares jids and types)
-static gint roster_compare_jid_type(roster *a, roster *b) {
-  if (! (a->type & b->type))
-    return -1; // arbitrary (but should be != 0, of course)
-  return strcasecmp(a->jid, b->jid);
+// Comparison function used to sort the roster (by name)
+static gint roster_compare_name(roster *a, roster *b) {
+  return strcmp(a->name, b->name);
+}
+
+/* ### Search keys ###
+ *
+ * Searches compare normalized, case-folded strings.  The keys are computed
+ * when the item is created or renamed, so that a search doesn't need to
+ * convert every roster item.
+ */
+
+// Fuzzy search scores (see fuzzy_score())
+#define FUZZY_SUBSTRING   1000
+#define FUZZY_PREFIX      200
+#define FUZZY_WORD_START  100
+
+//  search_fold(str)
+// Returns the normalized, case-folded version of the UTF-8 string str.
+// The result must be freed.
+static gchar *search_fold(const char *str)
+{
+  gchar *norm, *folded;
+
+  if (!str || !(norm = g_utf8_normalize(str, -1, G_NORMALIZE_ALL)))
+    return g_strdup("");
+  folded = g_utf8_casefold(norm, -1);
+  g_free(norm);
+  return folded;
+}
+
+//  roster_search_keys(roster_usr)
+// Compute the search keys of the item, if they haven't been computed yet.
+static void roster_search_keys(roster *roster_usr)
+{
+  if (!roster_usr->search_jid)
+    roster_usr->search_jid = search_fold(roster_usr->jid);
+  if (!roster_usr->search_name)
+    roster_usr->search_name = search_fold(roster_usr->name);
+}
+
+//  fuzzy_reset()
+// Drop the fuzzy search candidates, when an item is added, removed or
+// renamed.
+static void fuzzy_reset(void)
+{
+  g_free(fuzzy.query);
+  fuzzy.query = NULL;
+  if (fuzzy.matches) {
+    g_ptr_array_free(fuzzy.matches, TRUE);
+    fuzzy.matches = NULL;
+  }
+  fuzzy.index = 0;
+}
+
+/* ### Roster indexes ###
+ *
+ * The roster_jids and roster_groups hash tables are kept in sync with the
+ * groups lists, so that roster_find() does not need to walk all the users
+ * lists for jid and group name searches.
+ * Keys are not duplicated, they point to the roster item jid/name, which
+ * means an item must be removed from the index before it is freed.
+ */
+
+// JIDs are compared case-insensitively
+static guint roster_jid_hash(gconstpointer key)
+{
+  const char *p = key;
+  guint h = 5381;
+
+  for ( ; *p; p++)
+    h = (h << 5) + h + (guint)tolower((unsigned char)*p);
+  return h;
+}
+
+static gboolean roster_jid_equal(gconstpointer a, gconstpointer b)
+{
+  return !strcasecmp(a, b);
+}
+
+static void roster_index_init(void)
+{
+  if (!roster_jids)
+    roster_jids = g_hash_table_new(roster_jid_hash, roster_jid_equal);
+  if (!roster_groups)
+    roster_groups = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+static inline void roster_index_add_user(GSList *sl_user)
+{
+  roster_index_init();
+  g_hash_table_insert(roster_jids, ((roster*)sl_user->data)->jid, sl_user);
+}
+
+static inline void roster_index_del_user(roster *roster_usr)
+{
+  if (roster_jids)
+    g_hash_table_remove(roster_jids, roster_usr->jid);
+}
+
+static inline void roster_index_add_group(GSList *sl_group)
+{
+  roster_index_init();
+  g_hash_table_insert(roster_groups, ((roster*)sl_group->data)->name,
+                      sl_group);
+}
+
+static inline void roster_index_del_group(roster *roster_grp)
+{
+  if (roster_groups)
+    g_hash_table_remove(roster_groups, roster_grp->name);
+}
+
+//  group_insert_user(roster_grp, roster_usr)
+// Insert roster_usr in the (sorted) users list of the group and
+// return the new list element.
+// When loading a roster in bulk, the user is prepended and the lists are
+// sorted by roster_bulk_end().
+static GSList *group_insert_user(roster *roster_grp, roster *roster_usr)
+{
+  GSList *prev = NULL, *next, *sl_user;
+
+  if (roster_bulk) {
+    roster_grp->list = g_slist_prepend(roster_grp->list, roster_usr);
+    return roster_grp->list;
+  }
+
+  for (next = roster_grp->list; next; next = g_slist_next(next)) {
+    if (roster_compare_name(roster_usr, next->data) <= 0)
+      break;
+    prev = next;
+  }
+  sl_user = g_slist_prepend(next, roster_usr);
+  if (prev)
+    prev->next = sl_user;
+  else
+    roster_grp->list = sl_user;
+  return sl_user;
 }
 
 // Comparison function used to search in the roster (compares names and types)
@@ -299,11 +475,6 @@ static gint roster_compare_name_type(roster *a, roster *b) {
   return strcmp(a->name, b->name);
 }
 
-// Comparison function used to sort the roster (by name)
-static gint roster_compare_name(roster *a, roster *b) {
-  return strcmp(a->name, b->name);
-}
-
 // Finds a roster element (user, group, agent...), by jid or name
 // If roster_type is 0, returns match of any type.
 // Returns the roster GSList element, or NULL if jid/name not found
@@ -312,7 +483,6 @@ GSList *roster_find(const char *jidname, enum findwhat type, guint roster_type)
   GSList *sl_roster_elt = groups;
   GSList *resource;
   roster sample;
-  GCompareFunc comp;
 
   if (!jidname) return NULL;
 
@@ -320,23 +490,36 @@ GSList *roster_find(const char *jidname, enum findwhat type, guint roster_type)
     roster_type = ROSTER_TYPE_USER  | ROSTER_TYPE_ROOM |
                   ROSTER_TYPE_AGENT | ROSTER_TYPE_GROUP;
 
-  sample.type = roster_type;
   if (type == jidsearch) {
-    sample.jid = (gchar*)jidname;
-    comp = (GCompareFunc)&roster_compare_jid_type;
-  } else if (type == namesearch) {
-    sample.name = (gchar*)jidname;
-    comp = (GCompareFunc)&roster_compare_name_type;
-  } else
+    // Only users, agents and rooms have a jid, and jids are unique
+    // in the roster.
+    if (!roster_jids)
+      return NULL;
+    resource = g_hash_table_lookup(roster_jids, jidname);
+    if (resource && (((roster*)resource->data)->type & roster_type))
+      return resource;
+    return NULL;
+  } else if (type != namesearch) {
     return NULL;    // Should not happen...
+  }
 
+  if ((roster_type & ROSTER_TYPE_GROUP) && roster_groups) {
+    resource = g_hash_table_lookup(roster_groups, jidname);
+    if (resource)
+      return resource;
+  }
+
+  // Other items can share the same name, we need to look at the
+  // users lists.
+  if (!(roster_type & ~ROSTER_TYPE_GROUP))
+    return NULL;
+
+  sample.type = roster_type;
+  sample.name = (gchar*)jidname;
   while (sl_roster_elt) {
     roster *roster_elt = (roster*)sl_roster_elt->data;
-    if (roster_type & ROSTER_TYPE_GROUP) {
-      if ((type == namesearch) && !strcmp(jidname, roster_elt->name))
-        return sl_roster_elt;
-    }
-    resource = g_slist_find_custom(roster_elt->list, &sample, comp);
+    resource = g_slist_find_custom(roster_elt->list, &sample,
+                                   (GCompareFunc)&roster_compare_name_type);
     if (resource) return resource;
     sl_roster_elt = g_slist_next(sl_roster_elt);
   }
@@ -359,14 +542,105 @@ GSList *roster_add_group(const char *name)
     // #3 Insert (sorted)
     groups = g_slist_insert_sorted(groups, roster_grp,
             (GCompareFunc)&roster_compare_name);
-    p_group = roster_find(name, namesearch, ROSTER_TYPE_GROUP);
+    p_group = g_slist_find(groups, roster_grp);
+    roster_index_add_group(p_group);
   }
   return p_group;
 }
 
-// Comparison function used to sort the unread list by ui (attn) priority
-static gint _roster_compare_uiprio(roster *a, roster *b) {
-  return (b->ui_prio - a->ui_prio);
+// Comparison function used to sort the unread set by ui (attn) priority
+static gint _roster_compare_uiprio(gconstpointer a, gconstpointer b,
+                                   gpointer data)
+{
+  const roster *ra = a, *rb = b;
+
+  if (ra->ui_prio != rb->ui_prio)
+    return ra->ui_prio > rb->ui_prio ? -1 : 1;
+  if (ra->unread_serial != rb->unread_serial)
+    return ra->unread_serial > rb->unread_serial ? -1 : 1;
+  return 0;
+}
+
+//  unread_count(roster_usr, delta)
+// Update the unread counters for the item.
+static void unread_count(roster *roster_usr, int delta)
+{
+  unread_counters.unread += delta;
+  if (roster_usr->type & ROSTER_TYPE_ROOM) {
+    unread_counters.muc_unread += delta;
+    if (roster_usr->ui_prio >= ROSTER_UI_PRIO_MUC_HL_MESSAGE)
+      unread_counters.muc_attention += delta;
+  } else {
+    if (roster_usr->ui_prio >= ROSTER_UI_PRIO_ATTENTION_MESSAGE)
+      unread_counters.attention += delta;
+  }
+}
+
+//  unread_add(roster_usr)
+// Add the item to the unread messages set, unless it is already there.
+static void unread_add(roster *roster_usr)
+{
+  if (roster_usr->unread_iter)
+    return;
+  if (!unread_set)
+    unread_set = g_sequence_new(NULL);
+  roster_usr->unread_serial = ++unread_serial;
+  roster_usr->unread_iter = g_sequence_insert_sorted(unread_set, roster_usr,
+                                                     _roster_compare_uiprio,
+                                                     NULL);
+  unread_count(roster_usr, 1);
+}
+
+//  unread_remove(roster_usr)
+// Remove the item from the unread messages set, if it is there.
+static void unread_remove(roster *roster_usr)
+{
+  if (!roster_usr->unread_iter)
+    return;
+  unread_count(roster_usr, -1);
+  g_sequence_remove(roster_usr->unread_iter);
+  roster_usr->unread_iter = NULL;
+}
+
+//  group_unread_update(roster_usr, delta)
+// Update the unread members counter of the user's group, after the user
+// ROSTER_FLAG_MSG flag has been set (delta = 1) or cleared (delta = -1).
+// The group has the ROSTER_FLAG_MSG flag if one of its members has it.
+static void group_unread_update(roster *roster_usr, int delta)
+{
+  roster *roster_grp = (roster*)roster_usr->list->data;
+
+  if (delta < 0 && !roster_grp->unread_members)
+    return;
+  roster_grp->unread_members += delta;
+  if (roster_grp->unread_members)
+    roster_grp->flags |= ROSTER_FLAG_MSG;
+  else
+    roster_grp->flags &= ~ROSTER_FLAG_MSG;
+}
+
+//  group_status_update(roster_usr)
+// Update the status counter of the user's group (displayed for folded
+// groups), after the user status may have changed.  The counters are
+// computed by buddylist_build(), so nothing is done if there is no
+// buddylist yet.
+static void group_status_update(roster *roster_usr)
+{
+  roster *roster_grp = (roster*)roster_usr->list->data;
+  gboolean visible;
+
+  if (!buddylist)
+    return;
+
+  visible = buddylist_is_status_filtered(buddy_getstatus(roster_usr,
+                                                        NULL)) != 0;
+  if (visible == (gboolean)roster_usr->in_statusfilter)
+    return;
+  roster_usr->in_statusfilter = visible;
+  if (visible)
+    roster_grp->bl_status_members++;
+  else if (roster_grp->bl_status_members)
+    roster_grp->bl_status_members--;
 }
 
 // Returns a pointer to the new user, or existing user with that name
@@ -425,21 +699,23 @@ GSList *roster_add_user(const char *jid, const char *name, const char *group,
     roster_usr->name = g_strdup(str);
     g_free(str);
   }
-  if (unread_jid_del(jid)) {
-    roster_usr->flags |= ROSTER_FLAG_MSG;
-    // Append the roster_usr to unread_list
-    unread_list = g_slist_insert_sorted(unread_list, roster_usr,
-                                        (GCompareFunc)&_roster_compare_uiprio);
-  }
+  roster_search_keys(roster_usr);
+  fuzzy_reset();
   roster_usr->type = type;
   roster_usr->subscription = esub;
   roster_usr->list = slist;    // (my_group SList element)
+  if (unread_jid_del(jid)) {
+    roster_usr->flags |= ROSTER_FLAG_MSG;
+    group_unread_update(roster_usr, 1);
+    // Add the roster_usr to unread_set
+    unread_add(roster_usr);
+  }
   if (onserver == 1)
     roster_usr->on_server = TRUE;
   // #4 Insert node (sorted)
-  my_group->list = g_slist_insert_sorted(my_group->list, roster_usr,
-                                         (GCompareFunc)&roster_compare_name);
-  return roster_find(jid, jidsearch, type);
+  slist = group_insert_user(my_group, roster_usr);
+  roster_index_add_user(slist);
+  return slist;
 }
 
 // Removes user (jid) from roster, frees allocated memory
@@ -448,7 +724,6 @@ void roster_del_user(const char *jid)
   GSList *sl_user, *sl_group;
   GSList **sl_group_listptr;
   roster *roster_usr;
-  GSList *node;
 
   sl_user = roster_find(jid, jidsearch,
                         ROSTER_TYPE_USER|ROSTER_TYPE_AGENT|ROSTER_TYPE_ROOM);
@@ -456,15 +731,23 @@ void roster_del_user(const char *jid)
     return;
   roster_usr = (roster*)sl_user->data;
 
-  // Remove (if present) from unread messages list
-  node = g_slist_find(unread_list, roster_usr);
-  if (node) unread_list = g_slist_delete_link(unread_list, node);
+  // Remove (if present) from unread messages set
+  unread_remove(roster_usr);
   // If there is a pending unread message, keep track of it
-  if (roster_usr->flags & ROSTER_FLAG_MSG)
+  if (roster_usr->flags & ROSTER_FLAG_MSG) {
     unread_jid_add(roster_usr->jid);
+    group_unread_update(roster_usr, -1);
+  }
 
   sl_group = roster_usr->list;
 
+  // Remove the jid from the index before the key is freed
+  roster_index_del_user(roster_usr);
+  fuzzy_reset();
+  // The buddylist must not keep a pointer to the freed item until it is
+  // rebuilt (which can be deferred)
+  buddylist_remove_node(roster_usr);
+
   // Let's free roster_usr memory (jid, name, status message...)
   free_roster_user_data(roster_usr);
 
@@ -473,7 +756,7 @@ void roster_del_user(const char *jid)
   *sl_group_listptr = g_slist_delete_link(*sl_group_listptr, sl_user);
 
   // We need to rebuild the list
-  if (current_buddy)
+  if (current_buddy && !roster_bulk)
     buddylist_build();
   // TODO What we could do, too, is to check if the deleted node is
   // current_buddy, in which case we could move current_buddy to the
@@ -485,10 +768,26 @@ void roster_free(void)
 {
   GSList *sl_grp = groups;
 
-  // Free unread_list
-  if (unread_list) {
-    g_slist_free(unread_list);
-    unread_list = NULL;
+  fuzzy_reset();
+
+  // Free unread_set (the special buffer can be in it, too)
+  if (unread_set) {
+    GSequenceIter *iter = g_sequence_get_begin_iter(unread_set);
+    for ( ; !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter))
+      ((roster*)g_sequence_get(iter))->unread_iter = NULL;
+    g_sequence_free(unread_set);
+    unread_set = NULL;
+    memset(&unread_counters, 0, sizeof unread_counters);
+  }
+
+  // Drop the indexes (the keys belong to the roster items)
+  if (roster_jids) {
+    g_hash_table_destroy(roster_jids);
+    roster_jids = NULL;
+  }
+  if (roster_groups) {
+    g_hash_table_destroy(roster_groups);
+    roster_groups = NULL;
   }
 
   // Walk through groups
@@ -508,9 +807,11 @@ void roster_free(void)
     // Free group's users list
     if (roster_grp->list)
       g_slist_free(roster_grp->list);
-    // Free group's name and jid
+    // Free group's name, jid and search keys
     g_free((gchar*)roster_grp->jid);
     g_free((gchar*)roster_grp->name);
+    g_free(roster_grp->search_jid);
+    g_free(roster_grp->search_name);
     g_free(roster_grp);
     sl_grp = g_slist_next(sl_grp);
   }
@@ -524,6 +825,37 @@ void roster_free(void)
   }
 }
 
+//  roster_bulk_begin()
+// Start loading many items at once (e.g. the roster received after the
+// connection).  Until roster_bulk_end() is called, the users lists are
+// not kept sorted and buddylist_build() calls are deferred, so that each
+// item can be added in constant time.
+void roster_bulk_begin(void)
+{
+  roster_bulk = TRUE;
+}
+
+//  roster_bulk_end()
+// Sort the users lists and build the buddylist once.
+// Note: g_slist_sort() keeps the list elements, so the jid index is still
+// valid.
+void roster_bulk_end(void)
+{
+  GSList *sl_grp;
+
+  if (!roster_bulk)
+    return;
+  roster_bulk = FALSE;
+
+  for (sl_grp = groups; sl_grp; sl_grp = g_slist_next(sl_grp)) {
+    roster *roster_grp = (roster*)sl_grp->data;
+    roster_grp->list = g_slist_sort(roster_grp->list,
+                                    (GCompareFunc)&roster_compare_name);
+  }
+
+  buddylist_build();
+}
+
 //  roster_setstatus()
 // Note: resname, role, affil and realjid are for room members only
 void roster_setstatus(const char *jid, const char *resname, gchar prio,
@@ -572,10 +904,11 @@ void roster_setstatus(const char *jid, const char *resname, gchar prio,
     p_res->realjid = g_strdup(realjid);
 
   // If bstat is offline, we MUST delete the resource, actually
-  if (bstat == offline) {
+  if (bstat == offline)
     del_resource(roster_usr, resname);
-    return;
-  }
+
+  // The buddylist is not always updated for status changes (e.g. rooms)
+  group_status_update(roster_usr);
 }
 
 //  roster_setflags()
@@ -598,33 +931,12 @@ void roster_setflags(const char *jid, guint flags, guint value)
 }
 
 //  roster_unread_check()
+// Call the unread list change hook with the current counters.
 static void roster_unread_check(void)
 {
-  guint unread_count = 0;
-  gpointer unread_ptr, first_unread;
-  guint muc_unread = 0, muc_attention = 0;
-  guint attention_count = 0;
-
-  unread_ptr = first_unread = unread_msg(NULL);
-  if (first_unread) {
-    do {
-      guint type = buddy_gettype(unread_ptr);
-      unread_count++;
-
-      if (type & ROSTER_TYPE_ROOM) {
-        muc_unread++;
-        if (buddy_getuiprio(unread_ptr) >= ROSTER_UI_PRIO_MUC_HL_MESSAGE)
-          muc_attention++;
-      } else {
-        if (buddy_getuiprio(unread_ptr) >= ROSTER_UI_PRIO_ATTENTION_MESSAGE)
-          attention_count++;
-      }
-      unread_ptr = unread_msg(unread_ptr);
-    } while (unread_ptr && unread_ptr != first_unread);
-  }
-
-  hk_unread_list_change(unread_count, attention_count,
-                        muc_unread, muc_attention);
+  hk_unread_list_change(unread_counters.unread, unread_counters.attention,
+                        unread_counters.muc_unread,
+                        unread_counters.muc_attention);
 }
 
 //  roster_msg_setflag()
@@ -634,7 +946,7 @@ static void roster_unread_check(void)
 void roster_msg_setflag(const char *jid, guint special, guint value)
 {
   GSList *sl_user;
-  roster *roster_usr, *roster_grp;
+  roster *roster_usr;
   int new_roster_item = FALSE;
   guint unread_list_modified = FALSE;
 
@@ -647,20 +959,14 @@ void roster_msg_setflag(const char *jid, guint special, guint value)
       if (!(roster_usr->flags & ROSTER_FLAG_MSG))
         unread_list_modified = TRUE;
       roster_usr->flags |= ROSTER_FLAG_MSG;
-      // Append the roster_usr to unread_list, but avoid duplicates
-      if (!g_slist_find(unread_list, roster_usr))
-        unread_list = g_slist_insert_sorted(unread_list, roster_usr,
-                                        (GCompareFunc)&_roster_compare_uiprio);
+      // Add the roster_usr to unread_set, but avoid duplicates
+      unread_add(roster_usr);
     } else {
       if (roster_usr->flags & ROSTER_FLAG_MSG)
         unread_list_modified = TRUE;
       roster_usr->flags &= ~ROSTER_FLAG_MSG;
+      unread_remove(roster_usr);
       roster_usr->ui_prio = 0;
-      if (unread_list) {
-        GSList *node = g_slist_find(unread_list, roster_usr);
-        if (node)
-          unread_list = g_slist_delete_link(unread_list, node);
-      }
     }
     goto roster_msg_setflag_return;
   }
@@ -674,59 +980,34 @@ void roster_msg_setflag(const char *jid, guint special, guint value)
   }
 
   roster_usr = (roster*)sl_user->data;
-  roster_grp = (roster*)roster_usr->list->data;
   if (value) {
-    if (!(roster_usr->flags & ROSTER_FLAG_MSG))
+    // Message flag is TRUE.  The group is flagged, too.
+    if (!(roster_usr->flags & ROSTER_FLAG_MSG)) {
       unread_list_modified = TRUE;
-    // Message flag is TRUE.  This is easy, we just have to set both flags
-    // to TRUE...
-    roster_usr->flags |= ROSTER_FLAG_MSG;
-    roster_grp->flags |= ROSTER_FLAG_MSG; // group
-    // Append the roster_usr to unread_list, but avoid duplicates
-    if (!g_slist_find(unread_list, roster_usr))
-      unread_list = g_slist_insert_sorted(unread_list, roster_usr,
-                                      (GCompareFunc)&_roster_compare_uiprio);
+      roster_usr->flags |= ROSTER_FLAG_MSG;
+      group_unread_update(roster_usr, 1);
+    }
+    // Add the roster_usr to unread_set, but avoid duplicates
+    unread_add(roster_usr);
   } else {
-    // Message flag is FALSE.
-    guint msg = FALSE;
-    if (roster_usr->flags & ROSTER_FLAG_MSG)
+    // Message flag is FALSE.  The group keeps its flag if another member
+    // has an unread message (see group_unread_update()).
+    if (roster_usr->flags & ROSTER_FLAG_MSG) {
       unread_list_modified = TRUE;
-    roster_usr->flags &= ~ROSTER_FLAG_MSG;
-    roster_usr->ui_prio = 0;
-    if (unread_list) {
-      GSList *node = g_slist_find(unread_list, roster_usr);
-      if (node)
-        unread_list = g_slist_delete_link(unread_list, node);
-    }
-    // For the group value we need to watch all buddies in this group;
-    // if one is flagged, then the group will be flagged.
-    // I will re-use sl_user and roster_usr here, as they aren't used
-    // anymore.
-    sl_user = roster_grp->list;
-    while (sl_user) {
-      roster_usr = (roster*)sl_user->data;
-      if (roster_usr->flags & ROSTER_FLAG_MSG) {
-        msg = TRUE;
-        break;
-      }
-      sl_user = g_slist_next(sl_user);
+      roster_usr->flags &= ~ROSTER_FLAG_MSG;
+      group_unread_update(roster_usr, -1);
     }
-    if (!msg)
-      roster_grp->flags &= ~ROSTER_FLAG_MSG;
-    else
-      roster_grp->flags |= ROSTER_FLAG_MSG;
-      // Actually the "else" part is useless, because the group
-      // ROSTER_FLAG_MSG should already be set...
+    unread_remove(roster_usr);
+    roster_usr->ui_prio = 0;
   }
 
-  if (buddylist && (new_roster_item || !g_list_find(buddylist, roster_usr)))
-    buddylist_build();
+  // Make sure the buddy is visible if it has an unread message
+  if (buddylist && (new_roster_item || value))
+    buddylist_update_buddy(roster_usr);
 
 roster_msg_setflag_return:
-  if (unread_list_modified) {
-    hlog_save_state();
+  if (unread_list_modified)
     roster_unread_check();
-  }
 }
 
 //  roster_setuiprio(jid, special, prio_value, action)
@@ -757,9 +1038,16 @@ void roster_setuiprio(const char *jid, guint special, guint value,
   else // prio_set
     newval = value;
 
-  roster_usr->ui_prio = newval;
-  unread_list = g_slist_sort(unread_list,
-                             (GCompareFunc)&_roster_compare_uiprio);
+  if (roster_usr->unread_iter) {
+    // Update the counters and the position in the unread set
+    unread_count(roster_usr, -1);
+    roster_usr->ui_prio = newval;
+    unread_count(roster_usr, 1);
+    g_sequence_sort_changed(roster_usr->unread_iter, _roster_compare_uiprio,
+                            NULL);
+  } else {
+    roster_usr->ui_prio = newval;
+  }
   roster_unread_check();
 }
 
@@ -812,13 +1100,11 @@ const char *roster_getnickname(const char *jid)
 void roster_settype(const char *jid, guint type)
 {
   GSList *sl_user;
-  roster *roster_usr;
 
   if ((sl_user = roster_find(jid, jidsearch, 0)) == NULL)
     return;
 
-  roster_usr = (roster*)sl_user->data;
-  roster_usr->type = type;
+  buddy_settype(sl_user->data, type);
 }
 
 enum imstatus roster_getstatus(const char *jid, const char *resname)
@@ -951,6 +1237,175 @@ guchar buddylist_get_filter(void)
   return display_filter;
 }
 
+//  buddylist_is_visible(roster_usr, roster_current)
+// Returns TRUE if the user should be in the buddylist, i.e. if either:
+// - buddy's status matches the display_filter
+// - buddy has a lock (for example the buddy window is currently open)
+// - buddy has a pending (non-read) message
+// - this is the current_buddy
+// The group folding (ROSTER_FLAG_HIDE) is not taken into account here.
+static inline gboolean buddylist_is_visible(roster *roster_usr,
+                                            roster *roster_current)
+{
+  return (roster_usr == roster_current ||
+          buddylist_is_status_filtered(buddy_getstatus(roster_usr, NULL)) ||
+          (roster_usr->flags &
+               (ROSTER_FLAG_LOCK | ROSTER_FLAG_USRLOCK | ROSTER_FLAG_MSG)));
+}
+
+//  buddylist_find(rosterdata)
+// Returns the buddylist element of the given roster item, or NULL if the
+// item is not in the buddylist.
+GList *buddylist_find(gpointer rosterdata)
+{
+  if (!buddylist_nodes || !rosterdata)
+    return NULL;
+  return g_hash_table_lookup(buddylist_nodes, rosterdata);
+}
+
+//  buddylist_insert_before(sibling, rosterdata)
+// Insert rosterdata before the sibling element (at the end of the buddylist
+// if sibling is NULL) and update the index.
+static void buddylist_insert_before(GList *sibling, gpointer rosterdata)
+{
+  GList *node;
+
+  if (sibling) {
+    buddylist = g_list_insert_before(buddylist, sibling, rosterdata);
+    node = sibling->prev;
+  } else {
+    // Appending to the tail element is a constant time operation
+    if (buddylist_tail) {
+      g_list_append(buddylist_tail, rosterdata);
+      node = buddylist_tail->next;
+    } else {
+      node = buddylist = g_list_append(NULL, rosterdata);
+    }
+    buddylist_tail = node;
+  }
+  g_hash_table_insert(buddylist_nodes, rosterdata, node);
+}
+
+//  buddylist_remove(rosterdata)
+// Remove rosterdata from the buddylist and update the index and the
+// buddylist pointers.
+static void buddylist_remove(gpointer rosterdata)
+{
+  GList *node = buddylist_find(rosterdata);
+
+  if (!node)
+    return;
+
+  g_hash_table_remove(buddylist_nodes, rosterdata);
+  if (node == buddylist_tail)
+    buddylist_tail = node->prev;
+  if (node == alternate_buddy)
+    alternate_buddy = NULL;
+  if (node == last_activity_buddy)
+    last_activity_buddy = NULL;
+  if (node == current_buddy) // E.g. the buddy has been deleted
+    current_buddy = (node->prev ? node->prev : node->next);
+  buddylist = g_list_delete_link(buddylist, node);
+}
+
+//  buddylist_next_group_node(sl_group)
+// Returns the buddylist element of the first group following sl_group
+// in the groups list, or NULL if there is none.
+static GList *buddylist_next_group_node(GSList *sl_group)
+{
+  GList *node;
+
+  for (sl_group = g_slist_next(sl_group); sl_group;
+       sl_group = g_slist_next(sl_group)) {
+    node = buddylist_find(sl_group->data);
+    if (node)
+      return node;
+  }
+  return NULL;
+}
+
+//  buddylist_update_buddy(rosterdata)
+// Update the buddylist for a single buddy whose status, flags or
+// the current_buddy pointer have changed.  The buddy (and possibly its
+// group) is inserted or removed, the rest of the list isn't modified.
+// Note: group or name changes still need a buddylist_build().
+void buddylist_update_buddy(gpointer rosterdata)
+{
+  roster *roster_usr = rosterdata;
+  roster *roster_grp;
+  roster *roster_current = NULL;
+  GSList *sl_user;
+  GList *next = NULL;
+  gboolean visible;
+
+  if (!buddylist || !roster_usr)
+    return;
+  if (!(roster_usr->type &
+        (ROSTER_TYPE_USER|ROSTER_TYPE_ROOM|ROSTER_TYPE_AGENT)))
+    return;
+
+  if (current_buddy)
+    roster_current = BUDDATA(current_buddy);
+
+  roster_grp = (roster*)roster_usr->list->data;
+
+  group_status_update(roster_usr);
+
+  visible = buddylist_is_visible(roster_usr, roster_current);
+  if (visible == (gboolean)roster_usr->in_buddylist)
+    return;
+
+  roster_usr->in_buddylist = visible;
+
+  if (!visible) {
+    buddylist_remove(roster_usr);
+    if (roster_grp->bl_members && !--roster_grp->bl_members)
+      buddylist_remove(roster_grp);
+    return;
+  }
+
+  // Add the group first, if needed
+  if (!roster_grp->bl_members++)
+    buddylist_insert_before(buddylist_next_group_node(roster_usr->list),
+                            roster_grp);
+
+  if (roster_grp->flags & ROSTER_FLAG_HIDE)
+    return;
+
+  // Insert the user before the next visible member of the group, or
+  // before the next group.
+  sl_user = roster_find(roster_usr->jid, jidsearch, 0);
+  for (sl_user = g_slist_next(sl_user); sl_user && !next;
+       sl_user = g_slist_next(sl_user)) {
+    if (((roster*)sl_user->data)->in_buddylist)
+      next = buddylist_find(sl_user->data);
+  }
+  if (!next)
+    next = buddylist_next_group_node(roster_usr->list);
+  buddylist_insert_before(next, roster_usr);
+}
+
+//  buddylist_remove_node(roster_usr)
+// Remove a user which is being deleted from the buddylist, and update
+// the group counters.  The group is removed if it has no visible member
+// left.
+static void buddylist_remove_node(roster *roster_usr)
+{
+  roster *roster_grp = (roster*)roster_usr->list->data;
+
+  if (roster_usr->in_statusfilter && roster_grp->bl_status_members)
+    roster_grp->bl_status_members--;
+  roster_usr->in_statusfilter = FALSE;
+
+  // The user is not in the list if its group is folded
+  buddylist_remove(roster_usr);
+  if (roster_usr->in_buddylist) {
+    roster_usr->in_buddylist = FALSE;
+    if (roster_grp->bl_members && !--roster_grp->bl_members)
+      buddylist_remove(roster_grp);
+  }
+}
+
 //  buddylist_build()
 // Creates the buddylist from the roster entries.
 void buddylist_build(void)
@@ -962,6 +1417,10 @@ void buddylist_build(void)
   roster *roster_last_activity_buddy = NULL;
   int shrunk_group;
 
+  // The buddylist is built by roster_bulk_end()
+  if (roster_bulk)
+    return;
+
   // We need to remember which buddy is selected.
   if (current_buddy)
     roster_current_buddy = BUDDATA(current_buddy);
@@ -978,8 +1437,13 @@ void buddylist_build(void)
     g_list_free(buddylist);
     buddylist = NULL;
   }
+  if (buddylist_nodes)
+    g_hash_table_remove_all(buddylist_nodes);
+  else
+    buddylist_nodes = g_hash_table_new(g_direct_hash, g_direct_equal);
 
-  buddylist = g_list_append(buddylist, &roster_special);
+  // The list is built backwards and reversed at the end
+  buddylist = g_list_prepend(buddylist, &roster_special);
 
   // Create the new list
   while (sl_roster_elt) {
@@ -989,26 +1453,25 @@ void buddylist_build(void)
     roster_elt = (roster*) sl_roster_elt->data;
 
     shrunk_group = roster_elt->flags & ROSTER_FLAG_HIDE;
+    roster_elt->bl_members = 0;
+    roster_elt->bl_status_members = 0;
 
     sl_roster_usrelt = roster_elt->list;
     while (sl_roster_usrelt) {
       roster_usrelt = (roster*) sl_roster_usrelt->data;
 
-      // Buddy will be added if either:
-      // - buddy's status matches the display_filter
-      // - buddy has a lock (for example the buddy window is currently open)
-      // - buddy has a pending (non-read) message
-      // - group isn't hidden (shrunk)
-      // - this is the current_buddy
-      if (roster_usrelt == roster_current_buddy ||
-          buddylist_is_status_filtered(buddy_getstatus((gpointer)roster_usrelt,
-                                                       NULL)) ||
-          (buddy_getflags((gpointer)roster_usrelt) &
-               (ROSTER_FLAG_LOCK | ROSTER_FLAG_USRLOCK | ROSTER_FLAG_MSG))) {
+      roster_usrelt->in_statusfilter = buddylist_is_status_filtered(
+                                  buddy_getstatus(roster_usrelt, NULL)) != 0;
+      if (roster_usrelt->in_statusfilter)
+        roster_elt->bl_status_members++;
+      roster_usrelt->in_buddylist = buddylist_is_visible(roster_usrelt,
+                                                  roster_current_buddy);
+      if (roster_usrelt->in_buddylist) {
+        roster_elt->bl_members++;
         // This user should be added.  Maybe the group hasn't been added yet?
         if (pending_group) {
           // It hasn't been done yet
-          buddylist = g_list_append(buddylist, roster_elt);
+          buddylist = g_list_prepend(buddylist, roster_elt);
           pending_group = FALSE;
         }
         // Add user
@@ -1016,7 +1479,7 @@ void buddylist_build(void)
         //     the group is shrunk? If so, we'd need to check LOCK flag too,
         //     perhaps...
         if (!shrunk_group)
-          buddylist = g_list_append(buddylist, roster_usrelt);
+          buddylist = g_list_prepend(buddylist, roster_usrelt);
       }
 
       sl_roster_usrelt = g_slist_next(sl_roster_usrelt);
@@ -1024,16 +1487,22 @@ void buddylist_build(void)
     sl_roster_elt = g_slist_next(sl_roster_elt);
   }
 
+  buddylist_tail = buddylist;
+  buddylist = g_list_reverse(buddylist);
+
+  {
+    GList *node;
+    for (node = buddylist; node; node = g_list_next(node))
+      g_hash_table_insert(buddylist_nodes, node->data, node);
+  }
+
   // Check if we can find our saved current_buddy...
-  if (roster_current_buddy)
-    current_buddy = g_list_find(buddylist, roster_current_buddy);
-  if (roster_alternate_buddy)
-    alternate_buddy = g_list_find(buddylist, roster_alternate_buddy);
-  if (roster_last_activity_buddy)
-    last_activity_buddy = g_list_find(buddylist, roster_last_activity_buddy);
+  current_buddy = buddylist_find(roster_current_buddy);
+  alternate_buddy = buddylist_find(roster_alternate_buddy);
+  last_activity_buddy = buddylist_find(roster_last_activity_buddy);
   // current_buddy initialization
-  if (!current_buddy || (g_list_position(buddylist, current_buddy) == -1))
-    current_buddy = g_list_first(buddylist);
+  if (!current_buddy)
+    current_buddy = buddylist;
 }
 
 //  buddy_hide_group(roster, hide)
@@ -1079,22 +1548,29 @@ void buddy_setgroup(gpointer rosterdata, char *newgroupname)
   my_newgroup = (roster*)sl_newgroup->data;
 
   // Remove the buddy from current group
+  if (roster_usr->flags & ROSTER_FLAG_MSG)
+    group_unread_update(roster_usr, -1);
   sl_group = &((roster*)((GSList*)roster_usr->list)->data)->list;
   *sl_group = g_slist_remove(*sl_group, rosterdata);
+  roster_index_del_user(roster_usr);
 
   // Remove old group if it is empty
   if (!*sl_group) {
     roster *roster_grp = (roster*)((GSList*)roster_usr->list)->data;
+    roster_index_del_group(roster_grp);
     g_free((gchar*)roster_grp->jid);
     g_free((gchar*)roster_grp->name);
+    g_free(roster_grp->search_jid);
+    g_free(roster_grp->search_name);
     g_free(roster_grp);
     groups = g_slist_remove(groups, roster_grp);
   }
 
   // Add the buddy to its new group
   roster_usr->list = sl_newgroup;    // (my_newgroup SList element)
-  my_newgroup->list = g_slist_insert_sorted(my_newgroup->list, roster_usr,
-                                            (GCompareFunc)&roster_compare_name);
+  roster_index_add_user(group_insert_user(my_newgroup, roster_usr));
+  if (roster_usr->flags & ROSTER_FLAG_MSG)
+    group_unread_update(roster_usr, 1);
 
   buddylist_build();
 }
@@ -1116,6 +1592,16 @@ void buddy_setname(gpointer rosterdata, char *newname)
   if (newname)
     roster_usr->name = g_strdup(newname);
 
+  // Update the search key
+  g_free(roster_usr->search_name);
+  roster_usr->search_name = NULL;
+  roster_search_keys(roster_usr);
+  fuzzy_reset();
+
+  // The group lists are sorted by roster_bulk_end()
+  if (roster_bulk)
+    return;
+
   // We need to resort the group list
   sl_group = &((roster*)((GSList*)roster_usr->list)->data)->list;
   *sl_group = g_slist_sort(*sl_group, (GCompareFunc)&roster_compare_name);
@@ -1261,7 +1747,15 @@ gpointer buddy_getgroup(gpointer rosterdata)
 void buddy_settype(gpointer rosterdata, guint type)
 {
   roster *roster_usr = rosterdata;
-  roster_usr->type = type;
+
+  // The unread counters depend on the type
+  if (roster_usr->unread_iter) {
+    unread_count(roster_usr, -1);
+    roster_usr->type = type;
+    unread_count(roster_usr, 1);
+  } else {
+    roster_usr->type = type;
+  }
 }
 
 guint buddy_gettype(gpointer rosterdata)
@@ -1330,6 +1824,19 @@ void buddy_resource_setevents(gpointer rosterdata, const char *resname,
     p_res->events = events;
 }
 
+//  buddy_getevents(roster_data)
+// Return the events of all the buddy's resources
+guint buddy_getevents(gpointer rosterdata)
+{
+  roster *roster_usr = rosterdata;
+  GSList *lp;
+  guint events = ROSTER_EVENT_NONE;
+
+  for (lp = roster_usr->resource; lp; lp = g_slist_next(lp))
+    events |= ((res*)lp->data)->events;
+  return events;
+}
+
 char *buddy_resource_getcaps(gpointer rosterdata, const char *resname)
 {
   roster *roster_usr = rosterdata;
@@ -1506,6 +2013,7 @@ void buddy_del_all_resources(gpointer rosterdata)
     res *r = roster_usr->resource->data;
     del_resource(roster_usr, r->name);
   }
+  group_status_update(roster_usr);
 }
 
 //  buddy_setflags()
@@ -1531,6 +2039,15 @@ guint buddy_getuiprio(gpointer rosterdata)
   return roster_usr->ui_prio;
 }
 
+//  buddy_getgroupcount(rosterdata)
+// Return the number of members of the group whose status passes the
+// display filter.  The counter is maintained by the buddylist functions.
+guint buddy_getgroupcount(gpointer rosterdata)
+{
+  roster *roster_grp = rosterdata;
+  return roster_grp->bl_status_members;
+}
+
 //  buddy_setonserverflag()
 // Set the on_server flag
 void buddy_setonserverflag(gpointer rosterdata, guint onserver)
@@ -1551,17 +2068,27 @@ guint buddy_getonserverflag(gpointer rosterdata)
 // return NULL;
 GList *buddy_search_jid(const char *jid)
 {
-  GList *buddy;
-  roster *roster_usr;
+  GSList *sl_user;
 
   if (!buddylist) return NULL;
 
-  for (buddy = buddylist; buddy; buddy = g_list_next(buddy)) {
-    roster_usr = (roster*)buddy->data;
-    if (roster_usr->jid && !strcasecmp(roster_usr->jid, jid))
-      return buddy;
-  }
-  return NULL;
+  sl_user = roster_find(jid, jidsearch, 0);
+  if (!sl_user)
+    return NULL;
+  return buddylist_find(sl_user->data);
+}
+
+//  search_query(string)
+// Returns the case-folded version of the string (in the locale charset),
+// to be compared with the search keys.  The result must be freed.
+static gchar *search_query(const char *string)
+{
+  gchar *str_utf8, *query;
+
+  str_utf8 = to_utf8(string);
+  query = search_fold(str_utf8);
+  g_free(str_utf8);
+  return query;
 }
 
 //  buddy_search(string)
@@ -1572,37 +2099,174 @@ GList *buddy_search(char *string)
 {
   GList *buddy = current_buddy;
   roster *roster_usr;
+  gchar *query;
+
   if (!buddylist || !current_buddy) return NULL;
-  for (;;) {
-    gchar *jid_locale, *name_locale;
-    char *found = NULL;
 
+  query = search_query(string);
+  for (;;) {
     buddy = g_list_next(buddy);
     if (!buddy)
       buddy = buddylist;
 
     roster_usr = (roster*)buddy->data;
+    roster_search_keys(roster_usr);
 
-    jid_locale = from_utf8(roster_usr->jid);
-    if (jid_locale) {
-      found = strcasestr(jid_locale, string);
-      g_free(jid_locale);
-      if (found)
-        return buddy;
+    if ((roster_usr->jid && strstr(roster_usr->search_jid, query)) ||
+        strstr(roster_usr->search_name, query))
+      break;
+
+    if (buddy == current_buddy) {
+      buddy = NULL; // Back to the beginning, and no match found
+      break;
     }
-    name_locale = from_utf8(roster_usr->name);
-    if (name_locale) {
-      found = strcasestr(name_locale, string);
-      g_free(name_locale);
-      if (found)
-        return buddy;
+  }
+  g_free(query);
+  return buddy;
+}
+
+//  fuzzy_score(key, query)
+// Returns a positive score if the characters of query appear in key in
+// the same order, 0 otherwise.  Substrings are better than subsequences,
+// and matches at the beginning of a word or of the key are preferred.
+static guint fuzzy_score(const gchar *key, const gchar *query)
+{
+  const gchar *p, *q;
+  gunichar prev = 0;
+  guint score = 0, run = 0;
+
+  if (!*query)
+    return 0;
+
+  p = strstr(key, query);
+  if (p) {
+    score = FUZZY_SUBSTRING;
+    if (p == key)
+      score += FUZZY_PREFIX;
+    else if (!g_unichar_isalnum(g_utf8_get_char(g_utf8_prev_char(p))))
+      score += FUZZY_WORD_START;
+    return score;
+  }
+
+  // Subsequence: every character of the query must be found, in order
+  for (p = key, q = query; *q; q = g_utf8_next_char(q)) {
+    gunichar qc = g_utf8_get_char(q);
+    gboolean found = FALSE;
+
+    for ( ; *p && !found; p = g_utf8_next_char(p)) {
+      gunichar kc = g_utf8_get_char(p);
+      if (kc == qc) {
+        found = TRUE;
+        score += 1 + run;   // Consecutive characters are worth more
+        if (!prev || !g_unichar_isalnum(prev))
+          score += 2;
+        run++;
+      } else {
+        run = 0;
+      }
+      prev = kc;
     }
+    if (!found)
+      return 0;
+  }
+  return MIN(score, FUZZY_SUBSTRING - 1);
+}
 
-    if (buddy == current_buddy)
-      return NULL; // Back to the beginning, and no match found
+struct fuzzy_match {
+  roster *roster_usr;
+  guint score;
+};
+
+static gint fuzzy_compare(gconstpointer a, gconstpointer b)
+{
+  const struct fuzzy_match *ma = a, *mb = b;
+  gsize la, lb;
+
+  if (ma->score != mb->score)
+    return ma->score > mb->score ? -1 : 1;
+  // Shorter names first
+  la = strlen(ma->roster_usr->search_name);
+  lb = strlen(mb->roster_usr->search_name);
+  if (la != lb)
+    return la < lb ? -1 : 1;
+  return strcmp(ma->roster_usr->search_name, mb->roster_usr->search_name);
+}
+
+static void fuzzy_add_candidate(GArray *results, roster *roster_usr,
+                                const gchar *query)
+{
+  struct fuzzy_match match;
+  guint jscore;
+
+  roster_search_keys(roster_usr);
+  match.score = fuzzy_score(roster_usr->search_name, query);
+  jscore = fuzzy_score(roster_usr->search_jid, query);
+  if (jscore > match.score)
+    match.score = jscore;
+  if (match.score) {
+    match.roster_usr = roster_usr;
+    g_array_append_val(results, match);
   }
 }
 
+//  buddy_fuzzy_search(string)
+// Look for the buddy whose name or jid best matches string, the characters
+// of string may be separated by other characters.  Repeating the same
+// search selects the next match.  When the previous query is extended
+// (e.g. while the user types), only the previous matches are checked.
+// Only items of the displayed buddylist are returned; NULL is returned
+// if there is no match.
+GList *buddy_fuzzy_search(char *string)
+{
+  GArray *results;
+  GList *buddy;
+  gchar *query;
+  guint i;
+
+  if (!buddylist) return NULL;
+
+  query = search_query(string);
+
+  if (!fuzzy.query || !fuzzy.matches || strcmp(query, fuzzy.query)) {
+    results = g_array_new(FALSE, FALSE, sizeof(struct fuzzy_match));
+    if (fuzzy.query && fuzzy.matches &&
+        g_str_has_prefix(query, fuzzy.query)) {
+      // Narrow the previous candidates
+      for (i = 0; i < fuzzy.matches->len; i++)
+        fuzzy_add_candidate(results, g_ptr_array_index(fuzzy.matches, i),
+                            query);
+    } else {
+      GSList *sl_grp, *sl_usr;
+      for (sl_grp = groups; sl_grp; sl_grp = g_slist_next(sl_grp))
+        for (sl_usr = ((roster*)sl_grp->data)->list; sl_usr;
+             sl_usr = g_slist_next(sl_usr))
+          fuzzy_add_candidate(results, sl_usr->data, query);
+    }
+    g_array_sort(results, fuzzy_compare);
+
+    fuzzy_reset();
+    fuzzy.query = query;
+    fuzzy.matches = g_ptr_array_sized_new(results->len);
+    for (i = 0; i < results->len; i++)
+      g_ptr_array_add(fuzzy.matches,
+                      g_array_index(results, struct fuzzy_match, i).roster_usr);
+    g_array_free(results, TRUE);
+    // Start with the best match
+    fuzzy.index = fuzzy.matches->len ? fuzzy.matches->len - 1 : 0;
+  } else {
+    g_free(query);
+  }
+
+  // Select the next match which is in the buddylist
+  for (i = 0; i < fuzzy.matches->len; i++) {
+    fuzzy.index = (fuzzy.index + 1) % fuzzy.matches->len;
+    buddy = buddylist_find(g_ptr_array_index(fuzzy.matches, fuzzy.index));
+    if (buddy)
+      return buddy;
+  }
+  return NULL;
+}
+
 //  foreach_buddy(roster_type, pfunction, param)
 // Call pfunction(buddy, param) for each buddy from the roster with
 // type matching roster_type.
@@ -1701,25 +2365,47 @@ GSList *compl_list(guint type)
 // return the first buddy with an unread message.
 gpointer unread_msg(gpointer rosterdata)
 {
-  GSList *unread, *next_unread;
+  GSequenceIter *first, *next;
+  roster *roster_usr = rosterdata;
 
-  if (!unread_list)
+  if (!unread_set)
     return NULL;
 
-  // First unread message
-  if (!rosterdata)
-    return unread_list->data;
+  first = g_sequence_get_begin_iter(unread_set);
+  if (g_sequence_iter_is_end(first))
+    return NULL;
 
-  unread = g_slist_find(unread_list, rosterdata);
-  if (!unread)
-    return unread_list->data;
+  // First unread message
+  if (!roster_usr || !roster_usr->unread_iter)
+    return g_sequence_get(first);
 
-  next_unread = g_slist_next(unread);
-  if (next_unread)
-    return next_unread->data;
-  return unread_list->data;
+  next = g_sequence_iter_next(roster_usr->unread_iter);
+  if (!g_sequence_iter_is_end(next))
+    return g_sequence_get(next);
+  return g_sequence_get(first);
 }
 
+//  unread_msg_get_jid_list()
+// Return the JIDs of the users and agents with unread messages.
+// The content of the list should not be modified or freed.
+// The caller should call g_list_free() after use.
+GList *unread_msg_get_jid_list(void)
+{
+  GList *list = NULL;
+  GSequenceIter *iter;
+
+  if (!unread_set)
+    return NULL;
+
+  iter = g_sequence_get_begin_iter(unread_set);
+  for ( ; !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter)) {
+    roster *roster_usr = g_sequence_get(iter);
+    if ((roster_usr->type & (ROSTER_TYPE_USER|ROSTER_TYPE_AGENT)) &&
+        roster_usr->jid)
+      list = g_list_prepend(list, (gpointer)roster_usr->jid);
+  }
+  return g_list_reverse(list);
+}
 
 /* ### "unread_jids" functions ###
  *
@@ -170,6 +170,8 @@ GSList *roster_add_user(const char *jid, const char *name, const char *group,
 GSList *roster_find(const char *jidname, enum findwhat type, guint roster_type);
 void    roster_del_user(const char *jid);
 void    roster_free(void);
+void    roster_bulk_begin(void);
+void    roster_bulk_end(void);
 void    roster_setstatus(const char *jid, const char *resname, gchar prio,
                          enum imstatus bstat, const char *status_msg,
                          time_t timestamp,
@@ -191,6 +193,8 @@ guint   roster_getsubscription(const char *jid);
 void    roster_unsubscribed(const char *jid);
 
 void    buddylist_build(void);
+void    buddylist_update_buddy(gpointer rosterdata);
+GList  *buddylist_find(gpointer rosterdata);
 void    buddy_hide_group(gpointer rosterdata, int hide);
 void    buddylist_set_hide_offline_buddies(int hide);
 int     buddylist_isset_filter(void);
@@ -232,6 +236,7 @@ void    buddy_resource_setname(gpointer rosterdata, const char *resname,
 void    buddy_resource_setevents(gpointer rosterdata, const char *resname,
                                  guint event);
 guint   buddy_resource_getevents(gpointer rosterdata, const char *resname);
+guint   buddy_getevents(gpointer rosterdata);
 void    buddy_resource_setcaps(gpointer rosterdata, const char *resname,
                                const char *caps);
 char   *buddy_resource_getcaps(gpointer rosterdata, const char *resname);
@@ -244,10 +249,12 @@ void    buddy_del_all_resources(gpointer rosterdata);
 void    buddy_setflags(gpointer rosterdata, guint flags, guint value);
 guint   buddy_getflags(gpointer rosterdata);
 guint   buddy_getuiprio(gpointer rosterdata);
+guint   buddy_getgroupcount(gpointer rosterdata);
 void    buddy_setonserverflag(gpointer rosterdata, guint onserver);
 guint   buddy_getonserverflag(gpointer rosterdata);
 GList  *buddy_search_jid(const char *jid);
 GList  *buddy_search(char *string);
+GList  *buddy_fuzzy_search(char *string);
 void    foreach_buddy(guint roster_type,
                       void (*pfunc)(gpointer rosterdata, void *param),
                       void *param);
@@ -255,6 +262,7 @@ void    foreach_group_member(gpointer groupdata,
                              void (*pfunc)(gpointer rosterdata, void *param),
                              void *param);
 gpointer unread_msg(gpointer rosterdata);
+GList  *unread_msg_get_jid_list(void);
 
 void   unread_jid_add(const char *jid);
 GList *unread_jid_get_list(void);
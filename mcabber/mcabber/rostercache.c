@@ -0,0 +1,339 @@
+/*
+ * rostercache.c -- Local roster cache (roster versioning)
+ *
+ * Copyright (C) 2005-2010 Mikael Berthe <mikael@lilotux.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* The roster received from the server is saved to the file given by the
+ * "roster_cache" option, with the roster version string (XEP-0237).
+ * The cached roster is loaded before the roster is requested, and the
+ * version is sent with the request so that the server only sends the
+ * changes since this version.
+ *
+ * File format:
+ *   J <account bare jid>
+ *   V <roster version>               (optional)
+ *   I <subscription> <jid>\t<name>\t<group>
+ * The name and group strings are escaped with g_strescape().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "rostercache.h"
+#include "roster.h"
+#include "settings.h"
+#include "utils.h"
+#include "logprint.h"
+
+#define ROSTER_CACHE_DELAY  5 // Delay before the cache file is saved (s)
+
+static char *roster_version;  // Version of the cached roster, or NULL
+static gboolean cache_valid;  // The roster has been received from the server
+static guint cache_source;    // Pending save timeout source
+
+//  cache_filename()
+// Returns the expanded cache filename (to be freed), or NULL if the
+// cache is disabled.
+static char *cache_filename(void)
+{
+  const char *cachefile = settings_opt_get("roster_cache");
+
+  if (!cachefile || !*cachefile)
+    return NULL;
+  return expand_filename(cachefile);
+}
+
+//  cache_account_jid()
+// Returns the bare jid of the account (to be freed), or NULL.
+static char *cache_account_jid(void)
+{
+  const char *jid = settings_opt_get("jid");
+
+  if (!jid)
+    return NULL;
+  return jidtodisp(jid);
+}
+
+//  cache_escape(str)
+// Escape a name or a group for the cache file.  The UTF-8 characters
+// are kept, only the control characters and backslashes are escaped.
+static char *cache_escape(const char *str)
+{
+  static char exceptions[129];
+
+  if (!exceptions[0]) {
+    int i;
+    for (i = 0; i < 128; i++)
+      exceptions[i] = (char)(128 + i);
+    exceptions[128] = 0;
+  }
+  return g_strescape(str ? str : "", exceptions);
+}
+
+static void cache_write_item(gpointer rosterdata, void *param)
+{
+  FILE *fp = param;
+  const char *jid = buddy_getjid(rosterdata);
+  char *name, *group;
+
+  // Only the items received from the server are cached
+  if (!jid || !buddy_getonserverflag(rosterdata))
+    return;
+
+  name = cache_escape(buddy_getname(rosterdata));
+  group = cache_escape(buddy_getgroupname(rosterdata));
+  fprintf(fp, "I %u %s\t%s\t%s\n", buddy_getsubscription(rosterdata),
+          jid, name, group);
+  g_free(name);
+  g_free(group);
+}
+
+//  roster_cache_save()
+// Save the roster and its version to the cache file.
+// The file is written atomically (a new file is renamed).
+void roster_cache_save(void)
+{
+  char *cachefile, *tmpfile, *ajid;
+  FILE *fp;
+  int fd;
+
+  if (cache_source) {
+    g_source_remove(cache_source);
+    cache_source = 0;
+  }
+
+  // Do not overwrite the cache with an incomplete roster
+  if (!cache_valid)
+    return;
+
+  cachefile = cache_filename();
+  if (!cachefile)
+    return;
+
+  ajid = cache_account_jid();
+  tmpfile = g_strdup_printf("%s.tmp", cachefile);
+  // The cache lists all the contacts, so it is only readable by the user.
+  // A leftover temporary file is removed so that its mode isn't kept.
+  unlink(tmpfile);
+  fd = open(tmpfile, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+  fp = (fd == -1) ? NULL : fdopen(fd, "w");
+  if (!fp) {
+    if (fd != -1) {
+      int err = errno;
+      close(fd);
+      errno = err;
+    }
+    scr_LogPrint(LPRINT_LOGNORM, "Cannot open roster cache file [%s]",
+                 strerror(errno));
+  } else {
+    fprintf(fp, "J %s\n", ajid ? ajid : "");
+    if (roster_version)
+      fprintf(fp, "V %s\n", roster_version);
+    foreach_buddy(ROSTER_TYPE_USER|ROSTER_TYPE_AGENT|ROSTER_TYPE_ROOM,
+                  &cache_write_item, fp);
+    if (fclose(fp) || rename(tmpfile, cachefile)) {
+      scr_LogPrint(LPRINT_LOGNORM, "Cannot write roster cache file [%s]",
+                   strerror(errno));
+      unlink(tmpfile);
+    }
+  }
+  g_free(ajid);
+  g_free(tmpfile);
+  g_free(cachefile);
+}
+
+static gboolean roster_cache_timeout_callback(gpointer data)
+{
+  // source will be destroyed after return
+  cache_source = 0;
+  roster_cache_save();
+  return FALSE;
+}
+
+//  roster_cache_save_later()
+// Save the cache file a bit later, so that several roster pushes are
+// saved at once.
+void roster_cache_save_later(void)
+{
+  if (cache_source || !cache_valid || !settings_opt_get("roster_cache"))
+    return;
+  cache_source = g_timeout_add_seconds(ROSTER_CACHE_DELAY,
+                                       roster_cache_timeout_callback, NULL);
+}
+
+//  cache_read_line(channel, line)
+// Read a line from the cache file, without the trailing newline.
+// Note: the other trailing spaces belong to the name or the group.
+static gboolean cache_read_line(GIOChannel *channel, GString *line)
+{
+  if (g_io_channel_read_line_string(channel, line, NULL, NULL) !=
+      G_IO_STATUS_NORMAL)
+    return FALSE;
+  while (line->len && (line->str[line->len-1] == '\n' ||
+                       line->str[line->len-1] == '\r'))
+    g_string_truncate(line, line->len-1);
+  return TRUE;
+}
+
+//  cache_parse_item(line)
+// Add the cached item described by line to the roster.
+// Returns FALSE if the line is invalid.
+static gboolean cache_parse_item(char *line)
+{
+  char *jid, *name, *group, *p;
+  guint type;
+  long sub;
+
+  sub = strtol(line, &p, 10);
+  if (p == line || *p != ' ' || sub < 0)
+    return FALSE;
+  jid = p + 1;
+  name = strchr(jid, '\t');
+  if (!name)
+    return FALSE;
+  *name++ = 0;
+  group = strchr(name, '\t');
+  if (!group)
+    return FALSE;
+  *group++ = 0;
+  if (check_jid_syntax(jid))
+    return FALSE;
+
+  name = g_strcompress(name);
+  group = g_strcompress(group);
+  // See handle_iq_roster()
+  if (strchr(jid, JID_DOMAIN_SEPARATOR))
+    type = ROSTER_TYPE_USER;
+  else
+    type = ROSTER_TYPE_AGENT;
+  roster_add_user(jid, *name ? name : NULL, *group ? group : NULL, type,
+                  (enum subscr)sub, 1);
+  g_free(name);
+  g_free(group);
+  return TRUE;
+}
+
+//  roster_cache_load()
+// Load the cached roster (if enabled), before the roster is requested.
+// The cached version will be sent with the request.
+void roster_cache_load(void)
+{
+  char *cachefile, *ajid;
+  GIOChannel *channel;
+  GString *line;
+  gboolean ok = TRUE;
+  guint count = 0;
+
+  g_free(roster_version);
+  roster_version = NULL;
+  cache_valid = FALSE;
+
+  cachefile = cache_filename();
+  if (!cachefile)
+    return;
+
+  channel = g_io_channel_new_file(cachefile, "r", NULL);
+  g_free(cachefile);
+  if (!channel)
+    return;
+  // Read raw bytes, without charset conversion
+  g_io_channel_set_encoding(channel, NULL, NULL);
+
+  ajid = cache_account_jid();
+  line = g_string_new(NULL);
+  roster_bulk_begin();
+
+  // The first line must match the account
+  if (!ajid || !cache_read_line(channel, line))
+    ok = FALSE;
+  else
+    ok = !strncmp(line->str, "J ", 2) && !strcasecmp(line->str + 2, ajid);
+
+  while (ok && cache_read_line(channel, line)) {
+    if (!strncmp(line->str, "V ", 2) && !roster_version) {
+      roster_version = g_strdup(line->str + 2);
+    } else if (!strncmp(line->str, "I ", 2) &&
+               cache_parse_item(line->str + 2)) {
+      count++;
+    } else {
+      scr_LogPrint(LPRINT_LOGNORM,
+                   "Invalid roster cache file, ignoring the version.");
+      g_free(roster_version);
+      roster_version = NULL;
+      break;
+    }
+  }
+
+  roster_bulk_end();
+  g_string_free(line, TRUE);
+  g_io_channel_unref(channel);
+  g_free(ajid);
+
+  if (count)
+    scr_LogPrint(LPRINT_LOGNORM, "Loaded %u roster items from the cache.",
+                 count);
+}
+
+//  roster_cache_get_version()
+// Returns the version of the cached roster, or NULL if there is none.
+const char *roster_cache_get_version(void)
+{
+  return roster_version;
+}
+
+//  roster_cache_received(ver)
+// Called when the roster result has been handled.  ver is the roster
+// version sent by the server (NULL if the server doesn't support roster
+// versioning).
+void roster_cache_received(const char *ver)
+{
+  if (ver != roster_version) {
+    g_free(roster_version);
+    roster_version = (ver && *ver) ? g_strdup(ver) : NULL;
+  }
+  cache_valid = TRUE;
+  roster_cache_save_later();
+}
+
+//  roster_cache_push(ver)
+// Called when a roster push has been handled.
+void roster_cache_push(const char *ver)
+{
+  if (ver && *ver) {
+    g_free(roster_version);
+    roster_version = g_strdup(ver);
+  }
+  roster_cache_save_later();
+}
+
+//  roster_cache_close()
+// Save the pending changes before the roster is freed.
+void roster_cache_close(void)
+{
+  if (cache_source)
+    roster_cache_save();
+  cache_valid = FALSE;
+}
+
+/* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
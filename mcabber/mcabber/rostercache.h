@@ -0,0 +1,16 @@
+#ifndef __MCABBER_ROSTERCACHE_H__
+#define __MCABBER_ROSTERCACHE_H__ 1
+
+#include <glib.h>
+
+void roster_cache_load(void);
+void roster_cache_save(void);
+void roster_cache_save_later(void);
+void roster_cache_close(void);
+void roster_cache_received(const char *ver);
+void roster_cache_push(const char *ver);
+const char *roster_cache_get_version(void);
+
+#endif /* __MCABBER_ROSTERCACHE_H__ */
+
+/* vim: set expandtab cindent cinoptions=>2\:2(0 sw=2 ts=2:  For Vim users... */
@@ -29,6 +29,7 @@
 #include <config.h>
 #include <locale.h>
 #include <assert.h>
+#include <unistd.h>
 #ifdef USE_SIGWINCH
 # include <sys/ioctl.h>
 # include <termios.h>
@@ -99,11 +100,25 @@ static void spellcheck(char *, char *);
 
 static GHashTable *winbufhash;
 
+// History being loaded into a buffer
+typedef struct {
+  hlog_reader *reader;
+  GList  *hbuf;      // History lines read so far
+  int     wrapwidth; // Width used to wrap them
+  char    readmark;  // Set a readmark after the history
+} histload;
+
 typedef struct {
   GList  *hbuf;
   GList  *top;     // If top is NULL, we'll display the last lines
   char    cleared; // For ex, user has issued a /clear command...
   char    lock;
+  int     wrapwidth; // Width used to wrap the lines of the buffer
+  time_t  lastview;  // Last time the buffer was displayed
+  char   *spillfile; // File containing the messages of a spilled buffer
+  histload *histload; // History being loaded (NULL when done)
+  time_t  histstart; // There is no history on disk before this date
+  char    rewrapping; // The lines are being wrapped by the rewrap pool
 } buffdata;
 
 typedef struct {
@@ -123,7 +138,6 @@ static PANEL *rosterPanel, *chatPanel, *activechatPanel, *inputPanel;
 static PANEL *mainstatusPanel, *chatstatusPanel;
 static PANEL *logPanel;
 static int maxY, maxX;
-static int prev_chatwidth;
 static winbuf *statusWindow;
 static winbuf *currentWindow;
 static GList  *statushbuf;
@@ -138,6 +152,42 @@ static bool Curses;
 static bool log_win_on_top;
 static bool roster_win_on_right;
 static guint autoaway_source = 0;
+static guint rewrap_source = 0;
+
+// Buffers are rewrapped in the background by a thread pool: the text of
+// the lines is copied by hbuf_wrap_prepare(), the breaks are computed by a
+// worker thread, and the lines are split from the main loop.
+#define REWRAP_MAX_THREADS 8
+static GThreadPool *rewrap_pool;
+static guint rewrap_jobs;       // Buffers being wrapped by the pool
+static guint rewrap_max_jobs;   // (Each job holds a copy of its buffer)
+
+typedef struct {
+  buffdata *bd;
+  int width;
+  hbuf_wrap_job *wrap;
+} rewrap_job;
+
+// Memory budget for all the buffers (max_buffers_memory), in bytes
+static gsize buffers_memory_limit;
+// Memory used after the last buffers shrink, if it was above the limit
+static gsize buffers_memory_floor;
+
+// Idle buffers are written to disk after buffers_spill_delay minutes
+static guint buffers_spill_delay;
+static guint spill_source = 0;
+static char *spill_dir;
+static guint spill_count;
+
+// Buffers whose history is being loaded from file
+static GSList *histload_queue;
+static guint histload_source = 0;
+// Number of history records read per main loop iteration
+#define HISTLOAD_RECORDS 200
+// Size of the older history pages read when scrolling up (hbuf blocks)
+#define HISTPAGE_BLOCKS  8
+// Buffer waiting for a history page (compressed segment being read)
+static buffdata *histpage_pending;
 
 static char       inputLine[INPUTLINE_LENGTH+1];
 #if defined(WITH_ENCHANT) || defined(WITH_ASPELL)
@@ -214,6 +264,26 @@ typedef struct {
 
 static GSList *rostercolrules = NULL;
 
+// Cache of the roster coloring rules results, per jid
+typedef struct {
+  char status;
+  int color;
+} rostercolcache;
+
+static GHashTable *rostercolcachehash = NULL;
+
+// Roster window rows, as displayed by scr_draw_roster()
+typedef struct {
+  char *text;
+  int attr;
+  gboolean selected;
+} rosterrow;
+
+static rosterrow *roster_rows = NULL;
+static int roster_rows_count, roster_rows_width;
+static bool roster_rows_right;
+static WINDOW *roster_rows_win;
+
 static GHashTable *muccolors = NULL, *nickcolors = NULL;
 
 typedef struct {
@@ -373,10 +443,17 @@ static void free_rostercolrule(rostercolor *col)
   g_free(col);
 }
 
+static inline void roster_color_cache_clear(void)
+{
+  if (rostercolcachehash)
+    g_hash_table_remove_all(rostercolcachehash);
+}
+
 // Removes all roster coloring rules
 void scr_roster_clear_color(void)
 {
   GSList *head;
+  roster_color_cache_clear();
   for (head = rostercolrules; head; head = g_slist_next(head)) {
     free_rostercolrule(head->data);
   }
@@ -396,6 +473,7 @@ bool scr_roster_color(const char *status, const char *wildcard,
 {
   GSList *head;
   GSList *found = NULL;
+  roster_color_cache_clear();
   for (head = rostercolrules; head; head = g_slist_next(head)) {
     rostercolor *rc = head->data;
     if ((!strcmp(status, rc->status)) && (!strcmp(wildcard, rc->wildcard))) {
@@ -841,8 +919,33 @@ void scr_init_curses(void)
   return;
 }
 
+static void scr_buffer_drop_spill(buffdata *bd);
+
+static void drop_spilled_buffer(gpointer key, gpointer value, gpointer data)
+{
+  winbuf *win_entry = value;
+  scr_buffer_drop_spill(win_entry->bd);
+}
+
+static void scr_buffer_end_history_load(buffdata *bd, gboolean keep);
+
 void scr_terminate_curses(void)
 {
+  while (histload_queue)
+    scr_buffer_end_history_load(histload_queue->data, FALSE);
+  // Wait for the rewrap jobs (their results are dropped)
+  if (rewrap_pool) {
+    g_thread_pool_free(rewrap_pool, TRUE, TRUE);
+    rewrap_pool = NULL;
+  }
+  // Remove the files of the buffers written to disk
+  if (spill_dir) {
+    if (winbufhash)
+      g_hash_table_foreach(winbufhash, drop_spilled_buffer, NULL);
+    rmdir(spill_dir);
+    g_free(spill_dir);
+    spill_dir = NULL;
+  }
   if (!Curses) return;
   clear();
   refresh();
@@ -986,7 +1089,7 @@ void scr_log_print(unsigned int flag, const char *fmt, ...)
       printf("%s\n", buffer_locale);
       // ncurses are not initialized yet, so we call directly hbuf routine
       hbuf_add_line(&statushbuf, buf_specialwindow, timestamp,
-        HBB_PREFIX_SPECIAL, 0, 0, 0, NULL);
+        HBB_PREFIX_SPECIAL, 0, get_max_history_blocks(), 0, NULL);
     }
 
     g_free(convbuf1);
@@ -1033,6 +1136,326 @@ int scr_buddy_buffer_exists(const char *bjid)
   return (scr_search_window(bjid, FALSE) != NULL);
 }
 
+static void collect_buffdata(gpointer key, gpointer value, gpointer data)
+{
+  winbuf *win_entry = value;
+  g_hash_table_insert(data, win_entry->bd, win_entry->bd);
+}
+
+static void add_buffdata(gpointer key, gpointer value, gpointer data)
+{
+  g_ptr_array_add(data, value);
+}
+
+static gint buffdata_cmp_lastview(gconstpointer a, gconstpointer b)
+{
+  const buffdata *bda = *(buffdata * const *)a;
+  const buffdata *bdb = *(buffdata * const *)b;
+
+  if (bda->lastview < bdb->lastview)
+    return -1;
+  return bda->lastview > bdb->lastview;
+}
+
+//  scr_shrink_buffers()
+// Free the oldest lines of the least recently viewed buffers until the
+// memory used by all the buffers fits in max_buffers_memory.
+// The buffer on screen and the locked or scrolled buffers are left alone.
+static void scr_shrink_buffers(void)
+{
+  GHashTable *bdset;
+  GPtrArray *bdlist;
+  buffdata *current_bd = currentWindow ? currentWindow->bd : NULL;
+  gsize total;
+  guint i;
+
+  bdset = g_hash_table_new(g_direct_hash, g_direct_equal);
+  if (statusWindow)
+    g_hash_table_insert(bdset, statusWindow->bd, statusWindow->bd);
+  if (winbufhash)
+    g_hash_table_foreach(winbufhash, collect_buffdata, bdset);
+  bdlist = g_ptr_array_sized_new(g_hash_table_size(bdset));
+  g_hash_table_foreach(bdset, add_buffdata, bdlist);
+  g_hash_table_destroy(bdset);
+  g_ptr_array_sort(bdlist, buffdata_cmp_lastview);
+
+  total = hbuf_get_total_memory_usage();
+  for (i = 0; i < bdlist->len && total > buffers_memory_limit; i++) {
+    buffdata *bd = g_ptr_array_index(bdlist, i);
+    gsize usage, excess;
+
+    if (bd == current_bd || bd->lock || bd->top || !bd->hbuf)
+      continue;
+
+    excess = total - buffers_memory_limit;
+    usage = hbuf_get_memory_usage(bd->hbuf);
+    hbuf_shrink(&bd->hbuf, usage > excess ? usage - excess : 0);
+    if (statusWindow && bd == statusWindow->bd)
+      statushbuf = bd->hbuf;
+    total = hbuf_get_total_memory_usage();
+  }
+  g_ptr_array_free(bdlist, TRUE);
+
+  // If we could not get under the limit (the last block of each buffer
+  // is kept), do not try again before the buffers have grown.
+  buffers_memory_floor = (total > buffers_memory_limit ? total : 0);
+}
+
+//  scr_check_buffers_memory()
+// Shrink the buffers if they use more memory than allowed.
+static void scr_check_buffers_memory(void)
+{
+  gsize total;
+
+  if (!buffers_memory_limit)
+    return;
+  total = hbuf_get_total_memory_usage();
+  if (total > buffers_memory_limit &&
+      total > buffers_memory_floor + HBB_BLOCKSIZE)
+    scr_shrink_buffers();
+}
+
+//  scr_buffer_spill(bd)
+// Write the buffer messages to a file and free the buffer lines.
+// spill_dir must have been created.
+static void scr_buffer_spill(buffdata *bd)
+{
+  char *filename;
+
+  if (!bd->hbuf || bd->spillfile)
+    return;
+
+  filename = g_strdup_printf("%s/buffer-%u", spill_dir, ++spill_count);
+  if (!hbuf_save_messages(bd->hbuf, filename)) {
+    unlink(filename);
+    g_free(filename);
+    return;
+  }
+  hbuf_free(&bd->hbuf);
+  bd->spillfile = filename;
+}
+
+//  scr_buffer_drop_spill(bd)
+// Remove the file of a spilled buffer.
+static void scr_buffer_drop_spill(buffdata *bd)
+{
+  if (!bd->spillfile)
+    return;
+  unlink(bd->spillfile);
+  g_free(bd->spillfile);
+  bd->spillfile = NULL;
+}
+
+//  scr_buffer_unspill(bd)
+// Restore the messages of a spilled buffer.
+static void scr_buffer_unspill(buffdata *bd)
+{
+  if (!bd->spillfile)
+    return;
+
+  bd->wrapwidth = scr_gettextwidth();
+  if (!hbuf_load_messages(&bd->hbuf, bd->spillfile, bd->wrapwidth,
+                          get_max_history_blocks()))
+    scr_LogPrint(LPRINT_LOGNORM, "Error reading buffer file <%s>.",
+                 bd->spillfile);
+  scr_buffer_drop_spill(bd);
+}
+
+//  scr_spill_timeout_callback()
+// Write to disk the buffers which have not been displayed for
+// buffers_spill_delay minutes.
+static gboolean scr_spill_timeout_callback(gpointer data)
+{
+  GHashTable *bdset;
+  GPtrArray *bdlist;
+  buffdata *current_bd = currentWindow ? currentWindow->bd : NULL;
+  time_t limit = time(NULL) - buffers_spill_delay * 60;
+  guint i;
+
+  if (!winbufhash)
+    return TRUE;
+
+  if (!spill_dir) {
+    // The directory is private, mkdtemp() creates it with mode 0700
+    spill_dir = g_build_filename(g_get_tmp_dir(), "mcabber-XXXXXX", NULL);
+    if (!mkdtemp(spill_dir)) {
+      scr_LogPrint(LPRINT_LOGNORM, "Cannot create a directory for idle "
+                   "buffers, buffers will be kept in memory.");
+      g_free(spill_dir);
+      spill_dir = NULL;
+      // source will be destroyed after return
+      spill_source = 0;
+      return FALSE;
+    }
+  }
+
+  bdset = g_hash_table_new(g_direct_hash, g_direct_equal);
+  g_hash_table_foreach(winbufhash, collect_buffdata, bdset);
+  bdlist = g_ptr_array_sized_new(g_hash_table_size(bdset));
+  g_hash_table_foreach(bdset, add_buffdata, bdlist);
+  g_hash_table_destroy(bdset);
+
+  for (i = 0; i < bdlist->len; i++) {
+    buffdata *bd = g_ptr_array_index(bdlist, i);
+
+    if (bd == current_bd || bd->lock || bd->top || bd->cleared ||
+        bd->histload || bd->lastview > limit)
+      continue;
+    if (statusWindow && bd == statusWindow->bd)
+      continue;
+    scr_buffer_spill(bd);
+  }
+  g_ptr_array_free(bdlist, TRUE);
+  return TRUE;
+}
+
+//  scr_search_window_loaded(winId, special)
+// Same as scr_search_window(), but the buffer lines are restored if the
+// buffer has been written to disk.
+static winbuf *scr_search_window_loaded(const char *winId, int special)
+{
+  winbuf *win_entry = scr_search_window(winId, special);
+
+  if (win_entry)
+    scr_buffer_unspill(win_entry->bd);
+  return win_entry;
+}
+
+//  scr_buffer_end_history_load(bd, keep)
+// Stop loading the history of the buffer.  If keep is TRUE, the history
+// lines read so far are inserted before the buffer lines.
+static void scr_buffer_end_history_load(buffdata *bd, gboolean keep)
+{
+  histload *hl = bd->histload;
+
+  if (!hl)
+    return;
+
+  if (keep) {
+    if (hl->wrapwidth != bd->wrapwidth)
+      hbuf_rebuild(&hl->hbuf, bd->wrapwidth);
+    // Set a readmark to separate new content, unless the readmark has
+    // been changed meanwhile
+    if (hl->readmark)
+      hbuf_set_readmark(hl->hbuf, TRUE);
+    hbuf_prepend(&bd->hbuf, &hl->hbuf);
+  }
+  hbuf_free(&hl->hbuf);
+  hlog_reader_free(hl->reader);
+  g_free(hl);
+  bd->histload = NULL;
+  histload_queue = g_slist_remove(histload_queue, bd);
+}
+
+//  scr_histload_idle_callback()
+// Read some history records for one of the buffers being loaded.
+// The current buffer is loaded first.
+static gboolean scr_histload_idle_callback(gpointer data)
+{
+  buffdata *bd;
+  histload *hl;
+
+  if (!histload_queue) {
+    // source will be destroyed after return
+    histload_source = 0;
+    return FALSE;
+  }
+
+  if (currentWindow && currentWindow->bd->histload)
+    bd = currentWindow->bd;
+  else
+    bd = histload_queue->data;
+  hl = bd->histload;
+
+  // The buffer may have been rewrapped meanwhile
+  if (hl->wrapwidth != bd->wrapwidth) {
+    hbuf_rebuild(&hl->hbuf, bd->wrapwidth);
+    hl->wrapwidth = bd->wrapwidth;
+  }
+  if (hlog_reader_read(hl->reader, &hl->hbuf, hl->wrapwidth,
+                       HISTLOAD_RECORDS))
+    return TRUE;
+
+  scr_buffer_end_history_load(bd, TRUE);
+  scr_check_buffers_memory();
+  if (currentWindow && currentWindow->bd == bd) {
+    scr_update_buddy_window();
+    update_panels();
+  }
+  return TRUE;
+}
+
+//  scr_buffer_load_history(bd, bjid)
+// Load the buddy history from file (if enabled).
+// The history is read when the main loop is idle, and inserted before the
+// messages written to the buffer meanwhile.  (The history files are only
+// opened by the first hlog_reader_read() call.)
+static void scr_buffer_load_history(buffdata *bd, const char *bjid)
+{
+  hlog_reader *reader = hlog_reader_new(bjid);
+
+  if (!reader)
+    return;
+
+  bd->histload = g_new0(histload, 1);
+  bd->histload->reader = reader;
+  bd->histload->wrapwidth = bd->wrapwidth;
+  bd->histload->readmark = TRUE;
+  histload_queue = g_slist_append(histload_queue, bd);
+  if (!histload_source)
+    histload_source = g_idle_add(scr_histload_idle_callback, NULL);
+}
+
+//  scr_buffer_page_history(bd, bjid)
+// Read a page of older history records from file, and insert them before
+// the buffer lines.
+// Returns TRUE if lines have been added.
+static gboolean scr_buffer_page_history(buffdata *bd, const char *bjid)
+{
+  hlog_reader *reader;
+  GList *page = NULL;
+  time_t first;
+
+  if (bd->histload)
+    return FALSE;
+
+  // (The first lines may have been dropped since the last try)
+  first = hbuf_get_first_timestamp(bd->hbuf);
+  if (!first || first <= bd->histstart)
+    return FALSE;
+
+  reader = hlog_reader_new_before(bjid, first, HISTPAGE_BLOCKS);
+  if (reader) {
+    hlog_reader_read(reader, &page, bd->wrapwidth, 0);
+    if (hlog_reader_pending(reader))
+      histpage_pending = bd;
+    hlog_reader_free(reader);
+  }
+  if (histpage_pending == bd)
+    return FALSE; // See scr_history_page_ready()
+  if (!page) {
+    bd->histstart = first;
+    return FALSE;
+  }
+  hbuf_prepend(&bd->hbuf, &page);
+  scr_check_buffers_memory();
+  return TRUE;
+}
+
+//  scr_history_page_ready()
+// Called when the history page requested by scr_buffer_page_history()
+// can be read: scroll up again if the buffer is still displayed.
+void scr_history_page_ready(void)
+{
+  buffdata *bd = histpage_pending;
+
+  histpage_pending = NULL;
+  if (bd && currentWindow && currentWindow->bd == bd) {
+    scr_buffer_scroll_up_down(-1, 0);
+    scr_do_update();
+  }
+}
+
 //  scr_new_buddy(title, dontshow)
 // Note: title (aka winId/jid) can be NULL for special buffers
 static winbuf *scr_new_buddy(const char *title, int dont_show)
@@ -1066,11 +1489,9 @@ static winbuf *scr_new_buddy(const char *title, int dont_show)
       g_free(id);
     } else {  // Load buddy history from file (if enabled)
       tmp->bd = g_new0(buffdata, 1);
-      hlog_read_history(title, &tmp->bd->hbuf,
-                        maxX - Roster_Width - scr_getprefixwidth());
-
-      // Set a readmark to separate new content
-      hbuf_set_readmark(tmp->bd->hbuf, TRUE);
+      tmp->bd->wrapwidth = scr_gettextwidth();
+      tmp->bd->lastview = time(NULL);
+      scr_buffer_load_history(tmp->bd, title);
     }
 
     id = g_strdup(title);
@@ -1078,10 +1499,152 @@ static winbuf *scr_new_buddy(const char *title, int dont_show)
     g_hash_table_insert(winbufhash, id, tmp);
   } else {
     tmp->bd = g_new0(buffdata, 1);
+    tmp->bd->wrapwidth = scr_gettextwidth();
+    tmp->bd->lastview = time(NULL);
   }
+  scr_check_buffers_memory();
   return tmp;
 }
 
+static void scr_rewrap_buffer(winbuf *win_entry);
+
+static gboolean buffer_needs_rewrap(gpointer key, gpointer value,
+                                    gpointer data)
+{
+  winbuf *win_entry = value;
+  return win_entry->bd->wrapwidth != *(int*)data &&
+         !win_entry->bd->rewrapping;
+}
+
+static gboolean scr_rewrap_idle_callback(gpointer data);
+
+//  scr_rewrap_job_done(data)
+// Apply the breaks found by a worker to the buffer lines, unless the width
+// has changed or the buffer has been modified meanwhile (in which case the
+// buffer will be submitted again).
+static gboolean scr_rewrap_job_done(gpointer data)
+{
+  rewrap_job *job = data;
+  buffdata *bd = job->bd;
+  int width = scr_gettextwidth();
+
+  bd->rewrapping = FALSE;
+  if (bd->wrapwidth != width && job->width == width) {
+    GList *top = bd->top;
+    // If the top of the screen is on a non-persistent block, it would be
+    // destroyed by the rewrap.
+    bd->top = hbuf_previous_persistent(top);
+    if (hbuf_wrap_apply(&bd->hbuf, job->wrap))
+      bd->wrapwidth = width;
+    else
+      bd->top = top;
+  }
+  hbuf_wrap_job_free(job->wrap);
+  g_free(job);
+  rewrap_jobs--;
+
+  if (!rewrap_source)
+    rewrap_source = g_idle_add(scr_rewrap_idle_callback, NULL);
+  return FALSE;
+}
+
+//  scr_rewrap_worker(data, user_data)
+// Find the breaks of the lines of a buffer (called by a pool thread).
+static void scr_rewrap_worker(gpointer data, gpointer user_data)
+{
+  rewrap_job *job = data;
+
+  hbuf_wrap_compute(job->wrap);
+  g_idle_add(scr_rewrap_job_done, job);
+}
+
+//  scr_rewrap_submit(bd, width)
+// Rewrap the buffer lines with a worker thread.
+// Returns FALSE if the thread pool cannot be used.
+static gboolean scr_rewrap_submit(buffdata *bd, int width)
+{
+  rewrap_job *job;
+
+  if (!rewrap_pool) {
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    nthreads = CLAMP(nthreads, 1, REWRAP_MAX_THREADS);
+    rewrap_pool = g_thread_pool_new(scr_rewrap_worker, NULL, nthreads,
+                                    FALSE, NULL);
+    if (!rewrap_pool)
+      return FALSE;
+    rewrap_max_jobs = 2 * nthreads;
+  }
+
+  job = g_new(rewrap_job, 1);
+  job->wrap = hbuf_wrap_prepare(bd->hbuf, width);
+  if (!job->wrap) {
+    // Empty buffer
+    g_free(job);
+    bd->wrapwidth = width;
+    return TRUE;
+  }
+  job->bd = bd;
+  job->width = width;
+  bd->rewrapping = TRUE;
+  rewrap_jobs++;
+  g_thread_pool_push(rewrap_pool, job, NULL);
+  return TRUE;
+}
+
+//  scr_rewrap_idle_callback()
+// Submit one of the buffers which are not up to date to the rewrap pool.
+// This is called from the main loop when it is idle, so that the buffers
+// are usually ready when they are displayed.
+static gboolean scr_rewrap_idle_callback(gpointer data)
+{
+  winbuf *win_entry = NULL;
+  int width = scr_gettextwidth();
+
+  // The next buffers will be submitted when a job is done
+  if (rewrap_pool && rewrap_jobs >= rewrap_max_jobs) {
+    // source will be destroyed after return
+    rewrap_source = 0;
+    return FALSE;
+  }
+
+  if (statusWindow && buffer_needs_rewrap(NULL, statusWindow, &width))
+    win_entry = statusWindow;
+  else if (winbufhash)
+    win_entry = g_hash_table_find(winbufhash, buffer_needs_rewrap, &width);
+
+  if (!win_entry) {
+    // source will be destroyed after return
+    rewrap_source = 0;
+    return FALSE;
+  }
+  if (!scr_rewrap_submit(win_entry->bd, width))
+    scr_rewrap_buffer(win_entry);
+  return TRUE;
+}
+
+//  scr_rewrap_buffer(win_entry)
+// Rewrap the buffer lines if the width has changed since they were wrapped.
+// Buffers are not rewrapped when the screen is resized, but when they are
+// displayed or when the main loop is idle.
+static void scr_rewrap_buffer(winbuf *win_entry)
+{
+  int width = scr_gettextwidth();
+
+  if (win_entry->bd->wrapwidth == width)
+    return;
+
+  // The other buffers probably need to be rewrapped as well
+  if (!rewrap_source)
+    rewrap_source = g_idle_add(scr_rewrap_idle_callback, NULL);
+
+  // If the top of the screen is on a non-persistent block, it would be
+  // destroyed by the rebuild.
+  win_entry->bd->top = hbuf_previous_persistent(win_entry->bd->top);
+  hbuf_rebuild(&win_entry->bd->hbuf, width);
+  win_entry->bd->wrapwidth = width;
+}
+
 //  scr_line_prefix(line, pref, preflen)
 // Use data from the hbb_line structure and write the prefix
 // to pref (not exceeding preflen, trailing null byte included).
@@ -1149,10 +1712,16 @@ size_t scr_line_prefix(hbb_line *line, char *pref, guint preflen)
 // (Re-)Display the given chat window.
 static void scr_update_window(winbuf *win_entry)
 {
+  // The lines array is reused for all the windows
+  static hbb_line_view *lines;
+  static guint lines_size;
+  static GString *nick;
+  static hbb_line_view loading_marker;
   int n, mark_offset = 0;
-  guint prefixwidth;
+  int nmarker;  // Number of lines used by the loading marker
+  guint prefixwidth, nlines;
   char pref[96];
-  hbb_line **lines, *line;
+  hbb_line *line;
   GList *hbuf_head;
   int color = COLOR_GENERAL;
   bool readmark = FALSE;
@@ -1164,6 +1733,10 @@ static void scr_update_window(winbuf *win_entry)
   prefixwidth = scr_getprefixwidth();
   prefixwidth = MIN(prefixwidth, sizeof pref);
 
+  scr_buffer_unspill(win_entry->bd);
+  scr_rewrap_buffer(win_entry);
+  win_entry->bd->lastview = time(NULL);
+
   // Should the window be empty?
   if (win_entry->bd->cleared) {
     werase(win_entry->win);
@@ -1175,36 +1748,57 @@ static void scr_update_window(winbuf *win_entry)
   // win_entry->bd->top is the top message of the screen.  If it set to NULL,
   // we are displaying the last messages.
 
+  // While the history is being loaded, a marker line is displayed before
+  // the first line of the buffer.
+  nmarker = win_entry->bd->histload ? 1 : 0;
+
   // We will show the last CHAT_WIN_HEIGHT lines.
   // Let's find out where it begins.
-  if (!win_entry->bd->top || (g_list_position(g_list_first(win_entry->bd->hbuf),
-                                              win_entry->bd->top) == -1)) {
+  if (!win_entry->bd->top || (hbuf_get_position(win_entry->bd->hbuf,
+                                                 win_entry->bd->top) == -1)) {
     // Move up CHAT_WIN_HEIGHT lines
-    win_entry->bd->hbuf = g_list_last(win_entry->bd->hbuf);
-    hbuf_head = win_entry->bd->hbuf;
+    win_entry->bd->hbuf = hbuf_get_last(win_entry->bd->hbuf);
     win_entry->bd->top = NULL; // (Just to make sure)
-    n = 0;
-    while (hbuf_head && (n < CHAT_WIN_HEIGHT-1) && g_list_previous(hbuf_head)) {
-      hbuf_head = g_list_previous(hbuf_head);
-      n++;
-    }
+    n = (int)hbuf_get_lines_number(win_entry->bd->hbuf) + nmarker -
+        CHAT_WIN_HEIGHT;
+    if (n > 0) {
+      hbuf_head = hbuf_get_nth(win_entry->bd->hbuf, n - nmarker);
+      nmarker = 0; // Scrolled out
+    } else
+      hbuf_head = hbuf_get_nth(win_entry->bd->hbuf, 0);
     // If the buffer is locked, remember current "top" line for the next time.
     if (win_entry->bd->lock)
       win_entry->bd->top = hbuf_head;
-  } else
+  } else {
     hbuf_head = win_entry->bd->top;
+    if (hbuf_get_position(win_entry->bd->hbuf, hbuf_head) > 0)
+      nmarker = 0;
+  }
 
   // Get the last CHAT_WIN_HEIGHT lines, and one more to detect scroll.
-  lines = hbuf_get_lines(hbuf_head, CHAT_WIN_HEIGHT+1);
+  if (lines_size < (guint)CHAT_WIN_HEIGHT+1) {
+    lines_size = CHAT_WIN_HEIGHT+1;
+    lines = g_renew(hbb_line_view, lines, lines_size);
+  }
+  if (nmarker) {
+    if (!loading_marker.line.text) {
+      loading_marker.line.text = (char*)"Loading history...";
+      loading_marker.line.flags = HBB_PREFIX_INFO;
+      loading_marker.len = strlen(loading_marker.line.text);
+    }
+    lines[0] = loading_marker;
+  }
+  nlines = nmarker + hbuf_get_line_views(hbuf_head, lines + nmarker,
+                                         CHAT_WIN_HEIGHT+1 - nmarker);
 
   if (CHAT_WIN_HEIGHT > 1) {
     // Do we have a read mark?
     for (n = 0; n < CHAT_WIN_HEIGHT; n++) {
-      line = *(lines+n);
-      if (line) {
+      if (n < (int)nlines) {
+        line = &lines[n].line;
         if (line->flags & HBB_PREFIX_READMARK) {
           // If this is not the last line, we'll display a mark
-          if (n+1 < CHAT_WIN_HEIGHT && *(lines+n+1)) {
+          if (n+1 < CHAT_WIN_HEIGHT && n+1 < (int)nlines) {
             readmark = TRUE;
             skipline = TRUE;
             mark_offset = -1;
@@ -1223,8 +1817,10 @@ static void scr_update_window(winbuf *win_entry)
     int timelen;
     int winy = n + mark_offset;
     wmove(win_entry->win, winy, 0);
-    line = *(lines+n);
-    if (line) {
+    if (n < (int)nlines) {
+      unsigned nicklen;
+      line = &lines[n].line;
+      nicklen = MIN(line->mucnicklen, lines[n].len);
       if (skipline)
         goto scr_update_window_skipline;
 
@@ -1262,17 +1858,17 @@ static void scr_update_window(winbuf *win_entry)
       wmove(win_entry->win, winy, prefixwidth-1);
 
       // The MUC nick - overwrite with proper color
-      if (line->mucnicklen) {
+      if (nicklen) {
         char *mucjid;
-        char tmp;
         nickcolor *actual = NULL;
         muccoltype type, *typetmp;
 
-        // Store the char after the nick
-        tmp = line->text[line->mucnicklen];
+        // Copy the nick, the line text is not null-terminated
+        if (!nick)
+          nick = g_string_sized_new(64);
+        g_string_truncate(nick, 0);
+        g_string_append_len(nick, line->text, nicklen);
         type = glob_muccol;
-        // Terminate the string after the nick
-        line->text[line->mucnicklen] = '\0';
         mucjid = g_utf8_strdown(CURRENT_JID, -1);
         if (muccolors) {
           typetmp = g_hash_table_lookup(muccolors, mucjid);
@@ -1282,13 +1878,13 @@ static void scr_update_window(winbuf *win_entry)
         g_free(mucjid);
         // Need to generate a color for the specified nick?
         if ((type == MC_ALL) && (!nickcolors ||
-            !g_hash_table_lookup(nickcolors, line->text))) {
+            !g_hash_table_lookup(nickcolors, nick->str))) {
           char *snick, *mnick;
           nickcolor *nc;
-          const char *p = line->text;
+          const char *p = nick->str;
           unsigned int nicksum = 0;
-          snick = g_strdup(line->text);
-          mnick = g_strdup(line->text);
+          snick = g_strdup(nick->str);
+          mnick = g_strdup(nick->str);
           nc = g_new(nickcolor, 1);
           ensure_string_htable(&nickcolors, NULL);
           while (*p)
@@ -1304,20 +1900,18 @@ static void scr_update_window(winbuf *win_entry)
           g_hash_table_insert(nickcolors, mnick, nc);
         }
         if (nickcolors)
-          actual = g_hash_table_lookup(nickcolors, line->text);
+          actual = g_hash_table_lookup(nickcolors, nick->str);
         if (actual && ((type == MC_ALL) || (actual->manual))
             && (line->flags & HBB_PREFIX_IN) &&
            (!(line->flags & HBB_PREFIX_HLIGHT_OUT)))
           wattrset(win_entry->win, compose_color(actual->color));
-        wprintw(win_entry->win, "%s", line->text);
-        // Return the char
-        line->text[line->mucnicklen] = tmp;
+        waddstr(win_entry->win, nick->str);
         // Return the color back
         wattrset(win_entry->win, get_color(color));
       }
 
       // Display text line
-      wprintw(win_entry->win, "%s", line->text+line->mucnicklen);
+      waddnstr(win_entry->win, line->text + nicklen, lines[n].len - nicklen);
       wclrtoeol(win_entry->win);
 
 scr_update_window_skipline:
@@ -1343,28 +1937,21 @@ scr_update_window_skipline:
       // Restore default ("general") color
       if (color != COLOR_GENERAL)
         wattrset(win_entry->win, get_color(COLOR_GENERAL));
-
-      g_free(line->text);
-      g_free(line);
     } else {
       wclrtobot(win_entry->win);
       break;
     }
   }
-  line = *(lines+CHAT_WIN_HEIGHT); //line is scrolled out and never written
-  if (line) {
+  // The last line is scrolled out and never written
+  if (nlines > (guint)CHAT_WIN_HEIGHT) {
     if (autolock && !win_entry->bd->lock) {
       if (!hbuf_jump_readmark(hbuf_head))
         scr_buffer_readmark(TRUE);
       scr_buffer_scroll_lock(1);
     }
-    g_free(line->text);
-    g_free(line);
   } else if (autolock && win_entry->bd->lock) {
     scr_buffer_scroll_lock(0);
   }
-
-  g_free(lines);
 }
 
 static winbuf *scr_create_window(const char *winId, int special, int dont_show)
@@ -1485,9 +2072,13 @@ static void scr_write_in_window(const char *winId, const char *text,
     win_entry = scr_create_window(winId, special, dont_show);
   }
 
+  // Restore the buffer if it is on disk and has to be displayed
+  if (!dont_show)
+    scr_buffer_unspill(win_entry->bd);
+
   // The message must be displayed -> update top pointer
   if (win_entry->bd->cleared)
-    win_entry->bd->top = g_list_last(win_entry->bd->hbuf);
+    win_entry->bd->top = hbuf_get_last(win_entry->bd->hbuf);
 
   // Make sure we do not free the buffer while it's locked or when
   // top is set.
@@ -1506,9 +2097,18 @@ static void scr_write_in_window(const char *winId, const char *text,
     g_free(nicklocaltmp);
     g_free(nicktmp);
   }
-  hbuf_add_line(&win_entry->bd->hbuf, text_locale, timestamp, prefix_flags,
-                maxX - Roster_Width - scr_getprefixwidth(), num_history_blocks,
-                mucnicklen, xep184);
+  // If the buffer is on disk, append the message to its file
+  if (win_entry->bd->spillfile &&
+      hbuf_append_message_to_file(win_entry->bd->spillfile, text_locale,
+                                  timestamp, prefix_flags, mucnicklen,
+                                  xep184)) {
+    g_free(xep184);
+  } else {
+    scr_buffer_unspill(win_entry->bd);
+    hbuf_add_line(&win_entry->bd->hbuf, text_locale, timestamp, prefix_flags,
+                  scr_gettextwidth(), num_history_blocks,
+                  mucnicklen, xep184);
+  }
   g_free(text_locale);
 
   if (win_entry->bd->cleared) {
@@ -1520,9 +2120,8 @@ static void scr_write_in_window(const char *winId, const char *text,
   // Make sure the last line appears in the window; update top if necessary
   if (!win_entry->bd->lock && win_entry->bd->top) {
     int dist;
-    GList *first = g_list_first(win_entry->bd->hbuf);
-    dist = g_list_position(first, g_list_last(win_entry->bd->hbuf)) -
-           g_list_position(first, win_entry->bd->top);
+    dist = (int)hbuf_get_lines_number(win_entry->bd->hbuf) - 1 -
+           hbuf_get_position(win_entry->bd->hbuf, win_entry->bd->top);
     if (dist >= CHAT_WIN_HEIGHT)
       win_entry->bd->top = NULL;
   }
@@ -1532,8 +2131,12 @@ static void scr_write_in_window(const char *winId, const char *text,
       setmsgflg = TRUE;
     else
       // If this is an outgoing message, remove the readmark
-      if (!special && (prefix_flags & (HBB_PREFIX_OUT|HBB_PREFIX_HLIGHT_OUT)))
+      if (!special &&
+          (prefix_flags & (HBB_PREFIX_OUT|HBB_PREFIX_HLIGHT_OUT))) {
         hbuf_set_readmark(win_entry->bd->hbuf, FALSE);
+        if (win_entry->bd->histload)
+          win_entry->bd->histload->readmark = FALSE;
+      }
     // Show and refresh the window
     top_panel(win_entry->panel);
     scr_update_window(win_entry);
@@ -1548,6 +2151,7 @@ static void scr_write_in_window(const char *winId, const char *text,
     roster_msg_setflag(winId, special, TRUE);
     update_roster = TRUE;
   }
+  scr_check_buffers_memory();
 }
 
 static char *attention_sign_guard(const gchar *key, const gchar *new_value)
@@ -1570,11 +2174,51 @@ static char *attention_sign_guard(const gchar *key, const gchar *new_value)
   return g_strdup(new_value);
 }
 
+static gchar *buffers_memory_guard(const gchar *key, const gchar *new_value)
+{
+  int limit = new_value ? atoi(new_value) : 0;
+
+  if (limit < 0) {
+    scr_log_print(LPRINT_NORMAL, "%s value is invalid.", key);
+    // The option is unset, so is the limit
+    buffers_memory_limit = 0;
+    buffers_memory_floor = 0;
+    return NULL;
+  }
+  // The value is in kilobytes
+  buffers_memory_limit = (gsize)limit * 1024U;
+  buffers_memory_floor = 0;
+  scr_check_buffers_memory();
+  return g_strdup(new_value);
+}
+
+static gchar *buffers_spill_guard(const gchar *key, const gchar *new_value)
+{
+  int delay = new_value ? atoi(new_value) : 0;
+
+  if (delay < 0) {
+    scr_log_print(LPRINT_NORMAL, "%s value is invalid.", key);
+    return NULL;
+  }
+  // The value is in minutes
+  buffers_spill_delay = delay;
+  if (delay && !spill_source)
+    spill_source = g_timeout_add_seconds(60, scr_spill_timeout_callback,
+                                         NULL);
+  else if (!delay && spill_source) {
+    g_source_remove(spill_source);
+    spill_source = 0;
+  }
+  return g_strdup(new_value);
+}
+
 //  scr_init_settings()
 // Create guards for UI settings
 void scr_init_settings(void)
 {
   settings_set_guard("attention_char", attention_sign_guard);
+  settings_set_guard("max_buffers_memory", buffers_memory_guard);
+  settings_set_guard("buffers_spill_delay", buffers_spill_guard);
 }
 
 static unsigned int attention_sign(void)
@@ -1783,11 +2427,8 @@ void scr_draw_main_window(unsigned int fullinit)
     // is added
     buddylist_build();
 
-    // Init prev_chatwidth; this variable will be used to prevent us
-    // from rewrapping buffers when the width doesn't change.
-    prev_chatwidth = maxX - Roster_Width - scr_getprefixwidth();
     // Wrap existing status buffer lines
-    hbuf_rebuild(&statushbuf, prev_chatwidth);
+    hbuf_rebuild(&statushbuf, scr_gettextwidth());
 
 #ifndef UNICODE
     if (utf8_mode)
@@ -1814,7 +2455,6 @@ static void resize_win_buffer(gpointer key, gpointer value, gpointer data)
   winbuf *wbp = value;
   struct dimensions *dim = data;
   int chat_x_pos, chat_y_pos;
-  int new_chatwidth;
 
   if (!(wbp && wbp->win))
     return;
@@ -1836,18 +2476,15 @@ static void resize_win_buffer(gpointer key, gpointer value, gpointer data)
   // If a panel exists, replace the old window with the new
   if (wbp->panel)
     replace_panel(wbp->panel, wbp->win);
-  // Redo line wrapping
-  wbp->bd->top = hbuf_previous_persistent(wbp->bd->top);
-
-  new_chatwidth = maxX - Roster_Width - scr_getprefixwidth();
-  if (new_chatwidth != prev_chatwidth)
-    hbuf_rebuild(&wbp->bd->hbuf, new_chatwidth);
+  // Line wrapping will be done by scr_update_window() when the buffer
+  // is displayed, or in the background by scr_rewrap_idle_callback().
 }
 
 //  scr_Resize()
 // Function called when the window is resized.
 // - Resize windows
-// - Rewrap lines in each buddy buffer
+// - Redisplay the current buddy window (other buffers will be rewrapped
+//   in the background or when they are displayed)
 void scr_Resize(void)
 {
   struct dimensions dim;
@@ -1875,8 +2512,9 @@ void scr_Resize(void)
   if (statusWindow)
     resize_win_buffer(NULL, statusWindow, &dim);
 
-  // Update prev_chatwidth, now that all buffers have been resized
-  prev_chatwidth = maxX - Roster_Width - scr_getprefixwidth();
+  // Rewrap the buffers when the main loop is idle
+  if (!rewrap_source)
+    rewrap_source = g_idle_add(scr_rewrap_idle_callback, NULL);
 
   // Refresh current buddy window
   if (chatmode)
@@ -2037,27 +2675,83 @@ void scr_update_chat_status(int forceupdate)
   }
 }
 
-void increment_if_buddy_not_filtered(gpointer rosterdata, void *param)
+//  roster_rows_reset(rows, width)
+// (Re)initialize the roster rows cache for a window of the given size.
+// The roster window has to be erased, since nothing is displayed anymore.
+static void roster_rows_reset(int rows, int width)
 {
-  int *p = param;
-  if (buddylist_is_status_filtered(buddy_getstatus(rosterdata, NULL)))
-    *p=*p+1;
+  int i;
+
+  for (i = 0; i < roster_rows_count; i++)
+    g_free(roster_rows[i].text);
+  g_free(roster_rows);
+  roster_rows = NULL;
+  roster_rows_count = 0;
+
+  if (rows > 0)
+    roster_rows = g_new0(rosterrow, rows);
+  roster_rows_count = rows;
+  roster_rows_width = width;
+  roster_rows_right = roster_win_on_right;
+  roster_rows_win = rosterWnd;
+}
+
+//  get_roster_rule_color(bjid, status)
+// Return the color attribute of the first roster coloring rule matching
+// bjid and status, or the default roster color.
+// The results are cached until the rules are modified.
+static int get_roster_rule_color(const char *bjid, char status)
+{
+  rostercolcache *cc = NULL;
+  GSList *head;
+  int color = get_color(COLOR_ROSTER);
+
+  if (!rostercolrules || !bjid)
+    return color;
+
+  if (!rostercolcachehash)
+    rostercolcachehash = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+  else
+    cc = g_hash_table_lookup(rostercolcachehash, bjid);
+
+  if (cc && cc->status == status)
+    return cc->color;
+
+  for (head = rostercolrules; head; head = g_slist_next(head)) {
+    rostercolor *rc = head->data;
+    if (g_pattern_match_string(rc->compiled, bjid) &&
+        (!strcmp("*", rc->status) || strchr(rc->status, status))) {
+      color = compose_color(rc->color);
+      break;
+    }
+  }
+
+  if (!cc) {
+    cc = g_new(rostercolcache, 1);
+    g_hash_table_insert(rostercolcachehash, g_strdup(bjid), cc);
+  }
+  cc->status = status;
+  cc->color = color;
+  return color;
 }
 
 //  scr_draw_roster()
 // Display the buddylist (not really the roster) on the screen
+// Only the visible part of the buddylist is visited, and only the rows
+// which have changed since the previous call are redrawn.
 void scr_draw_roster(void)
 {
-  static int offset = 0;
+  static gpointer top_buddy;  // First item displayed
+  static int current_row;     // Row of current_buddy in the last redraw
   char *name, *rline;
   int maxx, maxy;
-  GList *buddy;
+  GList *buddy, *top, *up, *down;
   int i, n;
-  int rOffset;
   int cursor_backup;
   guint status, pending;
   enum imstatus currentstatus = xmpp_getstatus();
-  int x_pos;
+  int x_pos, line_x_pos;
   int prefix_length;
   char space[2] = " ";
 
@@ -2070,47 +2764,81 @@ void scr_draw_roster(void)
   cursor_backup = curs_set(0);
 
   if (!buddylist)
-    offset = 0;
+    top_buddy = NULL;
   else
     scr_update_chat_status(FALSE);
 
-  // Cleanup of roster window
-  werase(rosterWnd);
-
-  if (Roster_Width) {
-    int line_x_pos = roster_win_on_right ? 0 : Roster_Width-1;
-    // Redraw the vertical line (not very good...)
-    wattrset(rosterWnd, get_color(COLOR_GENERAL));
-    for (i=0 ; i < CHAT_WIN_HEIGHT ; i++)
-      mvwaddch(rosterWnd, i, line_x_pos, ACS_VLINE);
-  }
+  line_x_pos = roster_win_on_right ? 0 : Roster_Width-1;
 
   // Leave now if buddylist is empty or the roster is hidden
   if (!buddylist || !Roster_Width) {
+    werase(rosterWnd);
+    roster_rows_reset(0, 0);
+    if (Roster_Width) {
+      // Redraw the vertical line
+      wattrset(rosterWnd, get_color(COLOR_GENERAL));
+      for (i=0 ; i < CHAT_WIN_HEIGHT ; i++)
+        mvwaddch(rosterWnd, i, line_x_pos, ACS_VLINE);
+    }
     update_panels();
     curs_set(cursor_backup);
     return;
   }
 
-  // Update offset if necessary
-  // a) Try to show as many buddylist items as possible
-  i = g_list_length(buddylist) - maxy;
-  if (i < 0)
-    i = 0;
-  if (i < offset)
-    offset = i;
-  // b) Make sure the current_buddy is visible
-  i = g_list_position(buddylist, current_buddy);
-  if (i == -1) { // This is bad
-    scr_LogPrint(LPRINT_NORMAL, "Doh! Can't find current selected buddy!!");
-    curs_set(cursor_backup);
-    return;
-  } else if (i < offset) {
-    offset = i;
-  } else if (i+1 > offset + maxy) {
-    offset = i + 1 - maxy;
+  // The window has changed: everything has to be redrawn
+  if (maxy != roster_rows_count || maxx != roster_rows_width ||
+      roster_win_on_right != roster_rows_right ||
+      rosterWnd != roster_rows_win) {
+    werase(rosterWnd);
+    roster_rows_reset(maxy, maxx);
+    // Redraw the vertical line (not very good...)
+    wattrset(rosterWnd, get_color(COLOR_GENERAL));
+    for (i=0 ; i < CHAT_WIN_HEIGHT ; i++)
+      mvwaddch(rosterWnd, i, line_x_pos, ACS_VLINE);
+  }
+
+  // Find the first displayed item.  If it has left the buddylist, we try
+  // to keep current_buddy on the same row.
+  top = buddylist_find(top_buddy);
+  if (!top) {
+    top = current_buddy;
+    for (n = 0; n < current_row && g_list_previous(top); n++)
+      top = g_list_previous(top);
+  }
+
+  // Make sure the current_buddy is visible
+  for (n = 0, buddy = top; buddy && n < maxy && buddy != current_buddy; n++)
+    buddy = g_list_next(buddy);
+  if (buddy != current_buddy || n >= maxy) {
+    // Look for current_buddy above and below the window
+    up = g_list_previous(top);
+    down = (n >= maxy ? buddy : NULL);
+    while (up || down) {
+      if (up == current_buddy || down == current_buddy)
+        break;
+      up = g_list_previous(up);
+      down = g_list_next(down);
+    }
+    if (up && up == current_buddy) {
+      top = current_buddy;
+    } else if (down && down == current_buddy) {
+      top = current_buddy;
+      for (n = 1; n < maxy && g_list_previous(top); n++)
+        top = g_list_previous(top);
+    } else { // This is bad
+      scr_LogPrint(LPRINT_NORMAL, "Doh! Can't find current selected buddy!!");
+      curs_set(cursor_backup);
+      return;
+    }
   }
 
+  // Try to show as many buddylist items as possible
+  for (n = 0, buddy = top; buddy && n < maxy; n++)
+    buddy = g_list_next(buddy);
+  for ( ; n < maxy && g_list_previous(top); n++)
+    top = g_list_previous(top);
+  top_buddy = BUDDATA(top);
+
   if (roster_win_on_right)
     x_pos = 1; // 1 char offset (vertical line)
   else
@@ -2126,15 +2854,12 @@ void scr_draw_roster(void)
   name = g_new0(char, 4*Roster_Width);
   rline = g_new0(char, 4*Roster_Width+1);
 
-  buddy = buddylist;
-  rOffset = offset;
-
-  for (i=0; i<maxy && buddy; buddy = g_list_next(buddy)) {
+  for (i=0, buddy = top; i<maxy && buddy; buddy = g_list_next(buddy)) {
     unsigned short bflags, btype;
     unsigned short ismsg, isgrp, ismuc, ishid, isspe;
-    guint isurg;
+    guint isurg, events;
+    int color;
     gchar *rline_locale;
-    GSList *resources, *p_res;
 
     bflags = buddy_getflags(BUDDATA(buddy));
     btype = buddy_gettype(BUDDATA(buddy));
@@ -2146,25 +2871,14 @@ void scr_draw_roster(void)
     isspe = btype  & ROSTER_TYPE_SPECIAL;
     isurg = buddy_getuiprio(BUDDATA(buddy));
 
-    if (rOffset > 0) {
-      rOffset--;
-      continue;
-    }
-
     status = '?';
     pending = ' ';
 
-    resources = buddy_getresources(BUDDATA(buddy));
-    for (p_res = resources ; p_res ; p_res = g_slist_next(p_res)) {
-      guint events = buddy_resource_getevents(BUDDATA(buddy),
-                                              p_res ? p_res->data : "");
-      if ((events & ROSTER_EVENT_PAUSED) && pending != '+')
-        pending = '.';
-      if (events & ROSTER_EVENT_COMPOSING)
-        pending = '+';
-      g_free(p_res->data);
-    }
-    g_slist_free(resources);
+    events = buddy_getevents(BUDDATA(buddy));
+    if (events & ROSTER_EVENT_COMPOSING)
+      pending = '+';
+    else if (events & ROSTER_EVENT_PAUSED)
+      pending = '.';
 
     // Display message notice if there is a message flag, but not
     // for unfolded groups.
@@ -2185,32 +2899,17 @@ void scr_draw_roster(void)
     }
     if (buddy == current_buddy) {
       if (pending == '#')
-        wattrset(rosterWnd, get_color(COLOR_ROSTERSELNMSG));
+        color = get_color(COLOR_ROSTERSELNMSG);
       else
-        wattrset(rosterWnd, get_color(COLOR_ROSTERSEL));
-      // The 3 following lines aim at coloring the whole line
-      wmove(rosterWnd, i, x_pos);
-      for (n = 0; n < maxx; n++)
-        waddch(rosterWnd, ' ');
+        color = get_color(COLOR_ROSTERSEL);
+      current_row = i;
     } else {
       if (pending == '#')
-        wattrset(rosterWnd, get_color(COLOR_ROSTERNMSG));
-      else {
-        int color = get_color(COLOR_ROSTER);
-        if ((!isspe) && (!isgrp)) { // Look for color rules
-          GSList *head;
-          const char *bjid = buddy_getjid(BUDDATA(buddy));
-          for (head = rostercolrules; head; head = g_slist_next(head)) {
-            rostercolor *rc = head->data;
-            if (g_pattern_match_string(rc->compiled, bjid) &&
-                (!strcmp("*", rc->status) || strchr(rc->status, status))) {
-              color = compose_color(rc->color);
-              break;
-            }
-          }
-        }
-        wattrset(rosterWnd, color);
-      }
+        color = get_color(COLOR_ROSTERNMSG);
+      else if ((!isspe) && (!isgrp)) // Look for color rules
+        color = get_roster_rule_color(buddy_getjid(BUDDATA(buddy)), status);
+      else
+        color = get_color(COLOR_ROSTER);
     }
 
     if (Roster_Width > prefix_length)
@@ -2227,11 +2926,8 @@ void scr_draw_roster(void)
 
     if (isgrp) {
       if (ishid) {
-        int group_count = 0;
-        foreach_group_member(BUDDATA(buddy), increment_if_buddy_not_filtered,
-                             &group_count);
-        snprintf(rline, 4*Roster_Width, "%s%lc+++ %s (%i)", space, pending,
-                 name, group_count);
+        snprintf(rline, 4*Roster_Width, "%s%lc+++ %s (%u)", space, pending,
+                 name, buddy_getgroupcount(BUDDATA(buddy)));
         /* Do not display the item count if there isn't enough space */
         if (g_utf8_strlen(rline, 4*Roster_Width) >= Roster_Width)
           snprintf(rline, 4*Roster_Width, "%s%lc+++ %s", space, pending, name);
@@ -2256,12 +2952,54 @@ void scr_draw_roster(void)
                space, pending, sepleft, status, sepright, name);
     }
 
+    // Skip the row if it hasn't changed
+    if (roster_rows[i].text && roster_rows[i].attr == color &&
+        roster_rows[i].selected == (buddy == current_buddy) &&
+        !strcmp(roster_rows[i].text, rline)) {
+      i++;
+      continue;
+    }
+    g_free(roster_rows[i].text);
+    roster_rows[i].text = g_strdup(rline);
+    roster_rows[i].attr = color;
+    roster_rows[i].selected = (buddy == current_buddy);
+
+    // Clear the row
+    wmove(rosterWnd, i, x_pos);
+    wclrtoeol(rosterWnd);
+    if (!roster_win_on_right) {
+      wattrset(rosterWnd, get_color(COLOR_GENERAL));
+      mvwaddch(rosterWnd, i, line_x_pos, ACS_VLINE);
+    }
+
+    wattrset(rosterWnd, color);
+    if (buddy == current_buddy) {
+      // The 2 following lines aim at coloring the whole line
+      wmove(rosterWnd, i, x_pos);
+      for (n = 0; n < maxx; n++)
+        waddch(rosterWnd, ' ');
+    }
+
     rline_locale = from_utf8(rline);
     mvwprintw(rosterWnd, i, x_pos, "%s", rline_locale);
     g_free(rline_locale);
     i++;
   }
 
+  // Clear the remaining rows
+  for ( ; i < maxy; i++) {
+    if (!roster_rows[i].text)
+      continue;
+    g_free(roster_rows[i].text);
+    roster_rows[i].text = NULL;
+    wmove(rosterWnd, i, x_pos);
+    wclrtoeol(rosterWnd);
+    if (!roster_win_on_right) {
+      wattrset(rosterWnd, get_color(COLOR_GENERAL));
+      mvwaddch(rosterWnd, i, line_x_pos, ACS_VLINE);
+    }
+  }
+
   g_free(rline);
   g_free(name);
   top_panel(inputPanel);
@@ -2336,13 +3074,13 @@ void scr_write_outgoing_message(const char *jidto, const char *text,
                     0, prefix|HBB_PREFIX_OUT|HBB_PREFIX_HLIGHT_OUT, 0, xep184);
 
   // Show jidto's buffer unless the buddy is not in the buddylist
-  if (roster_elt && g_list_position(buddylist, roster_elt->data) != -1)
+  if (roster_elt && buddylist_find(roster_elt->data))
     scr_show_window(jidto, FALSE);
 }
 
 void scr_remove_receipt_flag(const char *bjid, gconstpointer xep184)
 {
-  winbuf *win_entry = scr_search_window(bjid, FALSE);
+  winbuf *win_entry = scr_search_window_loaded(bjid, FALSE);
   if (win_entry && xep184) {
     hbuf_remove_receipt(win_entry->bd->hbuf, xep184);
     if (chatmode && (buddy_search_jid(bjid) == current_buddy))
@@ -2481,11 +3219,7 @@ void scr_check_auto_away(int activity)
 // Lock the newbuddy, and unlock the previous current_buddy
 static void set_current_buddy(GList *newbuddy)
 {
-  enum imstatus prev_st = imstatus_size;
-  /* prev_st initialized to imstatus_size, which is used as "undef" value.
-   * We are sure prev_st will get a different status value after the
-   * buddy_getstatus() call.
-   */
+  gpointer prev_buddy;
 
   if (!current_buddy || !newbuddy)  return;
   if (newbuddy == current_buddy)    return;
@@ -2495,7 +3229,7 @@ static void set_current_buddy(GList *newbuddy)
   // We don't want the chatstate to be changed again right now.
   lock_chatstate = TRUE;
 
-  prev_st = buddy_getstatus(BUDDATA(current_buddy), NULL);
+  prev_buddy = BUDDATA(current_buddy);
   buddy_setflags(BUDDATA(current_buddy), ROSTER_FLAG_LOCK, FALSE);
   if (chatmode) {
     scr_buffer_readmark(TRUE);
@@ -2508,9 +3242,8 @@ static void set_current_buddy(GList *newbuddy)
     // Remove the readmark if it is at the end of the buffer
     scr_buffer_readmark(-1);
   }
-  // We should rebuild the buddylist but not everytime
-  if (!(buddylist_get_filter() & 1<<prev_st))
-    buddylist_build();
+  // The previous buddy may have to leave the buddylist
+  buddylist_update_buddy(prev_buddy);
   update_roster = TRUE;
 }
 
@@ -2619,6 +3352,18 @@ void scr_roster_search(char *str)
   }
 }
 
+//  scr_roster_fuzzy_search(str)
+// Jump to the buddy with jid/name best matching str (the characters of str
+// can be separated).  Repeat the search to jump to the next match.
+void scr_roster_fuzzy_search(char *str)
+{
+  set_current_buddy(buddy_fuzzy_search(str));
+  if (chatmode) {
+    last_activity_buddy = current_buddy;
+    scr_show_buddy_window();
+  }
+}
+
 //  scr_roster_jump_jid(bjid)
 // Jump to buddy bjid.
 // NOTE: With this function, the buddy is added to the roster if doesn't exist.
@@ -2660,7 +3405,8 @@ void scr_roster_unread_message(int next)
 
   unread_ptr = unread_msg(refbuddata);
   if (!unread_ptr) {
-    if (!last_activity_buddy || g_list_position(buddylist, last_activity_buddy) == -1)
+    if (!last_activity_buddy ||
+        buddylist_find(BUDDATA(last_activity_buddy)) != last_activity_buddy)
       return;
     unread_ptr = BUDDATA(last_activity_buddy);
   }
@@ -2675,7 +3421,7 @@ void scr_roster_unread_message(int next)
     }
   }
 
-  nbuddy = g_list_find(buddylist, unread_ptr);
+  nbuddy = buddylist_find(unread_ptr);
   if (nbuddy) {
     set_current_buddy(nbuddy);
     if (chatmode) scr_show_buddy_window();
@@ -2722,7 +3468,8 @@ void scr_roster_next_open_buffer(void)
 // Try to jump to alternate (== previous) buddy
 void scr_roster_jump_alternate(void)
 {
-  if (!alternate_buddy || g_list_position(buddylist, alternate_buddy) == -1)
+  if (!alternate_buddy ||
+      buddylist_find(BUDDATA(alternate_buddy)) != alternate_buddy)
     return;
   set_current_buddy(alternate_buddy);
   if (chatmode) {
@@ -2770,7 +3517,7 @@ void scr_roster_display(const char *filter)
 void scr_buffer_scroll_up_down(int updown, unsigned int nblines)
 {
   winbuf *win_entry;
-  int n, nbl;
+  int n, nbl, pos, nlines;
   GList *hbuf_top;
   guint isspe;
 
@@ -2778,7 +3525,7 @@ void scr_buffer_scroll_up_down(int updown, unsigned int nblines)
   if (!current_buddy) return;
 
   isspe = buddy_gettype(BUDDATA(current_buddy)) & ROSTER_TYPE_SPECIAL;
-  win_entry  = scr_search_window(CURRENT_JID, isspe);
+  win_entry  = scr_search_window_loaded(CURRENT_JID, isspe);
   if (!win_entry) return;
 
   if (!nblines) {
@@ -2788,11 +3535,12 @@ void scr_buffer_scroll_up_down(int updown, unsigned int nblines)
     nbl = nblines;
   }
   hbuf_top = win_entry->bd->top;
+  nlines = hbuf_get_lines_number(win_entry->bd->hbuf);
 
   if (updown == -1) {   // UP
     n = 0;
     if (!hbuf_top) {
-      hbuf_top = g_list_last(win_entry->bd->hbuf);
+      hbuf_top = hbuf_get_last(win_entry->bd->hbuf);
       if (!win_entry->bd->cleared) {
         if (!nblines) nbl = nbl*3 - 1;
         else nbl += CHAT_WIN_HEIGHT - 1;
@@ -2801,18 +3549,21 @@ void scr_buffer_scroll_up_down(int updown, unsigned int nblines)
         n++; // We'll scroll one line less
       }
     }
-    for ( ; hbuf_top && n < nbl && g_list_previous(hbuf_top) ; n++)
-      hbuf_top = g_list_previous(hbuf_top);
-    win_entry->bd->top = hbuf_top;
-  } else {              // DOWN
-    for (n=0 ; hbuf_top && n < nbl ; n++)
-      hbuf_top = g_list_next(hbuf_top);
-    win_entry->bd->top = hbuf_top;
+    pos = hbuf_get_position(win_entry->bd->hbuf, hbuf_top);
+    // Read older history from file when the first line is reached
+    if (pos >= 0 && pos < nbl - n && !isspe &&
+        scr_buffer_page_history(win_entry->bd, CURRENT_JID))
+      pos = hbuf_get_position(win_entry->bd->hbuf, hbuf_top);
+    if (pos >= 0)
+      win_entry->bd->top = hbuf_get_nth(win_entry->bd->hbuf,
+                                        MAX(pos - MAX(nbl - n, 0), 0));
+  } else if (hbuf_top) { // DOWN
+    pos = hbuf_get_position(win_entry->bd->hbuf, hbuf_top) + nbl;
     // Check if we are at the bottom
-    for (n=0 ; hbuf_top && n < CHAT_WIN_HEIGHT-1 ; n++)
-      hbuf_top = g_list_next(hbuf_top);
-    if (!hbuf_top)
+    if (pos + CHAT_WIN_HEIGHT-1 >= nlines)
       win_entry->bd->top = NULL; // End reached
+    else
+      win_entry->bd->top = hbuf_get_nth(win_entry->bd->hbuf, pos);
   }
 
   // Refresh the window
@@ -2832,7 +3583,7 @@ void scr_buffer_clear(void)
   // Get win_entry
   if (!current_buddy) return;
   isspe = buddy_gettype(BUDDATA(current_buddy)) & ROSTER_TYPE_SPECIAL;
-  win_entry = scr_search_window(CURRENT_JID, isspe);
+  win_entry = scr_search_window_loaded(CURRENT_JID, isspe);
   if (!win_entry) return;
 
   win_entry->bd->cleared = TRUE;
@@ -2858,6 +3609,10 @@ static gboolean buffer_purge(gpointer key, gpointer value, gpointer data)
 
   // Delete the current hbuf
   hbuf_free(&win_entry->bd->hbuf);
+  scr_buffer_drop_spill(win_entry->bd);
+  scr_buffer_end_history_load(win_entry->bd, FALSE);
+  if (histpage_pending == win_entry->bd)
+    histpage_pending = NULL;
 
   if (*p_closebuf) {
     GSList *roster_elt;
@@ -2972,7 +3727,7 @@ void scr_buffer_scroll_lock(int lock)
   // Get win_entry
   if (!current_buddy) return;
   isspe = buddy_gettype(BUDDATA(current_buddy)) & ROSTER_TYPE_SPECIAL;
-  win_entry = scr_search_window(CURRENT_JID, isspe);
+  win_entry = scr_search_window_loaded(CURRENT_JID, isspe);
   if (!win_entry) return;
 
   if (lock == -1)
@@ -3017,7 +3772,7 @@ void scr_buffer_readmark(gchar action)
   if (!current_buddy) return;
   isspe = buddy_gettype(BUDDATA(current_buddy)) & ROSTER_TYPE_SPECIAL;
   if (isspe) return; // Maybe not necessary
-  win_entry = scr_search_window(CURRENT_JID, isspe);
+  win_entry = scr_search_window_loaded(CURRENT_JID, isspe);
   if (!win_entry) return;
 
   autolock = settings_opt_get_int("buffer_smart_scrolling");
@@ -3026,6 +3781,9 @@ void scr_buffer_readmark(gchar action)
       hbuf_set_readmark(win_entry->bd->hbuf, action);
     else
       hbuf_remove_trailing_readmark(win_entry->bd->hbuf);
+    // The mark will not be on the last history line any more
+    if (win_entry->bd->histload && (action >= 0 || !win_entry->bd->hbuf))
+      win_entry->bd->histload->readmark = FALSE;
   }
 }
 
@@ -3041,14 +3799,14 @@ void scr_buffer_top_bottom(int topbottom)
   // Get win_entry
   if (!current_buddy) return;
   isspe = buddy_gettype(BUDDATA(current_buddy)) & ROSTER_TYPE_SPECIAL;
-  win_entry = scr_search_window(CURRENT_JID, isspe);
+  win_entry = scr_search_window_loaded(CURRENT_JID, isspe);
   if (!win_entry) return;
 
   win_entry->bd->cleared = FALSE;
   if (topbottom == 1)
     win_entry->bd->top = NULL;
   else
-    win_entry->bd->top = g_list_first(win_entry->bd->hbuf);
+    win_entry->bd->top = hbuf_get_nth(win_entry->bd->hbuf, 0);
 
   // Refresh the window
   scr_update_window(win_entry);
@@ -3069,13 +3827,13 @@ void scr_buffer_search(int direction, const char *text)
   // Get win_entry
   if (!current_buddy) return;
   isspe = buddy_gettype(BUDDATA(current_buddy)) & ROSTER_TYPE_SPECIAL;
-  win_entry = scr_search_window(CURRENT_JID, isspe);
+  win_entry = scr_search_window_loaded(CURRENT_JID, isspe);
   if (!win_entry) return;
 
   if (win_entry->bd->top)
     current_line = win_entry->bd->top;
   else
-    current_line = g_list_last(win_entry->bd->hbuf);
+    current_line = hbuf_get_last(win_entry->bd->hbuf);
 
   search_res = hbuf_search(current_line, direction, text);
 
@@ -3103,7 +3861,7 @@ void scr_buffer_percent(int pc)
   // Get win_entry
   if (!current_buddy) return;
   isspe = buddy_gettype(BUDDATA(current_buddy)) & ROSTER_TYPE_SPECIAL;
-  win_entry = scr_search_window(CURRENT_JID, isspe);
+  win_entry = scr_search_window_loaded(CURRENT_JID, isspe);
   if (!win_entry) return;
 
   if (pc < 0 || pc > 100) {
@@ -3135,7 +3893,7 @@ void scr_buffer_date(time_t t)
   // Get win_entry
   if (!current_buddy) return;
   isspe = buddy_gettype(BUDDATA(current_buddy)) & ROSTER_TYPE_SPECIAL;
-  win_entry = scr_search_window(CURRENT_JID, isspe);
+  win_entry = scr_search_window_loaded(CURRENT_JID, isspe);
   if (!win_entry) return;
 
   search_res = hbuf_jump_date(win_entry->bd->hbuf, t);
@@ -3165,7 +3923,7 @@ void scr_buffer_jump_readmark(void)
   if (!current_buddy) return;
   isspe = buddy_gettype(BUDDATA(current_buddy)) & ROSTER_TYPE_SPECIAL;
   if (isspe) return;
-  win_entry = scr_search_window(CURRENT_JID, isspe);
+  win_entry = scr_search_window_loaded(CURRENT_JID, isspe);
   if (!win_entry) return;
 
   search_res = hbuf_jump_readmark(win_entry->bd->hbuf);
@@ -3215,10 +3973,15 @@ static void buffer_list(gpointer key, gpointer value, gpointer data)
   GList *head;
   winbuf *win_entry = value;
 
-  head = g_list_first(win_entry->bd->hbuf);
+  head = win_entry->bd->hbuf;
 
-  scr_LogPrint(LPRINT_NORMAL, " %s  (%u/%u)", (const char *) key,
-               g_list_length(head), hbuf_get_blocks_number(head));
+  if (win_entry->bd->spillfile) {
+    scr_LogPrint(LPRINT_NORMAL, " %s  (on disk)", (const char *) key);
+    return;
+  }
+  scr_LogPrint(LPRINT_NORMAL, " %s  (%u/%u, %lu kB)", (const char *) key,
+               hbuf_get_lines_number(head), hbuf_get_blocks_number(head),
+               (unsigned long)(hbuf_get_memory_usage(head) / 1024U));
 }
 
 void scr_buffer_list(void)
@@ -3226,6 +3989,13 @@ void scr_buffer_list(void)
   scr_LogPrint(LPRINT_NORMAL, "Buffer list:");
   buffer_list("[status]", statusWindow, NULL);
   g_hash_table_foreach(winbufhash, buffer_list, NULL);
+  if (buffers_memory_limit)
+    scr_LogPrint(LPRINT_NORMAL, "Memory used: %lu kB (limit: %lu kB)",
+                 (unsigned long)(hbuf_get_total_memory_usage() / 1024U),
+                 (unsigned long)(buffers_memory_limit / 1024U));
+  else
+    scr_LogPrint(LPRINT_NORMAL, "Memory used: %lu kB",
+                 (unsigned long)(hbuf_get_total_memory_usage() / 1024U));
   scr_LogPrint(LPRINT_NORMAL, "End of buffer list.");
   scr_setmsgflag_if_needed(SPECIAL_BUFFER_STATUS_ID, TRUE);
   scr_setattentionflag_if_needed(SPECIAL_BUFFER_STATUS_ID, TRUE,
@@ -144,6 +144,7 @@ void scr_roster_up_down(int updown, unsigned int n);
 void scr_roster_prev_group(void);
 void scr_roster_next_group(void);
 void scr_roster_search(char *);
+void scr_roster_fuzzy_search(char *);
 void scr_roster_jump_jid(char *);
 void scr_roster_jump_alternate(void);
 void scr_roster_unread_message(int);
@@ -161,6 +162,7 @@ void scr_buffer_date(time_t t);
 void scr_buffer_dump(const char *file);
 void scr_buffer_list(void);
 void scr_buffer_scroll_up_down(int updown, unsigned int nblines);
+void scr_history_page_ready(void);
 void scr_buffer_readmark(gchar action);
 void scr_buffer_jump_readmark(void);
 
@@ -38,6 +38,7 @@
 #include "roster.h"
 #include "screen.h"
 #include "settings.h"
+#include "rostercache.h"
 #include "utils.h"
 #include "main.h"
 #include "carbons.h"
@@ -737,6 +738,9 @@ static void connection_auth_cb(LmConnection *connection, gboolean success,
 {
   if (success) {
 
+    // Display the cached roster until the server replies
+    roster_cache_load();
+    update_roster = TRUE;
     xmpp_iq_request(NULL, NS_ROSTER);
     xmpp_iq_request(NULL, NS_DISCO_INFO);
     xmpp_request_storage("storage:bookmarks");
@@ -833,7 +837,8 @@ static void connection_close_cb(LmConnection *connection,
   if (bookmarks)
     lm_message_node_unref(bookmarks);
   bookmarks = NULL;
-  // Free roster
+  // Save the roster cache and free roster
+  roster_cache_close();
   roster_free();
   if (rosternotes)
     lm_message_node_unref(rosternotes);
@@ -1892,6 +1897,8 @@ void xmpp_disconnect(void)
 {
   if (!lconnection)
     return;
+  // Save the pending roster cache changes
+  roster_cache_close();
   if (lm_connection_is_authenticated(lconnection)) {
     // Launch pre-disconnect internal hook
     hk_predisconnect();
@@ -1902,6 +1909,8 @@ void xmpp_disconnect(void)
     lm_connection_close(lconnection, NULL);
   lm_connection_unref(lconnection);
   lconnection = NULL;
+  // Write the pending history records
+  hlog_flush();
 }
 
 void xmpp_setstatus(enum imstatus st, const char *recipient, const char *msg,
@@ -32,6 +32,7 @@
 #include "utils.h"
 #include "logprint.h"
 #include "settings.h"
+#include "rostercache.h"
 #include "caps.h"
 #include "main.h"
 
@@ -563,15 +564,15 @@ LmHandlerResult handle_iq_disco_info(LmMessageHandler *h,
 LmHandlerResult handle_iq_roster(LmMessageHandler *h, LmConnection *c,
                                  LmMessage *m, gpointer ud)
 {
-  LmMessageNode *y;
-  const char *fjid, *name, *group, *sub, *ask;
+  LmMessageNode *x, *y;
+  const char *fjid, *name, *group, *sub, *ask, *ver;
   char *cleanalias;
   enum subscr esub;
   int need_refresh = FALSE;
   guint roster_type;
 
-  y = lm_message_node_find_child(lm_message_node_find_xmlns(m->node, NS_ROSTER),
-                                 "item");
+  x = lm_message_node_find_xmlns(m->node, NS_ROSTER);
+  y = lm_message_node_find_child(x, "item");
   for ( ; y; y = y->next) {
     char *name_tmp = NULL;
 
@@ -634,6 +635,13 @@ LmHandlerResult handle_iq_roster(LmMessageHandler *h, LmConnection *c,
     g_free(cleanalias);
   }
 
+  // Update the roster cache with the new roster version (XEP-0237)
+  ver = x ? lm_message_node_get_attribute(x, "ver") : NULL;
+  if (lm_message_get_sub_type(m) == LM_MESSAGE_SUB_TYPE_RESULT)
+    roster_cache_received(ver);
+  else
+    roster_cache_push(ver);
+
   // Acknowledge IQ message
   if (lm_message_get_sub_type(m) == LM_MESSAGE_SUB_TYPE_SET) {
     LmMessage *result;
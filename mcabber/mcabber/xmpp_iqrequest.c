@@ -29,6 +29,7 @@
 #include "screen.h"
 #include "utils.h"
 #include "settings.h"
+#include "rostercache.h"
 #include "hooks.h"
 #include "hbuf.h"
 #include "carbons.h"
@@ -179,7 +180,14 @@ void xmpp_iq_request(const char *fulljid, const char *xmlns)
                                     NULL);
   lm_message_node_set_attribute(query, "xmlns", xmlns);
 
-  if (!g_strcmp0(xmlns, NS_PING)) {     // Create handler for ping queries
+  if (!g_strcmp0(xmlns, NS_ROSTER)) {
+    // Send the version of the cached roster (XEP-0237).  Without a cached
+    // version, an empty string asks the server to start versioning.
+    const char *ver = roster_cache_get_version();
+    if (ver || settings_opt_get("roster_cache"))
+      lm_message_node_set_attribute(query, "ver", ver ? ver : "");
+  } else if (!g_strcmp0(xmlns, NS_PING)) {
+    // Create handler for ping queries
     struct timeval *now = g_new(struct timeval, 1);
     gettimeofday(now, NULL);
     data = (gpointer)now;
@@ -204,6 +212,56 @@ void xmpp_iq_request(const char *fulljid, const char *xmlns)
   }
 }
 
+struct roster_sync {
+  GHashTable *received; // Roster items of the roster result
+  GSList *stale;        // JIDs of the other server items
+};
+
+static void roster_find_stale_item(gpointer rosterdata, void *param)
+{
+  struct roster_sync *rs = param;
+
+  if (buddy_getonserverflag(rosterdata) &&
+      !g_hash_table_lookup(rs->received, rosterdata))
+    rs->stale = g_slist_prepend(rs->stale,
+                                g_strdup(buddy_getjid(rosterdata)));
+}
+
+//  roster_remove_stale_items(query)
+// Remove the server items (e.g. loaded from the roster cache) which are
+// not in the full roster result.
+static void roster_remove_stale_items(LmMessageNode *query)
+{
+  struct roster_sync rs;
+  LmMessageNode *y;
+  GSList *sl;
+
+  rs.received = g_hash_table_new(g_direct_hash, g_direct_equal);
+  rs.stale = NULL;
+
+  for (y = lm_message_node_find_child(query, "item"); y; y = y->next) {
+    const char *fjid = lm_message_node_get_attribute(y, "jid");
+    char *bjid;
+    if (!fjid)
+      continue;
+    bjid = jidtodisp(fjid);
+    sl = roster_find(bjid, jidsearch, 0);
+    if (sl)
+      g_hash_table_insert(rs.received, sl->data, sl->data);
+    g_free(bjid);
+  }
+
+  foreach_buddy(ROSTER_TYPE_USER|ROSTER_TYPE_AGENT|ROSTER_TYPE_ROOM,
+                &roster_find_stale_item, &rs);
+  g_hash_table_destroy(rs.received);
+
+  for (sl = rs.stale; sl; sl = g_slist_next(sl)) {
+    roster_del_user(sl->data);
+    g_free(sl->data);
+  }
+  g_slist_free(rs.stale);
+}
+
 //  This callback is reached when mcabber receives the first roster update
 // after the connection.
 static LmHandlerResult cb_roster(LmMessageHandler *h, LmConnection *c,
@@ -217,12 +275,27 @@ static LmHandlerResult cb_roster(LmMessageHandler *h, LmConnection *c,
     return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 
   x = lm_message_node_find_child(m->node, "query");
-  if (!x)
-    return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+  if (!x) {
+    if (!roster_cache_get_version())
+      return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+    // An empty result means the cached roster is up to date,
+    // the changes (if any) will be sent as roster pushes.
+    roster_cache_received(roster_cache_get_version());
+    update_roster = TRUE;
+    hk_postconnect();
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+  }
 
   ns = lm_message_node_get_attribute(x, "xmlns");
-  if (ns && !strcmp(ns, NS_ROSTER))
+  if (ns && !strcmp(ns, NS_ROSTER)) {
+    // The whole roster is loaded at once, the users lists are sorted
+    // and the buddylist is built only once at the end.
+    roster_bulk_begin();
     handle_iq_roster(NULL, c, m, user_data);
+    // This is the full roster, remove the cached items it doesn't contain
+    roster_remove_stale_items(x);
+    roster_bulk_end();
+  }
 
   // Post-login stuff
   hk_postconnect();